@@ -0,0 +1,189 @@
+#include "compile_cache.h"
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <dirent.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+namespace cuda_compiler {
+
+namespace {
+
+const char ENTRY_MAGIC[8] = {'N', 'A', 'N', 'P', 'T', 'X', '0', '1'};
+const char *ENTRY_EXTENSION = ".ptx";
+
+struct EntryHeader {
+  char magic[8];
+  uint64_t key;
+  uint64_t payload_size;
+  uint64_t payload_hash;
+};
+
+const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+const uint64_t FNV_PRIME = 1099511628211ULL;
+
+uint64_t fnv1a(const void *data, size_t size, uint64_t hash = FNV_OFFSET) {
+  const unsigned char *bytes = (const unsigned char *) data;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+// Create a directory and its parents, like mkdir -p
+bool make_dirs(const std::string &path) {
+  for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1)) {
+    std::string prefix = path.substr(0, pos);
+    if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) return false;
+    if (pos == std::string::npos) return true;
+  }
+}
+
+}
+
+CompileCache::CompileCache(const char *cache_dir, size_t max_size): cache_dir(cache_dir), max_size(max_size) {
+  if (!make_dirs(this->cache_dir)) {
+    std::cerr << "[Compile cache] Unable to create cache directory " << cache_dir << '\n';
+  }
+}
+
+std::string CompileCache::entry_path(uint64_t key) const {
+  char name[17];
+  snprintf(name, sizeof(name), "%016llx", (unsigned long long) key);
+  return cache_dir + "/" + name + ENTRY_EXTENSION;
+}
+
+uint64_t CompileCache::make_key(const char *source, size_t source_size,
+    const std::vector<std::string> &options, int version_major, int version_minor) {
+  // Separators keep ("ab", "c") and ("a", "bc") from hashing to the same key
+  const char separator = '\0';
+  uint64_t hash = fnv1a(source, source_size);
+  for (const std::string &option: options) {
+    hash = fnv1a(&separator, 1, hash);
+    hash = fnv1a(option.data(), option.size(), hash);
+  }
+  int version[2] = {version_major, version_minor};
+  return fnv1a(version, sizeof(version), hash);
+}
+
+bool CompileCache::load(uint64_t key, char **data, size_t *size) {
+  std::string path = entry_path(key);
+  std::ifstream input_file(path.c_str(), std::ifstream::in | std::ifstream::binary | std::ifstream::ate);
+  if (!input_file.is_open()) return false;
+
+  size_t file_size = (size_t) input_file.tellg();
+  input_file.seekg(0, std::ifstream::beg);
+
+  // The size check comes before allocating so a damaged header cannot request a huge payload
+  EntryHeader header;
+  bool valid = file_size >= sizeof(header) &&
+      (bool) input_file.read((char *) &header, sizeof(header)) &&
+      memcmp(header.magic, ENTRY_MAGIC, sizeof(ENTRY_MAGIC)) == 0 &&
+      header.key == key &&
+      header.payload_size == file_size - sizeof(header);
+
+  char *payload = nullptr;
+  if (valid) {
+    payload = new char[header.payload_size];
+    valid = (bool) input_file.read(payload, header.payload_size) &&
+        fnv1a(payload, header.payload_size) == header.payload_hash;
+  }
+  input_file.close();
+
+  if (!valid) {
+    std::cerr << "[Compile cache] Dropping corrupt entry " << path << '\n';
+    delete[] payload;
+    remove(path.c_str());
+    return false;
+  }
+
+  // Refresh the modification time, it is what eviction orders by
+  utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+
+  *data = payload;
+  *size = header.payload_size;
+  return true;
+}
+
+void CompileCache::store(uint64_t key, const char *data, size_t size) {
+  std::string path = entry_path(key);
+  // Write to a private temporary and rename it in place so readers never see a partial entry,
+  // the counter keeps temporaries apart when several threads store the same key
+  static std::atomic<unsigned int> tmp_counter(0);
+  std::string tmp_path = path + ".tmp." + std::to_string(getpid()) + "." + std::to_string(tmp_counter++);
+
+  EntryHeader header;
+  memcpy(header.magic, ENTRY_MAGIC, sizeof(ENTRY_MAGIC));
+  header.key = key;
+  header.payload_size = size;
+  header.payload_hash = fnv1a(data, size);
+
+  std::ofstream output_file(tmp_path.c_str(), std::ofstream::out | std::ofstream::binary);
+  bool written = output_file.is_open() &&
+      output_file.write((const char *) &header, sizeof(header)) &&
+      output_file.write(data, size);
+  output_file.close();
+
+  if (!written || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::cerr << "[Compile cache] Unable to store entry " << path << '\n';
+    remove(tmp_path.c_str());
+    return;
+  }
+
+  evict();
+}
+
+void CompileCache::evict() {
+  struct Entry {
+    std::string path;
+    size_t size;
+    struct timespec last_use;
+  };
+
+  DIR *dir = opendir(cache_dir.c_str());
+  if (dir == nullptr) return;
+
+  std::vector<Entry> entries;
+  size_t total_size = 0;
+  size_t extension_size = strlen(ENTRY_EXTENSION);
+
+  struct dirent *dir_entry;
+  while ((dir_entry = readdir(dir)) != nullptr) {
+    std::string name = dir_entry->d_name;
+    if (name.size() <= extension_size ||
+        name.compare(name.size() - extension_size, extension_size, ENTRY_EXTENSION) != 0) {
+      continue;
+    }
+
+    std::string path = cache_dir + "/" + name;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+    entries.push_back({path, (size_t) st.st_size, st.st_mtim});
+    total_size += st.st_size;
+  }
+  closedir(dir);
+
+  if (total_size <= max_size) return;
+
+  std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+    if (a.last_use.tv_sec != b.last_use.tv_sec) return a.last_use.tv_sec < b.last_use.tv_sec;
+    return a.last_use.tv_nsec < b.last_use.tv_nsec;
+  });
+
+  for (const Entry &entry: entries) {
+    if (total_size <= max_size) break;
+    if (remove(entry.path.c_str()) == 0) {
+      total_size -= entry.size;
+    }
+  }
+}
+
+}
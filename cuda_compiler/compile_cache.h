@@ -0,0 +1,53 @@
+#ifndef COMPILE_CACHE_H
+#define COMPILE_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace cuda_compiler {
+
+/*! \brief A persistent, content-addressed cache of compiled kernels.
+ * Entries live in a single directory, one file per key, named after the key in hex.
+ * Each entry starts with a header holding the key, the payload size and a payload hash,
+ * entries that do not match their header are considered corrupt, removed and rebuilt.
+ * The directory is kept under max_size bytes by evicting the least recently used entries,
+ * recency is tracked through the file modification time, which is refreshed on every hit.
+ */
+class CompileCache {
+private:
+  std::string cache_dir;
+  size_t max_size;
+
+  std::string entry_path(uint64_t key) const;
+  void evict();
+
+public:
+  static const size_t DEFAULT_MAX_SIZE = 256 * 1024 * 1024;
+
+  CompileCache(const char *cache_dir, size_t max_size = DEFAULT_MAX_SIZE);
+  ~CompileCache() {}
+
+  /*! \brief Compute the key for a compilation.
+   * Covers the source text, every compile option and the compiler version,
+   * included headers are passed as options, by name and contents.
+   */
+  static uint64_t make_key(const char *source, size_t source_size,
+      const std::vector<std::string> &options, int version_major, int version_minor);
+
+  /*! \brief Look up an entry.
+   * \note Allocates memory for data with new[] on a hit
+   * \return true on a hit, false if the entry is missing, stale or corrupt
+   */
+  bool load(uint64_t key, char **data, size_t *size);
+
+  /*! \brief Store an entry and evict old entries if the cache grew past its size cap.
+   * Failing to store is not an error, the entry is simply not cached.
+   */
+  void store(uint64_t key, const char *data, size_t size);
+};
+
+}
+
+#endif
@@ -1,36 +1,229 @@
 #include <iostream>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <dirent.h>
+#include <sys/stat.h>
 #include "cuda_compiler.h"
 
+static void print_usage() {
+  printf("Arguments: <kernel_path> <(opt)output_path>\n");
+  printf("       or: [-o output_dir] [-j jobs] [-c cache_dir] [-p profile] [-a arch] [-X option]... [--cubin]\n");
+  printf("           [-I include_dir]... [-l library_path]... <kernel_path|kernel_dir>...\n");
+  printf("  -p  precise (default), fast-math, debug or max-opt\n");
+  printf("  -a  --gpu-architecture, e.g. compute_80 or sm_80, native for the architecture of device 0\n");
+  printf("  -X  extra NVRTC option, may be repeated\n");
+  printf("  -I  directory included headers are looked up in, may be repeated. Headers are read once per run\n");
+  printf("  -l  device code shared by the kernels, may be repeated. Every source is compiled with -rdc=true\n");
+  printf("      and each kernel is linked with the libraries into a CUBIN\n");
+  printf("  --cubin  emit SASS for the architecture instead of PTX\n");
+}
+
+static bool is_directory(const std::string &path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static bool has_cu_extension(const std::string &path) {
+  return path.size() > 3 && path.compare(path.size() - 3, 3, ".cu") == 0;
+}
+
+// Output name for a kernel: its file name without directory and extension
+static std::string output_name(const std::string &kernel_path) {
+  size_t from = kernel_path.find_last_of("/") + 1;
+  size_t to = kernel_path.find_last_of(".") - from;
+  return kernel_path.substr(from, to);
+}
+
+// Append every .cu file in a directory, sorted so the output order is stable
+static void add_directory(const std::string &dir_path, std::vector<std::string> &kernel_paths) {
+  DIR *dir = opendir(dir_path.c_str());
+  if (dir == nullptr) {
+    printf("[Cuda compiler] Error, unable to open directory %s\n", dir_path.c_str());
+    exit(1);
+  }
+
+  std::vector<std::string> found;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    std::string name = entry->d_name;
+    if (has_cu_extension(name)) found.push_back(dir_path + "/" + name);
+  }
+  closedir(dir);
+
+  std::sort(found.begin(), found.end());
+  kernel_paths.insert(kernel_paths.end(), found.begin(), found.end());
+}
+
+// Compile the libraries once, as relocatable images every kernel is linked with
+static std::vector<cuda_compiler::CompileJob> compile_libraries(cuda_compiler::CudaCompiler &cuda_compiler,
+    const std::vector<std::string> &library_paths, unsigned int jobs) {
+  std::vector<cuda_compiler::CompileJob> library_jobs;
+  for (const std::string &library_path: library_paths) {
+    library_jobs.emplace_back(library_path);
+  }
+
+  std::cout << "[Cuda compiler] Compiling " << library_jobs.size() << " libraries" << std::endl;
+  bool success = cuda_compiler.compile_batch(library_jobs, jobs);
+  for (cuda_compiler::CompileJob &job: library_jobs) {
+    std::cout << "[Cuda compiler] " << job.source_path << ":\n" << job.log;
+  }
+  if (!success) {
+    std::cout << "[Cuda compiler] Error, libraries failed to compile" << std::endl;
+    exit(1);
+  }
+  return library_jobs;
+}
+
+// Link a relocatable kernel image with the libraries and save the CUBIN
+static void link_and_save(cuda_compiler::CudaCompiler &cuda_compiler, const std::string &kernel_path,
+    const char *image, size_t image_size, const std::vector<cuda_compiler::CompileJob> &libraries,
+    const std::string &output_path) {
+  cuda_compiler::OutputFormat format = cuda_compiler.get_options().output;
+  std::vector<cuda_compiler::LinkInput> link_inputs;
+  link_inputs.push_back({image, image_size, format, kernel_path});
+  for (const cuda_compiler::CompileJob &library: libraries) {
+    link_inputs.push_back({library.ptx, library.ptx_size, format, library.source_path});
+  }
+
+  char *cubin;
+  size_t cubin_size;
+  cuda_compiler.link(link_inputs, &cubin, &cubin_size);
+  cuda_compiler.save_image_to_file(cubin, cubin_size, output_path.c_str());
+  delete[] cubin;
+}
+
 int main(int argc, char **argv) {
-    if(argc < 2) {
-        printf("[Cuda compiler] Error, bad arguments\n");
-        printf("Arguments: <kernel_path> <(opt)output_path>\n");
-        exit(1);
-    }
+  std::string output_dir;
+  std::string cache_dir;
+  unsigned int jobs = 0;
+  cuda_compiler::CompileOptions options;
+  std::vector<std::string> library_paths;
+  std::vector<std::string> include_dirs;
+  std::vector<std::string> inputs;
 
-    std::string kernel_path = argv[1];
-    std::string output_path;
-    if(argc > 2) {
-        output_path = argv[2];
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if ((arg == "-o" || arg == "-j" || arg == "-c" || arg == "-p" || arg == "-a" || arg == "-X" || arg == "-l" || arg == "-I") && i + 1 < argc) {
+      std::string value = argv[++i];
+      if (arg == "-o") output_dir = value;
+      else if (arg == "-j") jobs = std::atoi(value.c_str());
+      else if (arg == "-a") options.architecture = value;
+      else if (arg == "-X") options.extra_options.push_back(value);
+      else if (arg == "-l") library_paths.push_back(value);
+      else if (arg == "-I") include_dirs.push_back(value);
+      else if (arg == "-c") cache_dir = value;
+      else if (!cuda_compiler::parse_compile_profile(value, &options.profile)) {
+        printf("[Cuda compiler] Error, unknown profile %s\n", value.c_str());
+        print_usage();
+        exit(1);
+      }
+    } else if (arg == "--cubin") {
+      options.output = cuda_compiler::OUTPUT_CUBIN;
+    } else if (arg[0] == '-') {
+      printf("[Cuda compiler] Error, bad arguments\n");
+      print_usage();
+      exit(1);
     } else {
-        size_t from = kernel_path.find_last_of("/") + 1;
-        size_t to = kernel_path.find_last_of(".") - from;
-        output_path = kernel_path.substr(from, to);
+      inputs.push_back(arg);
     }
-    
-    std::cout << "[Cuda compiler] Compiling: " << kernel_path << " to " << output_path << std::endl;
+  }
 
-    // Initialize cuda compiler
-    cuda_compiler::CudaCompiler cuda_compiler;
+  if(inputs.empty()) {
+    printf("[Cuda compiler] Error, bad arguments\n");
+    print_usage();
+    exit(1);
+  }
 
-    // Compile the file to a PTX
-    char *ptx;
-    cuda_compiler.compile_to_ptx(kernel_path.c_str(), &ptx);
+  // Initialize cuda compiler
+  std::unique_ptr<cuda_compiler::CudaCompiler> cuda_compiler(cache_dir.empty() ?
+      new cuda_compiler::CudaCompiler() : new cuda_compiler::CudaCompiler(cache_dir.c_str()));
+  options.relocatable = !library_paths.empty();
+  cuda_compiler->set_options(options);
+  for (const std::string &include_dir: include_dirs) {
+    cuda_compiler->get_header_registry().add_include_path(include_dir);
+  }
+
+  std::vector<cuda_compiler::CompileJob> libraries;
+  if (!library_paths.empty()) libraries = compile_libraries(*cuda_compiler, library_paths, jobs);
+
+  // Single kernel with an explicit output path
+  bool single = argc == 3 && inputs.size() == 2 && !has_cu_extension(inputs[1]) && !is_directory(inputs[1]);
+  if (inputs.size() == 1 && !is_directory(inputs[0])) single = true;
 
-    // Save the PTX file
-    cuda_compiler.save_ptx_to_file(ptx, output_path.c_str());
+  if (single) {
+    std::string kernel_path = inputs[0];
+    std::string output_path = inputs.size() > 1 ? inputs[1] : output_name(kernel_path);
+    if (!output_dir.empty()) output_path = output_dir + "/" + output_path;
+
+    std::cout << "[Cuda compiler] Compiling: " << kernel_path << " to " << output_path << std::endl;
+
+    char *ptx;
+    if (!libraries.empty()) {
+      // Compile the file to a relocatable image, then link it with the libraries
+      size_t image_size;
+      cuda_compiler->compile_relocatable(kernel_path.c_str(), &ptx, &image_size);
+      link_and_save(*cuda_compiler, kernel_path, ptx, image_size, libraries, output_path);
+    } else if (options.output == cuda_compiler::OUTPUT_CUBIN) {
+      // Compile the file to a CUBIN and save it
+      size_t cubin_size;
+      cuda_compiler->compile_to_cubin(kernel_path.c_str(), &ptx, &cubin_size);
+      cuda_compiler->save_image_to_file(ptx, cubin_size, output_path.c_str());
+    } else {
+      // Compile the file to a PTX and save it
+      cuda_compiler->compile_to_ptx(kernel_path.c_str(), &ptx);
+      cuda_compiler->save_ptx_to_file(ptx, output_path.c_str());
+    }
 
     std::cout << "[Cuda compiler] Compilation complete" << std::endl;
 
     delete[] ptx;
+    for (cuda_compiler::CompileJob &library: libraries) {
+      delete[] library.ptx;
+    }
+    return 0;
+  }
+
+  // Batch of kernels, compiled concurrently
+  std::vector<std::string> kernel_paths;
+  for (const std::string &input: inputs) {
+    if (is_directory(input)) add_directory(input, kernel_paths);
+    else kernel_paths.push_back(input);
+  }
+
+  std::vector<cuda_compiler::CompileJob> compile_jobs;
+  for (const std::string &kernel_path: kernel_paths) {
+    compile_jobs.emplace_back(kernel_path);
+  }
+
+  std::cout << "[Cuda compiler] Compiling " << compile_jobs.size() << " kernels" << std::endl;
+  bool success = cuda_compiler->compile_batch(compile_jobs, jobs);
+
+  int failed = 0;
+  for (cuda_compiler::CompileJob &job: compile_jobs) {
+    std::cout << "[Cuda compiler] " << job.source_path << ":\n" << job.log;
+    if (!job.success) {
+      ++failed;
+      continue;
+    }
+
+    std::string output_path = output_name(job.source_path);
+    if (!output_dir.empty()) output_path = output_dir + "/" + output_path;
+    if (!libraries.empty()) link_and_save(*cuda_compiler, job.source_path, job.ptx, job.ptx_size, libraries, output_path);
+    else if (options.output == cuda_compiler::OUTPUT_CUBIN) cuda_compiler->save_image_to_file(job.ptx, job.ptx_size, output_path.c_str());
+    else cuda_compiler->save_ptx_to_file(job.ptx, output_path.c_str());
+    delete[] job.ptx;
+  }
+  for (cuda_compiler::CompileJob &library: libraries) {
+    delete[] library.ptx;
+  }
+
+  if (!success) {
+    std::cout << "[Cuda compiler] " << failed << " of " << compile_jobs.size() << " kernels failed" << std::endl;
+    exit(1);
+  }
+
+  std::cout << "[Cuda compiler] Compilation complete" << std::endl;
 }
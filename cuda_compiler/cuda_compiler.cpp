@@ -1,6 +1,12 @@
 #include "cuda_compiler.h"
+#include <atomic>
+#include <chrono>
 #include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
 #include <iostream>
+#include <string.h>
 #include <nvrtc.h>
 #include <cuda.h>
 
@@ -29,14 +35,82 @@
 
 namespace cuda_compiler {
 
-void CudaCompiler::compile_to_ptx(const char *source_path, char **ptx, size_t *ptx_size) {
-  std::cout << "Compiling cuda kernel file [" << source_path << "]...\n";
+bool parse_compile_profile(const std::string &name, CompileProfile *profile) {
+  static const char *names[] = {"precise", "fast-math", "debug", "max-opt"};
+  for (int i = PROFILE_PRECISE; i <= PROFILE_MAX_OPT; ++i) {
+    if (name == names[i]) {
+      *profile = (CompileProfile) i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Real architecture of device 0, looked up once
+static const std::string &native_architecture() {
+  static const std::string architecture = []() {
+    CUdevice device;
+    int major, minor;
+    CUDA_SAFE_CALL(cuInit(0));
+    CUDA_SAFE_CALL(cuDeviceGet(&device, 0));
+    CUDA_SAFE_CALL(cuDeviceGetAttribute(&major, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR, device));
+    CUDA_SAFE_CALL(cuDeviceGetAttribute(&minor, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR, device));
+    return "sm_" + std::to_string(major * 10 + minor);
+  }();
+  return architecture;
+}
+
+std::vector<std::string> CompileOptions::to_nvrtc_options() const {
+  std::vector<std::string> nvrtc_options;
+  switch (profile) {
+    case PROFILE_PRECISE:
+      // Division and square root are IEEE compliant by default, the single option keeps existing cache keys
+      nvrtc_options = {"--fmad=false"};
+      break;
+    case PROFILE_FAST_MATH:
+      nvrtc_options = {"--use_fast_math"};
+      break;
+    case PROFILE_DEBUG:
+      nvrtc_options = {"--device-debug", "--generate-line-info"};
+      break;
+    case PROFILE_MAX_OPT:
+      nvrtc_options = {"--fmad=true", "--extra-device-vectorization"};
+      break;
+  }
+
+  if (architecture == "native") nvrtc_options.push_back("--gpu-architecture=" + native_architecture());
+  else if (!architecture.empty()) nvrtc_options.push_back("--gpu-architecture=" + architecture);
+  if (relocatable) nvrtc_options.push_back("--relocatable-device-code=true");
+
+  nvrtc_options.insert(nvrtc_options.end(), extra_options.begin(), extra_options.end());
+  return nvrtc_options;
+}
+
+CudaCompiler::CudaCompiler(const char *cache_dir, size_t cache_max_size):
+  cache(new CompileCache(cache_dir, cache_max_size)) {}
+
+bool CudaCompiler::compile_source(const char *source_path, const CompileOptions &source_options, char **ptx, size_t *ptx_size, std::string *log) {
+  // Compilation options, SASS can only be generated for a real architecture
+  OutputFormat output = source_options.output;
+  CompileOptions resolved_options = source_options;
+  if (output == OUTPUT_CUBIN && resolved_options.architecture.empty()) resolved_options.architecture = "native";
+  if (output == OUTPUT_CUBIN && resolved_options.architecture.compare(0, 3, "sm_") != 0 &&
+      resolved_options.architecture != "native") {
+    *log += "CUBIN output needs a real architecture (sm_XX), not " + resolved_options.architecture + "\n";
+    return false;
+  }
+  std::vector<std::string> opt_strings = resolved_options.to_nvrtc_options();
+  std::vector<const char *> opts;
+  for (const std::string &opt: opt_strings) {
+    opts.push_back(opt.c_str());
+  }
+
   // Read kernel file
   std::ifstream input_file(source_path, std::ifstream::in | std::ifstream::ate);
 
   if (!input_file.is_open()) {
-    std::cerr << "Unable to open file\n";
-    exit(1);
+    *log += "Unable to open file\n";
+    return false;
   }
 
   size_t input_size = (size_t)input_file.tellg();
@@ -48,47 +122,296 @@ void CudaCompiler::compile_to_ptx(const char *source_path, char **ptx, size_t *p
 
   kernel_string[input_size] = '\x0';
 
+  // Headers the source includes, handed to NVRTC from memory, quoted includes are looked up next to the source first
+  std::string source_dir = source_path;
+  size_t slash = source_dir.find_last_of('/');
+  source_dir = slash == std::string::npos ? "." : source_dir.substr(0, slash);
+  std::vector<ResolvedHeader> includes = headers.resolve_includes(kernel_string, input_size, source_dir);
+
+  std::vector<const char *> header_contents;
+  std::vector<const char *> header_names;
+  std::vector<std::string> header_paths;
+  for (const ResolvedHeader &include: includes) {
+    header_contents.push_back(include.header->contents.c_str());
+    header_names.push_back(include.include_name.c_str());
+    header_paths.push_back(include.header->path);
+  }
+  {
+    std::lock_guard<std::mutex> lock(dependencies_mutex);
+    dependencies[source_path] = header_paths;
+  }
+
+  // Look for a previous compilation of the same source, headers, options and compiler version
+  uint64_t cache_key = 0;
+  if (cache) {
+    int nvrtc_major, nvrtc_minor;
+    NVRTC_SAFE_CALL(nvrtcVersion(&nvrtc_major, &nvrtc_minor));
+    // The output format is part of the key, PTX and CUBIN of the same source are different entries
+    std::vector<std::string> key_options = opt_strings;
+    key_options.push_back(output == OUTPUT_CUBIN ? "cubin" : "ptx");
+    for (const ResolvedHeader &include: includes) {
+      key_options.push_back(include.include_name);
+      key_options.push_back(include.header->contents);
+    }
+    cache_key = CompileCache::make_key(kernel_string, input_size, key_options, nvrtc_major, nvrtc_minor);
+
+    if (cache->load(cache_key, ptx, ptx_size)) {
+      ++cache_hit_count;
+      *log += "Loaded from compile cache\n";
+      delete[] kernel_string;
+      return true;
+    }
+  }
+
   // Create nvrtc program for compilation
   nvrtcProgram prog;
   // TODO Check if program name (3rd param) is needed, "default_program" is used when null.
   NVRTC_SAFE_CALL(
-      nvrtcCreateProgram(&prog, kernel_string, NULL, 0, NULL, NULL) 
+      nvrtcCreateProgram(&prog, kernel_string, NULL, (int) includes.size(), header_contents.data(), header_names.data())
   );
 
   delete[] kernel_string;
 
-  // Compilation options
-  const char *opts[] = {"--fmad=false"};
   // Compile the program
-  nvrtcResult compile_result = nvrtcCompileProgram(prog, 1, opts);
+  std::chrono::steady_clock::time_point compile_start = std::chrono::steady_clock::now();
+  nvrtcResult compile_result = nvrtcCompileProgram(prog, (int) opts.size(), opts.data());
+  uint64_t compile_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - compile_start).count();
+
+  ++compilation_count;
+  total_compile_ns += compile_ns;
+  uint64_t max_ns = max_compile_ns.load();
+  while (compile_ns > max_ns && !max_compile_ns.compare_exchange_weak(max_ns, compile_ns)) {}
 
   // Get compilation log
   size_t log_size;
   NVRTC_SAFE_CALL(
     nvrtcGetProgramLogSize(prog, &log_size)
   );
-  char *log = new char[log_size];
-  NVRTC_SAFE_CALL(nvrtcGetProgramLog(prog, log));
-  std::cout << log;
-  delete[] log;
+  char *program_log = new char[log_size];
+  NVRTC_SAFE_CALL(nvrtcGetProgramLog(prog, program_log));
+  *log += program_log;
+  delete[] program_log;
 
   if (compile_result != NVRTC_SUCCESS) {
-    exit(1);
+    ++failure_count;
+    NVRTC_SAFE_CALL(nvrtcDestroyProgram(&prog));
+    return false;
   }
-  std::cout << "Compilation successful\n";
+  *log += "Compilation successful\n";
 
-  // Get PTX from the program
-  size_t _ptx_size;
-  NVRTC_SAFE_CALL(nvrtcGetPTXSize(prog, &_ptx_size));
-  *ptx = new char[_ptx_size];
-  NVRTC_SAFE_CALL(nvrtcGetPTX(prog, *ptx));
+  // Get PTX or SASS from the program
+  if (output == OUTPUT_CUBIN) {
+    NVRTC_SAFE_CALL(nvrtcGetCUBINSize(prog, ptx_size));
+    *ptx = new char[*ptx_size];
+    NVRTC_SAFE_CALL(nvrtcGetCUBIN(prog, *ptx));
+  } else {
+    NVRTC_SAFE_CALL(nvrtcGetPTXSize(prog, ptx_size));
+    *ptx = new char[*ptx_size];
+    NVRTC_SAFE_CALL(nvrtcGetPTX(prog, *ptx));
+  }
 
   // Destroy the program
   NVRTC_SAFE_CALL(nvrtcDestroyProgram(&prog));
 
+  if (cache) cache->store(cache_key, *ptx, *ptx_size);
+
+  return true;
+}
+
+void CudaCompiler::compile_to_ptx(const char *source_path, char **ptx, size_t *ptx_size) {
+  std::cout << "Compiling cuda kernel file [" << source_path << "]...\n";
+
+  std::string log;
+  size_t _ptx_size;
+  CompileOptions ptx_options = options;
+  ptx_options.output = OUTPUT_PTX;
+  bool success = compile_source(source_path, ptx_options, ptx, &_ptx_size, &log);
+  std::cout << log;
+
+  if (!success) {
+    exit(1);
+  }
+
   if (ptx_size != nullptr) *ptx_size = _ptx_size;
 }
 
+void CudaCompiler::compile_to_cubin(const char *source_path, char **cubin, size_t *cubin_size) {
+  std::cout << "Compiling cuda kernel file [" << source_path << "] to CUBIN...\n";
+
+  std::string log;
+  CompileOptions cubin_options = options;
+  cubin_options.output = OUTPUT_CUBIN;
+  bool success = compile_source(source_path, cubin_options, cubin, cubin_size, &log);
+  std::cout << log;
+
+  if (!success) {
+    exit(1);
+  }
+}
+
+void CudaCompiler::compile_relocatable(const char *source_path, char **image, size_t *image_size) {
+  std::cout << "Compiling cuda kernel file [" << source_path << "] to relocatable code...\n";
+
+  std::string log;
+  CompileOptions relocatable_options = options;
+  relocatable_options.relocatable = true;
+  bool success = compile_source(source_path, relocatable_options, image, image_size, &log);
+  std::cout << log;
+
+  if (!success) {
+    exit(1);
+  }
+}
+
+bool CudaCompiler::link_images(const std::vector<LinkInput> &inputs, char **cubin, size_t *cubin_size, std::string *log) {
+  // The linker targets the device of the current context, the primary context of device 0 stands in when there is none
+  CUDA_SAFE_CALL(cuInit(0));
+  CUcontext context;
+  CUdevice device;
+  CUDA_SAFE_CALL(cuCtxGetCurrent(&context));
+  bool own_context = context == nullptr;
+  if (own_context) {
+    CUDA_SAFE_CALL(cuDeviceGet(&device, 0));
+    CUDA_SAFE_CALL(cuDevicePrimaryCtxRetain(&context, device));
+    CUDA_SAFE_CALL(cuCtxSetCurrent(context));
+  } else {
+    CUDA_SAFE_CALL(cuCtxGetDevice(&device));
+  }
+
+  // Look for a previous link of the same images for the same architecture and driver
+  uint64_t cache_key = 0;
+  bool linked = false;
+  if (cache) {
+    int major, minor, driver_version;
+    CUDA_SAFE_CALL(cuDeviceGetAttribute(&major, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR, device));
+    CUDA_SAFE_CALL(cuDeviceGetAttribute(&minor, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR, device));
+    CUDA_SAFE_CALL(cuDriverGetVersion(&driver_version));
+
+    std::vector<std::string> key_parts = {"link", "sm_" + std::to_string(major * 10 + minor)};
+    for (const LinkInput &input: inputs) {
+      key_parts.push_back(input.format == OUTPUT_CUBIN ? "cubin" : "ptx");
+      key_parts.push_back(std::string(input.data, input.size));
+    }
+    cache_key = CompileCache::make_key("", 0, key_parts, driver_version / 1000, driver_version % 1000 / 10);
+
+    if (cache->load(cache_key, cubin, cubin_size)) {
+      ++cache_hit_count;
+      *log += "Loaded link from compile cache\n";
+      linked = true;
+    }
+  }
+
+  if (!linked) {
+    char error_log[8192] = "";
+    char info_log[8192] = "";
+    CUjit_option link_options[] = {
+      CU_JIT_ERROR_LOG_BUFFER, CU_JIT_ERROR_LOG_BUFFER_SIZE_BYTES,
+      CU_JIT_INFO_LOG_BUFFER, CU_JIT_INFO_LOG_BUFFER_SIZE_BYTES
+    };
+    void *link_values[] = {
+      error_log, (void *) sizeof(error_log),
+      info_log, (void *) sizeof(info_log)
+    };
+
+    CUlinkState link_state;
+    CUDA_SAFE_CALL(cuLinkCreate(4, link_options, link_values, &link_state));
+
+    CUresult result = CUDA_SUCCESS;
+    for (const LinkInput &input: inputs) {
+      CUjitInputType type = input.format == OUTPUT_CUBIN ? CU_JIT_INPUT_CUBIN : CU_JIT_INPUT_PTX;
+      result = cuLinkAddData(link_state, type, (void *) input.data, input.size, input.name.c_str(), 0, nullptr, nullptr);
+      if (result != CUDA_SUCCESS) break;
+    }
+
+    void *linked_cubin;
+    size_t linked_size;
+    if (result == CUDA_SUCCESS) result = cuLinkComplete(link_state, &linked_cubin, &linked_size);
+    ++link_count;
+
+    *log += info_log;
+    *log += error_log;
+    if (result == CUDA_SUCCESS) {
+      // The image is owned by the link state
+      *cubin_size = linked_size;
+      *cubin = new char[linked_size];
+      memcpy(*cubin, linked_cubin, linked_size);
+      *log += "Link successful\n";
+      if (cache) cache->store(cache_key, *cubin, *cubin_size);
+      linked = true;
+    } else {
+      ++failure_count;
+    }
+    CUDA_SAFE_CALL(cuLinkDestroy(link_state));
+  }
+
+  if (own_context) {
+    CUDA_SAFE_CALL(cuCtxSetCurrent(nullptr));
+    CUDA_SAFE_CALL(cuDevicePrimaryCtxRelease(device));
+  }
+  return linked;
+}
+
+void CudaCompiler::link(const std::vector<LinkInput> &inputs, char **cubin, size_t *cubin_size) {
+  std::cout << "Linking " << inputs.size() << " images...\n";
+
+  std::string log;
+  bool success = link_images(inputs, cubin, cubin_size, &log);
+  std::cout << log;
+
+  if (!success) {
+    exit(1);
+  }
+}
+
+bool CudaCompiler::compile_batch(std::vector<CompileJob> &jobs, unsigned int worker_count) {
+  if (worker_count == 0) worker_count = std::thread::hardware_concurrency();
+  if (worker_count == 0) worker_count = 1;
+  if (worker_count > jobs.size()) worker_count = jobs.size();
+
+  // Workers pull the next job from a shared index until every job is taken
+  std::atomic<size_t> next_job(0);
+  auto worker = [&]() {
+    for (size_t i = next_job++; i < jobs.size(); i = next_job++) {
+      CompileJob &job = jobs[i];
+      job.success = compile_source(job.source_path.c_str(), options, &job.ptx, &job.ptx_size, &job.log);
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned int i = 1; i < worker_count; ++i) {
+    workers.emplace_back(worker);
+  }
+  worker(); // The calling thread takes part as well
+  for (std::thread &t: workers) {
+    t.join();
+  }
+
+  bool all_successful = true;
+  for (const CompileJob &job: jobs) {
+    all_successful = all_successful && job.success;
+  }
+  return all_successful;
+}
+
+std::vector<std::string> CudaCompiler::get_dependencies(const char *source_path) {
+  std::lock_guard<std::mutex> lock(dependencies_mutex);
+  std::map<std::string, std::vector<std::string>>::iterator it = dependencies.find(source_path);
+  if (it == dependencies.end()) return std::vector<std::string>();
+  return it->second;
+}
+
+CompileStats CudaCompiler::get_stats() const {
+  CompileStats stats;
+  stats.compilations = compilation_count;
+  stats.failures = failure_count;
+  stats.cache_hits = cache_hit_count;
+  stats.links = link_count;
+  stats.total_compile_ms = total_compile_ns / 1e6;
+  stats.max_compile_ms = max_compile_ns / 1e6;
+  return stats;
+}
+
 void CudaCompiler::save_ptx_to_file(const char *ptx, const char *output_path) {
   std::ofstream output_file(output_path);
   
@@ -101,6 +424,18 @@ void CudaCompiler::save_ptx_to_file(const char *ptx, const char *output_path) {
   output_file.close();
 }
 
+void CudaCompiler::save_image_to_file(const char *image, size_t image_size, const char *output_path) {
+  std::ofstream output_file(output_path, std::ofstream::out | std::ofstream::binary);
+
+  if (!output_file) {
+    std::cerr << "Unable to create file\n";
+    exit(1);
+  }
+
+  output_file.write(image, image_size);
+  output_file.close();
+}
+
 char *CudaCompiler::read_ptx_from_file(const char *ptx_path) {
   std::ifstream input_file(ptx_path, std::ifstream::in | std::ifstream::ate);
 
@@ -1,16 +1,146 @@
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "compile_cache.h"
+#include "header_registry.h"
 
 namespace cuda_compiler {
 
+// Named sets of NVRTC options
+enum CompileProfile {
+  PROFILE_PRECISE,   // No contraction into fused multiply-adds, IEEE division and square root
+  PROFILE_FAST_MATH, // --use_fast_math, approximate division, square root and transcendentals
+  PROFILE_DEBUG,     // Device debug information, optimizations off
+  PROFILE_MAX_OPT    // Fused multiply-adds and extra vectorization
+};
+
+enum OutputFormat {
+  OUTPUT_PTX,  // JIT compiled by the driver when the module is loaded
+  OUTPUT_CUBIN // SASS for a single architecture, loaded as is
+};
+
+/*! \brief How sources are compiled.
+ * architecture is passed as --gpu-architecture, either a virtual (compute_80) or a real (sm_80) one.
+ * "native" stands for the real architecture of device 0, empty leaves the NVRTC default.
+ * CUBIN output needs a real architecture.
+ */
+struct CompileOptions {
+  CompileProfile profile = PROFILE_PRECISE;
+  std::string architecture;
+  OutputFormat output = OUTPUT_PTX;
+  bool relocatable = false; // -rdc=true, the image has to be linked before it can be loaded
+  std::vector<std::string> extra_options; // Appended after the profile options, so they can override them
+
+  // Full NVRTC option list, with "native" resolved
+  std::vector<std::string> to_nvrtc_options() const;
+};
+
+// Profile by name (precise, fast-math, debug, max-opt), \return false if the name is unknown
+bool parse_compile_profile(const std::string &name, CompileProfile *profile);
+
+// A relocatable image handed to the linker
+struct LinkInput {
+  const char *data;
+  size_t size;
+  OutputFormat format;
+  std::string name; // Shown in link errors
+};
+
+/*! \brief A single source to compile as part of a batch.
+ */
+struct CompileJob {
+  std::string source_path;
+  char *ptx = nullptr; // PTX or CUBIN as the options say, allocated with new[] on success, owned by the caller
+  size_t ptx_size = 0;
+  bool success = false;
+  std::string log; // Compilation log, kept per job so concurrent compilations do not interleave
+
+  CompileJob(const std::string &source_path): source_path(source_path) {}
+};
+
+// Compilations made by a CudaCompiler, times are wall time spent in NVRTC
+struct CompileStats {
+  uint64_t compilations;  // Sources compiled by NVRTC, successfully or not
+  uint64_t failures;
+  uint64_t cache_hits;    // Sources loaded from the compile cache instead
+  uint64_t links;         // Link steps run by the driver, cached links are counted as cache hits
+  double total_compile_ms;
+  double max_compile_ms;
+};
+
 /*! \brief A class for cuda kernel compilation.
  */
 class CudaCompiler {
+private:
+  std::unique_ptr<CompileCache> cache;
+  CompileOptions options;
+  HeaderRegistry headers;
+
+  std::mutex dependencies_mutex;
+  std::map<std::string, std::vector<std::string>> dependencies; // Header paths of each source, from its last compilation
+
+  std::atomic<uint64_t> compilation_count{0};
+  std::atomic<uint64_t> failure_count{0};
+  std::atomic<uint64_t> cache_hit_count{0};
+  std::atomic<uint64_t> link_count{0};
+  std::atomic<uint64_t> total_compile_ns{0};
+  std::atomic<uint64_t> max_compile_ns{0};
+
+  // Compile a single source, returns false instead of exiting on failure, safe to call concurrently
+  bool compile_source(const char *source_path, const CompileOptions &source_options, char **ptx, size_t *ptx_size, std::string *log);
+  // Link relocatable images, returns false instead of exiting on failure
+  bool link_images(const std::vector<LinkInput> &inputs, char **cubin, size_t *cubin_size, std::string *log);
+
 public:
   CudaCompiler() {}
+  /*! \brief Compiler backed by a persistent compile cache.
+   * \param cache_dir directory holding the cache entries, created if missing
+   * \param cache_max_size size cap of the cache directory in bytes
+   */
+  CudaCompiler(const char *cache_dir, size_t cache_max_size = CompileCache::DEFAULT_MAX_SIZE);
   ~CudaCompiler() {}
+
+  // Options of the following compilations, not to be changed while a compilation is running
+  void set_options(const CompileOptions &options) { this->options = options; }
+  const CompileOptions &get_options() const { return options; }
+
+  /*! \brief Headers handed to every compilation from memory.
+   * The headers a source includes, directly or not, are part of its compile cache key.
+   */
+  HeaderRegistry &get_header_registry() { return headers; }
+  // Files and registered headers the last compilation of source_path included, directly or not
+  std::vector<std::string> get_dependencies(const char *source_path);
+
   void compile_to_ptx(const char *source_path, char **ptx, size_t *ptx_size = nullptr);
+  /*! \brief Compile straight to SASS, modules load without a driver JIT.
+   * Uses the configured architecture, or the one of device 0 when none is set.
+   */
+  void compile_to_cubin(const char *source_path, char **cubin, size_t *cubin_size);
+  /*! \brief Compile with -rdc=true to a PTX or CUBIN image as the options say, for link().
+   * Shared device code is compiled once this way and linked into every kernel using it.
+   */
+  void compile_relocatable(const char *source_path, char **image, size_t *image_size);
+  /*! \brief Link relocatable images into a CUBIN for the device of the current context,
+   * or of device 0 when there is none. The result is cached like compilations are.
+   */
+  void link(const std::vector<LinkInput> &inputs, char **cubin, size_t *cubin_size);
+  /*! \brief Compile several sources concurrently.
+   * NVRTC programs are independent, so each job is compiled on its own worker.
+   * \param worker_count number of worker threads, 0 uses one per core
+   * \return true if every job compiled successfully
+   */
+  bool compile_batch(std::vector<CompileJob> &jobs, unsigned int worker_count = 0);
   void save_ptx_to_file(const char *ptx, const char *output_path);
+  // Save a PTX or CUBIN image as is
+  void save_image_to_file(const char *image, size_t image_size, const char *output_path);
   char *read_ptx_from_file(const char *ptx_path);
+
+  CompileStats get_stats() const;
 };
 
 }
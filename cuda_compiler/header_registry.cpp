@@ -0,0 +1,160 @@
+#include "header_registry.h"
+#include <algorithm>
+#include <fstream>
+#include <set>
+#include <utility>
+#include <sys/stat.h>
+
+namespace cuda_compiler {
+
+namespace {
+
+// Directory part of a path, "." for a bare file name
+std::string dir_name(const std::string &path) {
+  size_t slash = path.find_last_of('/');
+  if (slash == std::string::npos) return ".";
+  if (slash == 0) return "/";
+  return path.substr(0, slash);
+}
+
+bool read_file(const std::string &path, std::string *contents) {
+  std::ifstream input_file(path.c_str(), std::ifstream::in | std::ifstream::binary | std::ifstream::ate);
+  if (!input_file.is_open()) return false;
+
+  size_t file_size = (size_t) input_file.tellg();
+  contents->resize(file_size);
+  input_file.seekg(0, std::ifstream::beg);
+  return file_size == 0 || (bool) input_file.read(&(*contents)[0], file_size);
+}
+
+}
+
+std::vector<std::string> HeaderRegistry::parse_includes(const char *text, size_t size) {
+  std::vector<std::string> includes;
+  const char *end = text + size;
+  for (const char *line = text; line < end; ) {
+    const char *p = line;
+    while (p < end && (*p == ' ' || *p == '\t')) ++p;
+    if (p < end && *p == '#') {
+      ++p;
+      while (p < end && (*p == ' ' || *p == '\t')) ++p;
+      static const char directive[] = "include";
+      size_t directive_size = sizeof(directive) - 1;
+      if ((size_t) (end - p) > directive_size && std::equal(directive, directive + directive_size, p)) {
+        p += directive_size;
+        while (p < end && (*p == ' ' || *p == '\t')) ++p;
+        if (p < end && (*p == '"' || *p == '<')) {
+          char close = *p == '"' ? '"' : '>';
+          const char *name = ++p;
+          while (p < end && *p != close && *p != '\n') ++p;
+          if (p < end && *p == close && p > name) includes.emplace_back(name, p - name);
+        }
+      }
+    }
+
+    // Next line
+    while (p < end && *p != '\n') ++p;
+    line = p + 1;
+  }
+  return includes;
+}
+
+void HeaderRegistry::add_header(const std::string &name, const std::string &contents) {
+  std::shared_ptr<Header> header(new Header);
+  header->path = name;
+  header->contents = contents;
+  header->includes = parse_includes(contents.data(), contents.size());
+  header->from_file = false;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  named[name] = header;
+}
+
+bool HeaderRegistry::add_header_file(const std::string &name, const char *path) {
+  std::shared_ptr<Header> header(new Header);
+  if (!read_file(path, &header->contents)) return false;
+  header->path = path;
+  header->includes = parse_includes(header->contents.data(), header->contents.size());
+  header->dir = dir_name(path);
+  header->from_file = false;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  named[name] = header;
+  return true;
+}
+
+void HeaderRegistry::add_include_path(const std::string &dir) {
+  std::lock_guard<std::mutex> lock(mutex);
+  include_paths.push_back(dir);
+}
+
+std::shared_ptr<const Header> HeaderRegistry::load_file(const std::string &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return nullptr;
+
+  // A stat is all a resident, unchanged header costs
+  std::map<std::string, std::shared_ptr<const Header>>::iterator it = files.find(path);
+  if (it != files.end() && it->second->file_size == st.st_size &&
+      it->second->mtime.tv_sec == st.st_mtim.tv_sec && it->second->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+    return it->second;
+  }
+
+  std::shared_ptr<Header> header(new Header);
+  if (!read_file(path, &header->contents)) return nullptr;
+  header->path = path;
+  header->includes = parse_includes(header->contents.data(), header->contents.size());
+  header->dir = dir_name(path);
+  header->from_file = true;
+  header->mtime = st.st_mtim;
+  header->file_size = st.st_size;
+
+  files[path] = header;
+  return header;
+}
+
+std::shared_ptr<const Header> HeaderRegistry::resolve(const std::string &include_name, const std::string &includer_dir) {
+  std::map<std::string, std::shared_ptr<const Header>>::iterator it = named.find(include_name);
+  if (it != named.end()) return it->second;
+
+  if (!include_name.empty() && include_name[0] == '/') return load_file(include_name);
+
+  std::shared_ptr<const Header> header;
+  if (!includer_dir.empty()) header = load_file(includer_dir + "/" + include_name);
+  for (size_t i = 0; header == nullptr && i < include_paths.size(); ++i) {
+    header = load_file(include_paths[i] + "/" + include_name);
+  }
+  return header;
+}
+
+std::vector<ResolvedHeader> HeaderRegistry::resolve_includes(const char *source, size_t source_size, const std::string &source_dir) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  // Breadth first over include names, each name is resolved once
+  std::map<std::string, ResolvedHeader> found;
+  std::set<std::string> visited;
+  std::vector<std::pair<std::string, std::string>> pending; // Include name and the directory of its includer
+  for (const std::string &include_name: parse_includes(source, source_size)) {
+    pending.emplace_back(include_name, source_dir);
+  }
+
+  for (size_t i = 0; i < pending.size(); ++i) {
+    std::string include_name = pending[i].first;
+    if (!visited.insert(include_name).second) continue;
+
+    std::shared_ptr<const Header> header = resolve(include_name, pending[i].second);
+    if (header == nullptr) continue;
+
+    found[include_name] = ResolvedHeader{include_name, header};
+    for (const std::string &nested: header->includes) {
+      if (visited.count(nested) == 0) pending.emplace_back(nested, header->dir);
+    }
+  }
+
+  std::vector<ResolvedHeader> headers;
+  for (auto &entry: found) {
+    headers.push_back(std::move(entry.second));
+  }
+  return headers;
+}
+
+}
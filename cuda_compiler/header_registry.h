@@ -0,0 +1,75 @@
+#ifndef HEADER_REGISTRY_H
+#define HEADER_REGISTRY_H
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <time.h>
+
+namespace cuda_compiler {
+
+// A memory resident header and the includes found in it
+struct Header {
+  std::string path;                  // File it was read from, or the registered name for headers added from memory
+  std::string contents;
+  std::vector<std::string> includes; // Names of its #include directives, in order
+  std::string dir;                   // Where its includes are looked up first, empty for headers added from memory
+  bool from_file;                    // Found through an include, read again once the file changes
+  struct timespec mtime;
+  off_t file_size;
+};
+
+// A header as handed to NVRTC, under the name the source includes it by
+struct ResolvedHeader {
+  std::string include_name;
+  std::shared_ptr<const Header> header;
+};
+
+/*! \brief Headers shared by every compilation, read once and kept in memory.
+ * Includes are resolved by name against the headers added from memory first, then relative to the
+ * including file and last through the include paths, in the order they were added. Headers found on
+ * disk stay resident and are only read again once their file changes. Includes that resolve to
+ * nothing are left to NVRTC, which knows its builtin headers.
+ * \note Include directives are found by scanning the text, those disabled by the preprocessor are resolved too
+ */
+class HeaderRegistry {
+private:
+  std::mutex mutex; // Guards everything below, headers are immutable once created
+  std::map<std::string, std::shared_ptr<const Header>> named; // Added from memory, by name
+  std::map<std::string, std::shared_ptr<const Header>> files; // Read from disk, by path
+  std::vector<std::string> include_paths;
+
+  // Resident header of a file, read if missing or stale, null if the file cannot be read
+  std::shared_ptr<const Header> load_file(const std::string &path);
+  std::shared_ptr<const Header> resolve(const std::string &include_name, const std::string &includer_dir);
+
+public:
+  HeaderRegistry() {}
+  ~HeaderRegistry() {}
+
+  HeaderRegistry(const HeaderRegistry &) = delete;
+  HeaderRegistry &operator=(const HeaderRegistry &) = delete;
+
+  // Make contents includable as name, replacing a header of the same name
+  void add_header(const std::string &name, const std::string &contents);
+  // Read a file once and make it includable as name, \return false if it cannot be read
+  bool add_header_file(const std::string &name, const char *path);
+  void add_include_path(const std::string &dir);
+
+  /*! \brief Every header source includes, directly or through other headers, sorted by include name.
+   * When the same name resolves to different files from different includers, the first one is kept.
+   * \param source_dir directory of the source, quoted includes are looked up there
+   */
+  std::vector<ResolvedHeader> resolve_includes(const char *source, size_t source_size, const std::string &source_dir);
+
+  // Names of the #include directives of a text, in order
+  static std::vector<std::string> parse_includes(const char *text, size_t size);
+};
+
+}
+
+#endif
@@ -0,0 +1,97 @@
+// Throughput of allocate/write/launch/read/deallocate rounds against the number of submitting threads,
+// all threads share a single CudaApi
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include "cuda_api.h"
+#include "cuda_compiler.h"
+#include "kernel_arguments.h"
+
+#define ROUNDS_PER_THREAD 2000
+#define N 4096
+#define NUM_THREADS 128
+
+const char *KERNEL_NAME = "saxpy";
+const char *KERNEL_PATH = "saxpy.cu";
+
+using namespace cuda_manager;
+
+typedef std::chrono::high_resolution_clock Clock;
+
+static void submit(CudaApi *cuda_api, int kernel_id, int thread_index) {
+  size_t n = N;
+  size_t buffer_size = n * sizeof(float);
+  float a = 2.5f;
+  std::vector<float> x(n, 1.0f), y(n, 2.0f), o(n);
+
+  // Ids private to this thread
+  int xid = thread_index * 3;
+  int yid = xid + 1;
+  int oid = xid + 2;
+
+  char args[sizeof(ScalarArg) * 2 + sizeof(BufferArg) * 3];
+  char *current_arg = args;
+  *(ScalarArg *) current_arg = {SCALAR, &a};  current_arg += sizeof(ScalarArg);
+  *(BufferArg *) current_arg = {BUFFER, xid, true};  current_arg += sizeof(BufferArg);
+  *(BufferArg *) current_arg = {BUFFER, yid, true};  current_arg += sizeof(BufferArg);
+  *(BufferArg *) current_arg = {BUFFER, oid, false}; current_arg += sizeof(BufferArg);
+  *(ScalarArg *) current_arg = {SCALAR, &n};
+
+  CudaResourceArgs r_args = {0, {N / NUM_THREADS, 1, 1}, {NUM_THREADS, 1, 1}};
+
+  for (int round = 0; round < ROUNDS_PER_THREAD; ++round) {
+    cuda_api->allocate_memory(xid, buffer_size);
+    cuda_api->allocate_memory(yid, buffer_size);
+    cuda_api->allocate_memory(oid, buffer_size);
+    cuda_api->write_memory(xid, x.data(), buffer_size);
+    cuda_api->write_memory(yid, y.data(), buffer_size);
+    cuda_api->launch_kernel(kernel_id, r_args, args, 5);
+    cuda_api->read_memory(oid, o.data(), buffer_size);
+    cuda_api->deallocate_memory(xid);
+    cuda_api->deallocate_memory(yid);
+    cuda_api->deallocate_memory(oid);
+  }
+}
+
+int main(void) {
+  CudaApi cuda_api;
+  // Threads use their own buffers and wait for their launches, so launches of different threads may overlap
+  cuda_api.set_concurrent_launches(true);
+  cuda_compiler::CudaCompiler cuda_compiler;
+
+  char *ptx;
+  size_t ptx_size;
+  cuda_compiler.compile_to_ptx(KERNEL_PATH, &ptx, &ptx_size);
+
+  int kernel_id = 0;
+  cuda_api.allocate_kernel(kernel_id, ptx_size);
+  cuda_api.write_kernel(kernel_id, KERNEL_NAME, ptx, ptx_size);
+  delete[] ptx;
+
+  unsigned int max_threads = std::thread::hardware_concurrency();
+  std::vector<double> results;
+  for (unsigned int thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+    Clock::time_point start = Clock::now();
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < thread_count; ++i) {
+      threads.emplace_back(submit, &cuda_api, kernel_id, i);
+    }
+    for (std::thread &thread: threads) {
+      thread.join();
+    }
+
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    results.push_back(thread_count * ROUNDS_PER_THREAD / seconds);
+  }
+
+  printf("%8s %14s %10s\n", "threads", "rounds/s", "speedup");
+  for (size_t i = 0; i < results.size(); ++i) {
+    printf("%8u %14.0f %9.2fx\n", 1u << i, results[i], results[i] / results[0]);
+  }
+
+  cuda_api.deallocate_kernel(kernel_id);
+}
@@ -0,0 +1,102 @@
+// Launch rate of asynchronous launches against the number of submitting threads, with every thread
+// switching contexts itself (CALLER_THREADS) and with calls routed to per device workers (DEVICE_WORKERS).
+// Launches are tiny so the rate is bound by submission overhead.
+
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include "cuda_api.h"
+#include "cuda_compiler.h"
+#include "kernel_arguments.h"
+
+#define LAUNCHES_PER_THREAD 20000
+#define N 256
+
+const char *KERNEL_NAME = "saxpy";
+const char *KERNEL_PATH = "saxpy.cu";
+
+using namespace cuda_manager;
+
+typedef std::chrono::high_resolution_clock Clock;
+
+static void submit(CudaApi *cuda_api, int kernel_id, int thread_index) {
+  size_t n = N;
+  size_t buffer_size = n * sizeof(float);
+  float a = 2.5f;
+
+  // Ids private to this thread
+  int xid = thread_index * 3;
+  int yid = xid + 1;
+  int oid = xid + 2;
+  cuda_api->allocate_memory(xid, buffer_size, 0);
+  cuda_api->allocate_memory(yid, buffer_size, 0);
+  cuda_api->allocate_memory(oid, buffer_size, 0);
+
+  char args[sizeof(ScalarArg) * 2 + sizeof(BufferArg) * 3];
+  char *current_arg = args;
+  *(ScalarArg *) current_arg = {SCALAR, &a};  current_arg += sizeof(ScalarArg);
+  *(BufferArg *) current_arg = {BUFFER, xid, true};  current_arg += sizeof(BufferArg);
+  *(BufferArg *) current_arg = {BUFFER, yid, true};  current_arg += sizeof(BufferArg);
+  *(BufferArg *) current_arg = {BUFFER, oid, false}; current_arg += sizeof(BufferArg);
+  *(ScalarArg *) current_arg = {SCALAR, &n};
+
+  CudaResourceArgs r_args = {0, {1, 1, 1}, {N, 1, 1}};
+
+  CompletionHandlePtr completion;
+  for (int i = 0; i < LAUNCHES_PER_THREAD; ++i) {
+    cuda_api->launch_kernel_async(kernel_id, r_args, args, 5, &completion);
+  }
+  completion->wait();
+
+  cuda_api->deallocate_memory(xid);
+  cuda_api->deallocate_memory(yid);
+  cuda_api->deallocate_memory(oid);
+}
+
+// \return launches/s per thread count, thread counts are powers of two
+static std::vector<double> run(ExecutionModel execution_model, const char *ptx, size_t ptx_size) {
+  CudaApi cuda_api(execution_model);
+
+  int kernel_id = 0;
+  cuda_api.allocate_kernel(kernel_id, ptx_size);
+  cuda_api.write_kernel(kernel_id, KERNEL_NAME, ptx, ptx_size);
+
+  unsigned int max_threads = std::thread::hardware_concurrency();
+  std::vector<double> results;
+  for (unsigned int thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+    Clock::time_point start = Clock::now();
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < thread_count; ++i) {
+      threads.emplace_back(submit, &cuda_api, kernel_id, i);
+    }
+    for (std::thread &thread: threads) {
+      thread.join();
+    }
+
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    results.push_back(thread_count * LAUNCHES_PER_THREAD / seconds);
+  }
+
+  cuda_api.deallocate_kernel(kernel_id);
+  return results;
+}
+
+int main(void) {
+  cuda_compiler::CudaCompiler cuda_compiler;
+
+  char *ptx;
+  size_t ptx_size;
+  cuda_compiler.compile_to_ptx(KERNEL_PATH, &ptx, &ptx_size);
+
+  std::vector<double> caller_threads = run(CALLER_THREADS, ptx, ptx_size);
+  std::vector<double> device_workers = run(DEVICE_WORKERS, ptx, ptx_size);
+  delete[] ptx;
+
+  printf("%8s %20s %20s %10s\n", "threads", "caller (launches/s)", "workers (launches/s)", "speedup");
+  for (size_t i = 0; i < caller_threads.size(); ++i) {
+    printf("%8u %20.0f %20.0f %9.2fx\n", 1u << i, caller_threads[i], device_workers[i],
+        device_workers[i] / caller_threads[i]);
+  }
+}
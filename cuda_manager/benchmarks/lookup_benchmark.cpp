@@ -0,0 +1,78 @@
+// Cost of a buffer lookup by id against the size of the id space, std::map (the previous
+// buffer table) against HandleTable. Runs on the host only.
+
+#include <chrono>
+#include <map>
+#include <random>
+#include <vector>
+#include <stdio.h>
+#include "handle_table.h"
+
+#define LOOKUPS 10000000
+
+using namespace cuda_manager;
+
+typedef std::chrono::high_resolution_clock Clock;
+
+// Same layout as MemoryBuffer, without pulling in the driver headers
+struct Buffer {
+  int id;
+  size_t size;
+  unsigned long long d_ptr;
+  void *context;
+};
+
+template <typename F>
+static double ns_per_lookup(F lookup) {
+  Clock::time_point start = Clock::now();
+  size_t checksum = lookup();
+  double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / LOOKUPS;
+  // Keep the lookups from being optimized away
+  if (checksum == 1) printf(" ");
+  return ns;
+}
+
+int main(void) {
+  std::vector<int> id_space_sizes = {16, 256, 4096, 65536, 1048576};
+  std::mt19937 rng(42);
+
+  printf("%12s %16s %16s\n", "ids", "std::map (ns)", "HandleTable (ns)");
+
+  for (int id_count: id_space_sizes) {
+    std::map<int, Buffer> map;
+    HandleTable<Buffer> table;
+
+    // Sparse ids, as clients pick them
+    std::vector<int> ids;
+    for (int i = 0; i < id_count; ++i) {
+      int id = i * 7 + 3;
+      Buffer buffer = { id, (size_t) i, (unsigned long long) i, nullptr };
+      map.emplace(id, buffer);
+      table.insert(id, buffer);
+      ids.push_back(id);
+    }
+
+    std::vector<int> queries(LOOKUPS);
+    for (int &query: queries) query = ids[rng() % ids.size()];
+
+    double map_ns = ns_per_lookup([&]() {
+      size_t sum = 0;
+      for (int id: queries) {
+        Buffer buffer = map.find(id)->second; // Copy, as get_buffer used to return
+        sum += buffer.d_ptr;
+      }
+      return sum;
+    });
+
+    double table_ns = ns_per_lookup([&]() {
+      size_t sum = 0;
+      for (int id: queries) {
+        const Buffer &buffer = *table.find(id);
+        sum += buffer.d_ptr;
+      }
+      return sum;
+    });
+
+    printf("%12d %16.2f %16.2f\n", id_count, map_ns, table_ns);
+  }
+}
@@ -0,0 +1,52 @@
+// Parse throughput of launch requests, as submitted by the front-end, into a reused arena.
+// Runs on the host only.
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include "cuda_argument_parser.h"
+
+#define ITERATIONS 1000000
+
+using namespace cuda_manager;
+
+typedef std::chrono::high_resolution_clock Clock;
+
+int main(void) {
+  std::vector<std::string> requests = {
+    "0 saxpy 2.5 b 1 1 b 1 2 b 0 3 4096",
+    "12 reduce b 1 7 b 0 8 1048576l",
+    "3 stencil_3d b 1 10 b 1 11 b 0 12 256 256 256 0.25f 0.125d -1 0x10",
+    "7 noargs",
+  };
+
+  alignas(8) char storage[64 * 1024];
+  ArgumentArena arena(storage, sizeof(storage));
+
+  printf("%-70s %12s %12s\n", "request", "ns/request", "MB/s");
+  for (const std::string &request: requests) {
+    size_t checksum = 0;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < ITERATIONS; ++i) {
+      // Several requests share the arena between resets, as a batch would
+      if (arena.capacity - arena.used < 1024) arena.reset();
+
+      ParsedArguments parsed;
+      ParseError error = parse_arguments(request.c_str(), request.size(), arena, &parsed);
+      if (error.code != PARSE_OK) {
+        printf("Error parsing \"%s\" at %zu: %s\n", request.c_str(), error.position, parse_error_string(error.code));
+        return 1;
+      }
+      checksum += parsed.arg_count;
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    // Keep the parses from being optimized away
+    if (checksum == 1) printf(" ");
+    printf("%-70s %12.1f %12.1f\n", request.c_str(), seconds * 1e9 / ITERATIONS,
+        request.size() * (double) ITERATIONS / seconds / 1e6);
+  }
+
+  return 0;
+}
@@ -0,0 +1,70 @@
+// Compares host <-> device bandwidth of plain synchronous copies from pageable memory
+// against the staged (page-locked, chunked) copies done by CudaApi
+
+#include <cuda.h>
+#include <chrono>
+#include <iostream>
+#include <vector>
+#include "cuda_common.h"
+#include "cuda_api.h"
+
+#define ITERATIONS 10
+
+using namespace cuda_manager;
+
+typedef std::chrono::high_resolution_clock Clock;
+
+static double bandwidth(size_t size, Clock::time_point start, Clock::time_point end) {
+  double seconds = std::chrono::duration<double>(end - start).count();
+  return (double) size * ITERATIONS / seconds / (1024.0 * 1024.0 * 1024.0);
+}
+
+int main(void) {
+  CudaApi cuda_api;
+
+  std::vector<size_t> sizes = {1 << 20, 4 << 20, 16 << 20, 64 << 20, 256 << 20};
+  int buffer_id = 0;
+
+  printf("%12s %14s %14s %14s %14s %14s\n", "size (MB)", "HtoD pageable", "HtoD staged", "HtoD async",
+      "DtoH pageable", "DtoH staged");
+
+  for (size_t size: sizes) {
+    std::vector<char> host(size, 1);
+
+    // Baseline: direct synchronous copies, as done before the staging pool
+    CUdeviceptr d_ptr;
+    CUDA_SAFE_CALL(cuMemAlloc(&d_ptr, size));
+
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < ITERATIONS; ++i) CUDA_SAFE_CALL(cuMemcpyHtoD(d_ptr, host.data(), size));
+    double htod_pageable = bandwidth(size, start, Clock::now());
+
+    start = Clock::now();
+    for (int i = 0; i < ITERATIONS; ++i) CUDA_SAFE_CALL(cuMemcpyDtoH(host.data(), d_ptr, size));
+    double dtoh_pageable = bandwidth(size, start, Clock::now());
+
+    CUDA_SAFE_CALL(cuMemFree(d_ptr));
+
+    // Staged copies through the API
+    cuda_api.allocate_memory(buffer_id, size);
+
+    start = Clock::now();
+    for (int i = 0; i < ITERATIONS; ++i) cuda_api.write_memory(buffer_id, host.data(), size);
+    double htod_staged = bandwidth(size, start, Clock::now());
+
+    CompletionHandlePtr completion;
+    start = Clock::now();
+    for (int i = 0; i < ITERATIONS; ++i) cuda_api.write_memory_async(buffer_id, host.data(), size, &completion);
+    completion->wait();
+    double htod_async = bandwidth(size, start, Clock::now());
+
+    start = Clock::now();
+    for (int i = 0; i < ITERATIONS; ++i) cuda_api.read_memory(buffer_id, host.data(), size);
+    double dtoh_staged = bandwidth(size, start, Clock::now());
+
+    cuda_api.deallocate_memory(buffer_id);
+
+    printf("%12zu %11.2f GB/s %9.2f GB/s %9.2f GB/s %9.2f GB/s %9.2f GB/s\n", size >> 20,
+        htod_pageable, htod_staged, htod_async, dtoh_pageable, dtoh_staged);
+  }
+}
@@ -1,71 +1,424 @@
 #include "cuda_api.h"
 #include "cuda_memory_manager.h"
 #include "cuda_argument_parser.h"
+#include "cuda_log.h"
+#include "cuda_metrics.h"
 #include <assert.h>
 
-CudaApi::CudaApi():cuda_manager() {}
+// Graph being recorded by the calling thread, if any
+static thread_local cuda_manager::CudaGraph *capture_graph = nullptr;
+
+CudaApi::CudaApi(cuda_manager::ExecutionModel execution_model, cuda_manager::InitMode init_mode):
+  cuda_manager(init_mode) {
+  if (execution_model == cuda_manager::DEVICE_WORKERS) {
+    cuda_manager.start_workers();
+  }
+}
 
 CudaApi::~CudaApi() {}
 
 // TODO 
 // - error codes
 
+// Device ids come from clients, they index per device tables
+static bool check_device(const cuda_manager::CudaManager &cuda_manager, int device_id) {
+  if (cuda_manager.is_valid_device(device_id)) return true;
+  CUDA_LOG_ERROR("Device id %d is out of range, there are %u devices", device_id, cuda_manager.device_count);
+  return false;
+}
+
+// Device of a buffer, to route calls on it
+static int buffer_device(cuda_manager::CudaManager &cuda_manager, int buffer_id) {
+  return cuda_manager.get_device_id(cuda_manager.memory_manager.get_buffer(buffer_id).context);
+}
+
 CudaApiExitCode CudaApi::allocate_memory(int buffer_id, size_t size) {
+  if (cuda_manager.has_workers()) {
+    return allocate_memory(buffer_id, size, 0);
+  }
+  cuda_manager.ensure_context();
   cuda_manager.memory_manager.allocate_buffer(buffer_id, size);
   return OK;
 }
 
+CudaApiExitCode CudaApi::allocate_memory(int buffer_id, size_t size, int device_id) {
+  if (!check_device(cuda_manager, device_id)) return ERROR;
+  cuda_manager.run_on_device(device_id, [&] {
+    cuda_manager.memory_manager.allocate_buffer(buffer_id, size);
+  });
+  return OK;
+}
+
 CudaApiExitCode CudaApi::deallocate_memory(int buffer_id) {
-  cuda_manager.memory_manager.deallocate_buffer(buffer_id);
+  cuda_manager.run_on_device(buffer_device(cuda_manager, buffer_id), [&] {
+    cuda_manager.memory_manager.deallocate_buffer(buffer_id);
+  });
   return OK;
 }
 
 CudaApiExitCode CudaApi::write_memory(int buffer_id, const void *data, size_t size) {
-  cuda_manager.memory_manager.write_buffer(buffer_id, data, size);
+  if (capture_graph != nullptr) {
+    capture_graph->add_write(buffer_id, data, size);
+    return OK;
+  }
+  cuda_manager.run_on_device(buffer_device(cuda_manager, buffer_id), [&] {
+    cuda_manager.memory_manager.write_buffer(buffer_id, data, size);
+  });
   return OK;
 }
 
 CudaApiExitCode CudaApi::read_memory(int buffer_id, void *dest_buffer, size_t size) {
-  cuda_manager.memory_manager.read_buffer(buffer_id, dest_buffer, size);
+  if (capture_graph != nullptr) {
+    capture_graph->add_read(buffer_id, dest_buffer, size);
+    return OK;
+  }
+  cuda_manager.run_on_device(buffer_device(cuda_manager, buffer_id), [&] {
+    cuda_manager.memory_manager.read_buffer(buffer_id, dest_buffer, size);
+  });
+  return OK;
+}
+
+CudaApiExitCode CudaApi::write_memory(int buffer_id, size_t offset, const void *data, size_t size) {
+  assert(capture_graph == nullptr && "Ranged copies cannot be recorded in a graph");
+  cuda_manager.run_on_device(buffer_device(cuda_manager, buffer_id), [&] {
+    cuda_manager.memory_manager.write_buffer_range(buffer_id, offset, data, size);
+  });
+  return OK;
+}
+
+CudaApiExitCode CudaApi::read_memory(int buffer_id, size_t offset, void *dest_buffer, size_t size) {
+  assert(capture_graph == nullptr && "Ranged copies cannot be recorded in a graph");
+  cuda_manager.run_on_device(buffer_device(cuda_manager, buffer_id), [&] {
+    cuda_manager.memory_manager.read_buffer_range(buffer_id, offset, dest_buffer, size);
+  });
+  return OK;
+}
+
+CudaApiExitCode CudaApi::write_memory_strided(int buffer_id, const cuda_manager::MemoryLayout &buffer_layout,
+    const void *data, const cuda_manager::MemoryLayout &host_layout, const cuda_manager::CopyExtent &extent) {
+  assert(capture_graph == nullptr && "Strided copies cannot be recorded in a graph");
+  cuda_manager.run_on_device(buffer_device(cuda_manager, buffer_id), [&] {
+    cuda_manager.memory_manager.write_buffer_strided(buffer_id, buffer_layout, data, host_layout, extent);
+  });
+  return OK;
+}
+
+CudaApiExitCode CudaApi::read_memory_strided(int buffer_id, const cuda_manager::MemoryLayout &buffer_layout,
+    void *dest_buffer, const cuda_manager::MemoryLayout &host_layout, const cuda_manager::CopyExtent &extent) {
+  assert(capture_graph == nullptr && "Strided copies cannot be recorded in a graph");
+  cuda_manager.run_on_device(buffer_device(cuda_manager, buffer_id), [&] {
+    cuda_manager.memory_manager.read_buffer_strided(buffer_id, buffer_layout, dest_buffer, host_layout, extent);
+  });
+  return OK;
+}
+
+CudaApiExitCode CudaApi::copy_memory(int dst_buffer_id, size_t dst_offset, int src_buffer_id, size_t src_offset, size_t size) {
+  assert(capture_graph == nullptr && "Device copies cannot be recorded in a graph");
+  cuda_manager.run_on_device(buffer_device(cuda_manager, dst_buffer_id), [&] {
+    cuda_manager.memory_manager.copy_buffer(dst_buffer_id, dst_offset, src_buffer_id, src_offset, size);
+  });
+  return OK;
+}
+
+CudaApiExitCode CudaApi::copy_memory_strided(int dst_buffer_id, const cuda_manager::MemoryLayout &dst_layout,
+    int src_buffer_id, const cuda_manager::MemoryLayout &src_layout, const cuda_manager::CopyExtent &extent) {
+  assert(capture_graph == nullptr && "Device copies cannot be recorded in a graph");
+  cuda_manager.run_on_device(buffer_device(cuda_manager, dst_buffer_id), [&] {
+    cuda_manager.memory_manager.copy_buffer_strided(dst_buffer_id, dst_layout, src_buffer_id, src_layout, extent);
+  });
+  return OK;
+}
+
+CudaApiExitCode CudaApi::fill_memory_d8(int buffer_id, size_t offset, uint8_t value, size_t count) {
+  assert(capture_graph == nullptr && "Fills cannot be recorded in a graph");
+  cuda_manager.run_on_device(buffer_device(cuda_manager, buffer_id), [&] {
+    cuda_manager.memory_manager.fill_buffer_d8(buffer_id, offset, value, count);
+  });
   return OK;
 }
 
+CudaApiExitCode CudaApi::fill_memory_d32(int buffer_id, size_t offset, uint32_t value, size_t count) {
+  assert(capture_graph == nullptr && "Fills cannot be recorded in a graph");
+  cuda_manager.run_on_device(buffer_device(cuda_manager, buffer_id), [&] {
+    cuda_manager.memory_manager.fill_buffer_d32(buffer_id, offset, value, count);
+  });
+  return OK;
+}
+
+CudaApiExitCode CudaApi::write_memory_async(int buffer_id, const void *data, size_t size,
+    cuda_manager::CompletionHandlePtr *completion) {
+  cuda_manager.run_on_device(buffer_device(cuda_manager, buffer_id), [&] {
+    *completion = cuda_manager.memory_manager.write_buffer_async(buffer_id, data, size);
+  });
+  return OK;
+}
+
+CudaApiExitCode CudaApi::read_memory_async(int buffer_id, void *dest_buffer, size_t size,
+    cuda_manager::CompletionHandlePtr *completion) {
+  cuda_manager.run_on_device(buffer_device(cuda_manager, buffer_id), [&] {
+    *completion = cuda_manager.memory_manager.read_buffer_async(buffer_id, dest_buffer, size);
+  });
+  return OK;
+}
+
+CudaApiExitCode CudaApi::trim_memory() {
+  cuda_manager.memory_manager.trim();
+  return OK;
+}
+
+cuda_manager::AllocatorStats CudaApi::get_allocator_stats(int device_id) {
+  if (!check_device(cuda_manager, device_id)) return cuda_manager::AllocatorStats();
+  return cuda_manager.memory_manager.get_allocator_stats(cuda_manager.get_context(device_id));
+}
+
 CudaApiExitCode CudaApi::allocate_kernel(int kernel_id, size_t size) {
   cuda_manager.memory_manager.allocate_kernel(kernel_id, size);
   return OK;
 }
 
 CudaApiExitCode CudaApi::deallocate_kernel(int kernel_id) {
+  if (reloader != nullptr) reloader->unwatch(kernel_id);
   cuda_manager.memory_manager.deallocate_kernel(kernel_id);
   return OK;
 }
 
 CudaApiExitCode CudaApi::write_kernel(int kernel_id, const char *function_name, const void *data, size_t size) {
+  // Other devices load the module on their first launch of the kernel
+  if (cuda_manager.has_workers()) {
+    cuda_manager.run_on_device(0, [&] {
+      cuda_manager.memory_manager.write_kernel(kernel_id, function_name, data, size);
+    });
+    return OK;
+  }
+  cuda_manager.ensure_context();
   cuda_manager.memory_manager.write_kernel(kernel_id, function_name, data, size);
   return OK;
 }
 
+size_t CudaApi::get_module_loads_avoided() {
+  return cuda_manager.memory_manager.get_module_loads_avoided();
+}
+
+CudaApiExitCode CudaApi::enable_hot_reload(cuda_manager::ReloadCompileFunction compile_function) {
+  assert(reloader == nullptr && "Hot reload is already enabled");
+  reloader.reset(new cuda_manager::KernelReloader(cuda_manager.memory_manager, compile_function));
+  return OK;
+}
+
+CudaApiExitCode CudaApi::watch_kernel_source(int kernel_id, const char *function_name, const char *source_path,
+    const std::vector<std::string> &dependencies) {
+  assert(reloader != nullptr && "Hot reload is not enabled");
+  return reloader->watch_source(kernel_id, function_name, source_path, dependencies) ? OK : ERROR;
+}
+
+CudaApiExitCode CudaApi::watch_kernel_image(int kernel_id, const char *function_name, const char *image_path) {
+  assert(reloader != nullptr && "Hot reload is not enabled");
+  return reloader->watch_image(kernel_id, function_name, image_path) ? OK : ERROR;
+}
+
+CudaApiExitCode CudaApi::unwatch_kernel(int kernel_id) {
+  assert(reloader != nullptr && "Hot reload is not enabled");
+  reloader->unwatch(kernel_id);
+  return OK;
+}
+
+CudaApiExitCode CudaApi::reload_kernel(int kernel_id) {
+  assert(reloader != nullptr && "Hot reload is not enabled");
+  return reloader->reload_now(kernel_id) ? OK : ERROR;
+}
+
+cuda_manager::ReloadStats CudaApi::get_reload_stats() {
+  cuda_manager::ReloadStats stats = cuda_manager.memory_manager.get_reload_stats();
+  if (reloader != nullptr) stats.reload_failures += reloader->get_compile_failures();
+  return stats;
+}
+
 CudaApiExitCode CudaApi::launch_kernel(int kernel_id, CudaResourceArgs r_args, const char *args, int arg_count) {
-  // Get writtenl kernel using kernel_id
-  cuda_manager::MemoryKernel mem_kernel = cuda_manager.memory_manager.get_kernel(kernel_id);
-  assert(mem_kernel.kernel != nullptr && "Kernel isn't loaded, perform kernel_write() before launching");
+  cuda_manager::CompletionHandlePtr completion;
+  CudaApiExitCode exit_code = launch_kernel_async(kernel_id, r_args, args, arg_count, &completion);
+  if (exit_code != OK) return exit_code;
+
+  // Recorded launches have nothing to wait for
+  if (completion != nullptr) completion->wait();
+  return OK;
+}
+
+void CudaApi::set_concurrent_launches(bool enabled) {
+  cuda_manager.set_concurrent_launches(enabled);
+}
+
+CudaApiExitCode CudaApi::launch_kernel_async(int kernel_id, CudaResourceArgs r_args, const char *args, int arg_count,
+    cuda_manager::CompletionHandlePtr *completion) {
+  if (!check_device(cuda_manager, r_args.device_id)) return ERROR;
+  // Get written kernel using kernel_id, held until the launch is queued so a reload cannot unload it
+  cuda_manager::KernelVersionPtr version = cuda_manager.memory_manager.get_kernel_version(kernel_id);
+  assert(version != nullptr && "Kernel isn't loaded, perform kernel_write() before launching");
 
   // Launch kernel
-#ifndef NDEBUG
-  std::cout << "Launching kernel " << kernel_id << "\n";
-  std::cout << "Resources: device_id: " 
-            << r_args.device_id << ",  Grid(" 
-            << r_args.grid_dim.x << ", " 
-            << r_args.grid_dim.y << ", " 
-            << r_args.grid_dim.z << "),  Block(" 
-            << r_args.block_dim.x << ", "
-            << r_args.block_dim.y << ", "  
-            << r_args.block_dim.z << ")\n"; 
-  std::cout << "Number of arguments: " << arg_count << "\n";
-#endif
+  CUDA_LOG_TRACE("Launching kernel %d", kernel_id);
+  CUDA_LOG_TRACE("Resources: device_id: %d,  Grid(%u, %u, %u),  Block(%u, %u, %u)", r_args.device_id,
+      r_args.grid_dim.x, r_args.grid_dim.y, r_args.grid_dim.z,
+      r_args.block_dim.x, r_args.block_dim.y, r_args.block_dim.z);
+  CUDA_LOG_TRACE("Number of arguments: %d", arg_count);
+
+  if (capture_graph != nullptr) {
+    capture_graph->add_kernel(kernel_id, version, r_args, args, arg_count);
+    completion->reset();
+    return OK;
+  }
+
+  cuda_manager::LaunchTimer timer(kernel_id);
+  cuda_manager.run_on_device(r_args.device_id, [&] {
+    CUfunction kernel = cuda_manager.memory_manager.get_function(*version, cuda_manager.get_context(r_args.device_id));
+    *completion = cuda_manager.launch_kernel_async(kernel, r_args, args, arg_count);
+  });
+
+  return OK;
+}
+
+CudaApiExitCode CudaApi::launch_kernel_packed(int kernel_id, CudaResourceArgs r_args, const char *args, int arg_count) {
+  cuda_manager::CompletionHandlePtr completion;
+  CudaApiExitCode exit_code = launch_kernel_packed_async(kernel_id, r_args, args, arg_count, &completion);
+  if (exit_code != OK) return exit_code;
+
+  completion->wait();
+  return OK;
+}
 
-  cuda_manager.launch_kernel(mem_kernel.kernel, r_args, args, arg_count);
+CudaApiExitCode CudaApi::launch_kernel_packed_async(int kernel_id, CudaResourceArgs r_args, const char *args, int arg_count,
+    cuda_manager::CompletionHandlePtr *completion) {
+  if (!check_device(cuda_manager, r_args.device_id)) return ERROR;
+  cuda_manager::KernelVersionPtr version = cuda_manager.memory_manager.get_kernel_version(kernel_id);
+  assert(version != nullptr && "Kernel isn't loaded, perform kernel_write() before launching");
+  assert(version->param_layout.valid && "Kernel has no parameter layout, it was not written from PTX");
+  assert(capture_graph == nullptr && "Packed launches cannot be recorded in a graph");
 
+  cuda_manager::LaunchTimer timer(kernel_id);
+  // Packed on the stack, the launch copies it. One extra word keeps the array non-empty for kernels without parameters
+  uint64_t params[(version->param_layout.size + 7) / 8 + 1];
+  cuda_manager.run_on_device(r_args.device_id, [&] {
+    cuda_manager.pack_arguments(r_args.device_id, version->param_layout, args, arg_count, params);
+    CUfunction kernel = cuda_manager.memory_manager.get_function(*version, cuda_manager.get_context(r_args.device_id));
+    *completion = cuda_manager.launch_kernel_packed_async(kernel, r_args, params, version->param_layout.size);
+  });
+
+  return OK;
+}
+
+CudaApiExitCode CudaApi::prepare_launch(int kernel_id, CudaResourceArgs r_args, const char *args, int arg_count,
+    cuda_manager::PreparedLaunchPtr *prepared) {
+  if (!check_device(cuda_manager, r_args.device_id)) return ERROR;
+  cuda_manager::KernelVersionPtr version = cuda_manager.memory_manager.get_kernel_version(kernel_id);
+  assert(version != nullptr && "Kernel isn't loaded, perform kernel_write() before launching");
+  if (!cuda_manager::PreparedLaunch::can_prepare(args, arg_count)) {
+    CUDA_LOG_ERROR("Value arguments of a prepared launch have to fit in 8 bytes");
+    return ERROR;
+  }
+
+  prepared->reset(new cuda_manager::PreparedLaunch(cuda_manager, kernel_id, version, r_args, args, arg_count));
   return OK;
 }
 
+CudaApiExitCode CudaApi::get_occupancy_report(int kernel_id, CudaResourceArgs r_args, cuda_manager::OccupancyReport *report) {
+  if (!check_device(cuda_manager, r_args.device_id)) return ERROR;
+  cuda_manager::KernelVersionPtr version = cuda_manager.memory_manager.get_kernel_version(kernel_id);
+  assert(version != nullptr && "Kernel isn't loaded, perform kernel_write() before launching");
+
+  cuda_manager.run_on_device(r_args.device_id, [&] {
+    CUfunction kernel = cuda_manager.memory_manager.get_function(*version, cuda_manager.get_context(r_args.device_id));
+    *report = cuda_manager.get_occupancy_report(kernel, r_args);
+  });
+  return OK;
+}
+
+CudaApiExitCode CudaApi::begin_capture(int device_id) {
+  if (!check_device(cuda_manager, device_id)) return ERROR;
+  assert(capture_graph == nullptr && "Thread is already capturing a graph");
+  capture_graph = new cuda_manager::CudaGraph(cuda_manager, device_id);
+  return OK;
+}
+
+CudaApiExitCode CudaApi::end_capture(cuda_manager::CudaGraphPtr *graph) {
+  assert(capture_graph != nullptr && "Thread is not capturing a graph");
+  graph->reset(capture_graph);
+  capture_graph = nullptr;
+
+  (*graph)->instantiate();
+  return OK;
+}
+
+CudaApiExitCode CudaApi::set_buffer_placement(int buffer_id, cuda_manager::PlacementPolicy placement) {
+  cuda_manager.run_on_device(buffer_device(cuda_manager, buffer_id), [&] {
+    cuda_manager.memory_manager.set_placement(buffer_id, placement);
+  });
+  return OK;
+}
+
+cuda_manager::PlacementStats CudaApi::get_placement_stats() {
+  return cuda_manager.memory_manager.get_placement_stats();
+}
+
+CudaApiExitCode CudaApi::set_host_shadow(int buffer_id, bool enabled) {
+  cuda_manager.run_on_device(buffer_device(cuda_manager, buffer_id), [&] {
+    cuda_manager.memory_manager.set_host_shadow(buffer_id, enabled);
+  });
+  return OK;
+}
+
+CudaApiExitCode CudaApi::sync_host_shadow(int buffer_id) {
+  cuda_manager.run_on_device(buffer_device(cuda_manager, buffer_id), [&] {
+    cuda_manager.memory_manager.sync_shadow(buffer_id);
+  });
+  return OK;
+}
+
+cuda_manager::ShadowStats CudaApi::get_shadow_stats() {
+  return cuda_manager.memory_manager.get_shadow_stats();
+}
+
+cuda_manager::MetricsSnapshot CudaApi::get_stats() {
+  cuda_manager::MetricsSnapshot snapshot = cuda_manager::collect_metrics();
+  for (uint32_t i = 0; i < cuda_manager.device_count; ++i) {
+    // Devices never used have no allocator
+    CUcontext context = cuda_manager.contexts[i].load(std::memory_order_acquire);
+    if (context == nullptr) continue;
+
+    cuda_manager::AllocatorStats allocator_stats = cuda_manager.memory_manager.get_allocator_stats(context);
+    cuda_manager::DeviceMetrics device;
+    device.device_id = i;
+    device.allocations = allocator_stats.allocations;
+    device.deallocations = allocator_stats.deallocations;
+    device.live_bytes = allocator_stats.used_bytes;
+    device.reserved_bytes = allocator_stats.reserved_bytes;
+    snapshot.devices.push_back(device);
+  }
+  return snapshot;
+}
+
+void CudaApi::reset_stats() {
+  cuda_manager::reset_metrics();
+}
+
+void CudaApi::set_profiling(bool enabled) {
+  cuda_manager.memory_manager.profiler.set_enabled(enabled);
+}
+
+std::vector<cuda_manager::ProfileRecord> CudaApi::get_profile_records() {
+  return cuda_manager.memory_manager.profiler.get_records();
+}
+
+CudaApiExitCode CudaApi::write_chrome_trace(const char *path) {
+  if (!cuda_manager.memory_manager.profiler.write_chrome_trace(path)) {
+    CUDA_LOG_ERROR("Could not write trace to %s", path);
+    return ERROR;
+  }
+  return OK;
+}
+
+void CudaApi::clear_profile() {
+  cuda_manager.memory_manager.profiler.clear();
+}
+
+cuda_manager::StartupTimes CudaApi::get_startup_times() {
+  return cuda_manager.get_startup_times();
+}
@@ -2,37 +2,201 @@
 #define CUDA_API_H
 
 #include "cuda_manager.h"
+#include "cuda_prepared_launch.h"
+#include "cuda_graph.h"
+#include "cuda_metrics.h"
+#include "cuda_kernel_reloader.h"
+#include <memory>
 
 enum CudaApiExitCode {
   OK,
   ERROR
 };
 
+/*! \brief Entry point for clients, safe to call from several threads at once.
+ * Buffers are allocated and kernels loaded in the calling thread's current context,
+ * device 0 if the thread has none. Kernels are loaded again on the first launch on each other device.
+ * With DEVICE_WORKERS, memory calls and launches run on the worker thread of their device,
+ * buffers without a device go to device 0 and kernels are loaded on the worker of device 0.
+ */
 class CudaApi {
 private:
   cuda_manager::CudaManager cuda_manager;
+  // Declared after cuda_manager so it stops before the kernels are released
+  std::unique_ptr<cuda_manager::KernelReloader> reloader;
 
 public:
-  CudaApi();
+  CudaApi(cuda_manager::ExecutionModel execution_model = cuda_manager::CALLER_THREADS,
+      cuda_manager::InitMode init_mode = cuda_manager::LAZY_INIT);
   ~CudaApi();
 
   CudaApiExitCode allocate_memory(int buffer_id, size_t size);
+  // Allocate on device_id, with CALLER_THREADS this makes the device current on the calling thread
+  CudaApiExitCode allocate_memory(int buffer_id, size_t size, int device_id);
   CudaApiExitCode deallocate_memory(int buffer_id);
   CudaApiExitCode write_memory(int buffer_id, const void *data, size_t size);
   CudaApiExitCode read_memory(int buffer_id, void *dest_buffer, size_t size);
+  // Write or read size bytes at offset of buffer_id, the rest of the buffer is not transferred
+  CudaApiExitCode write_memory(int buffer_id, size_t offset, const void *data, size_t size);
+  CudaApiExitCode read_memory(int buffer_id, size_t offset, void *dest_buffer, size_t size);
+
+  /*! \brief Copy a 2D (depth 1) or 3D box between host memory and buffer_id with cuMemcpy2D/3D.
+   * buffer_layout and host_layout give the offset, row pitch and slice height of the box on each side.
+   */
+  CudaApiExitCode write_memory_strided(int buffer_id, const cuda_manager::MemoryLayout &buffer_layout,
+      const void *data, const cuda_manager::MemoryLayout &host_layout, const cuda_manager::CopyExtent &extent);
+  CudaApiExitCode read_memory_strided(int buffer_id, const cuda_manager::MemoryLayout &buffer_layout,
+      void *dest_buffer, const cuda_manager::MemoryLayout &host_layout, const cuda_manager::CopyExtent &extent);
+
+  // Copy size bytes between buffers on the device, across devices with peer copies or host staging
+  CudaApiExitCode copy_memory(int dst_buffer_id, size_t dst_offset, int src_buffer_id, size_t src_offset, size_t size);
+  // Copy a box between buffers of the same device
+  CudaApiExitCode copy_memory_strided(int dst_buffer_id, const cuda_manager::MemoryLayout &dst_layout,
+      int src_buffer_id, const cuda_manager::MemoryLayout &src_layout, const cuda_manager::CopyExtent &extent);
+
+  // Set count bytes at offset of buffer_id to value on the device
+  CudaApiExitCode fill_memory_d8(int buffer_id, size_t offset, uint8_t value, size_t count);
+  // Set count 32 bit words at offset of buffer_id to value on the device, offset is 4 byte aligned
+  CudaApiExitCode fill_memory_d32(int buffer_id, size_t offset, uint32_t value, size_t count);
+
+  /*
+   * Non-blocking versions of write_memory and read_memory, copies go through page-locked staging buffers.
+   * data can be reused as soon as write_memory_async returns, dest_buffer must stay valid until completion.
+   * Neither is ordered with in-flight launches, wait on the launch handles first.
+   * \param completion set to a handle to wait on, poll or attach a completion callback to
+   */
+  CudaApiExitCode write_memory_async(int buffer_id, const void *data, size_t size,
+      cuda_manager::CompletionHandlePtr *completion);
+  CudaApiExitCode read_memory_async(int buffer_id, void *dest_buffer, size_t size,
+      cuda_manager::CompletionHandlePtr *completion);
+
+  // Give cached device memory no buffer uses back to the driver, e.g. under memory pressure
+  CudaApiExitCode trim_memory();
+  // Latency, fragmentation and hit rate of the device memory allocator of a device
+  cuda_manager::AllocatorStats get_allocator_stats(int device_id);
+
+  /*! \brief Choose where buffer_id lives when kernels on other devices than its own use it, FIRST_TOUCH by default.
+   * Buffers are moved or copied with peer copies between devices with peer access, through host memory otherwise.
+   */
+  CudaApiExitCode set_buffer_placement(int buffer_id, cuda_manager::PlacementPolicy placement);
+  // Buffer moves and copies made by placement policies so far
+  cuda_manager::PlacementStats get_placement_stats();
+
+  /*! \brief Keep a host copy of buffer_id so writes, reads and launches only transfer the bytes that changed.
+   * Launches use the is_in flag of buffer arguments to know which buffers kernels may have written.
+   * Prepared launches and graphs are not tracked, call sync_host_shadow after them.
+   */
+  CudaApiExitCode set_host_shadow(int buffer_id, bool enabled);
+  // Upload pending writes to buffer_id and treat all of it as written by the device
+  CudaApiExitCode sync_host_shadow(int buffer_id);
+  // Bytes transferred and saved by host shadows so far
+  cuda_manager::ShadowStats get_shadow_stats();
+
+  /*! \brief Launch counts and latencies per kernel id, transfers per direction, allocations per device and module loads.
+   * Counters are process wide and kept per thread, the snapshot sums them. Dump it with to_text() or to_json().
+   */
+  cuda_manager::MetricsSnapshot get_stats();
+  // Zero the launch, transfer and module load counters, allocation counts are kept by the allocators
+  void reset_stats();
+
+  /*! \brief Record launches, graph launches and copies on a GPU timeline, off by default.
+   * Each is timed with a pair of events on its stream, nothing waits on the GPU until records are read.
+   */
+  void set_profiling(bool enabled);
+  // Records so far in start order, waits for the profiled work still running
+  std::vector<cuda_manager::ProfileRecord> get_profile_records();
+  // Write the timeline as a Chrome trace (chrome://tracing, Perfetto), with a track per device and stream
+  CudaApiExitCode write_chrome_trace(const char *path);
+  void clear_profile();
+
+  // Time spent initializing the driver and each device so far
+  cuda_manager::StartupTimes get_startup_times();
 
   CudaApiExitCode allocate_kernel(int kernel_id, size_t size);
+  // Also stops watching the kernel with hot reload
   CudaApiExitCode deallocate_kernel(int kernel_id);
+  // data is a PTX or CUBIN image, packed launches need PTX as the parameter layout is read from it
   CudaApiExitCode write_kernel(int kernel_id, const char *function_name, const void *data, size_t size);
+  // Number of kernel writes that reused an already loaded module
+  size_t get_module_loads_avoided();
+
+  /*! \brief Reload kernels when the files they were written from change, while they keep being launched.
+   * Launches queued before a reload finish on the previous image, which is unloaded once they completed.
+   * Call once before watching kernels, not concurrently with other calls.
+   * \param compile_function turns watched sources into images, e.g. with cuda_compiler, only needed for sources
+   */
+  CudaApiExitCode enable_hot_reload(cuda_manager::ReloadCompileFunction compile_function = nullptr);
+  // Recompile and reload a written kernel when source_path or one of dependencies changes, and the files it included since
+  CudaApiExitCode watch_kernel_source(int kernel_id, const char *function_name, const char *source_path,
+      const std::vector<std::string> &dependencies = std::vector<std::string>());
+  // Reload a written kernel when the PTX or CUBIN at image_path changes
+  CudaApiExitCode watch_kernel_image(int kernel_id, const char *function_name, const char *image_path);
+  CudaApiExitCode unwatch_kernel(int kernel_id);
+  // Reload a watched kernel now, ERROR if it kept its previous version
+  CudaApiExitCode reload_kernel(int kernel_id);
+  cuda_manager::ReloadStats get_reload_stats();
   
   /*
    * \param kernel_id 
    * \param function_name name of the function to run in the kernel file
-   * \param resource_args device id and grid and block dimensions
+   * \param resource_args device id and grid and block dimensions, or an element count with zero dimensions
+   *        to have a 1D configuration chosen from the kernel occupancy, see CudaManager::configure_launch
    * \param args kernel_arguments array of structs
    * \param arg_count number of arguments in the arguments array
    */
   CudaApiExitCode launch_kernel(int kernel_id, CudaResourceArgs resource_args, const char *args, int arg_count);
+
+  /*! \brief Let launches of each device run on several streams and overlap, off by default.
+   * By default launches run in the order they are issued and launch_kernel waits for every earlier launch.
+   * Once enabled, launches that share buffers have to be ordered by waiting on their completion handles.
+   */
+  void set_concurrent_launches(bool enabled);
+
+  /*
+   * Non-blocking version of launch_kernel, parameters are the same.
+   * \param completion set to a handle to wait on, poll or attach a completion callback to
+   */
+  CudaApiExitCode launch_kernel_async(int kernel_id, CudaResourceArgs resource_args, const char *args, int arg_count,
+      cuda_manager::CompletionHandlePtr *completion);
+
+  /*
+   * Launch a kernel with its arguments packed into one parameter buffer, laid out from the kernel's PTX.
+   * Scalar values are copied at the call, args and the memory it points to can be reused once this returns.
+   * The kernel must have been written from PTX, parameters are the same as launch_kernel.
+   */
+  CudaApiExitCode launch_kernel_packed(int kernel_id, CudaResourceArgs resource_args, const char *args, int arg_count);
+  CudaApiExitCode launch_kernel_packed_async(int kernel_id, CudaResourceArgs resource_args, const char *args, int arg_count,
+      cuda_manager::CompletionHandlePtr *completion);
+
+  /*
+   * Resolve a launch once for repeated launches of the same kernel and arguments, parameters are the same as launch_kernel.
+   * Buffer arguments are resolved to device pointers here, launch() only resolves them again when a placement policy
+   * moved the buffer or changed its replicas since. Rebind them with set_buffer after the buffer is deallocated,
+   * and call sync_host_shadow after host writes to a shadowed buffer, or launches use stale memory.
+   * \param prepared set to the prepared launch, call its launch() to run the kernel
+   */
+  CudaApiExitCode prepare_launch(int kernel_id, CudaResourceArgs resource_args, const char *args, int arg_count,
+      cuda_manager::PreparedLaunchPtr *prepared);
+
+  /*
+   * Compare the theoretical occupancy of a launch configuration with the one chosen automatically for as many threads.
+   * \param report set to the occupancy of both configurations, print it with to_text()
+   */
+  CudaApiExitCode get_occupancy_report(int kernel_id, CudaResourceArgs resource_args, cuda_manager::OccupancyReport *report);
+
+  /*
+   * Start recording a graph on the calling thread. Until end_capture, launch_kernel, launch_kernel_async,
+   * write_memory and read_memory on this thread are recorded instead of run, async launches get a null handle.
+   * Host memory passed to recorded copies is accessed on every replay, it has to outlive the graph.
+   * \param device_id device every recorded launch and buffer has to be on
+   */
+  CudaApiExitCode begin_capture(int device_id);
+
+  /*
+   * Stop recording and instantiate the graph.
+   * \param graph set to the recorded graph, replay it with launch(), node i is the i-th recorded call
+   */
+  CudaApiExitCode end_capture(cuda_manager::CudaGraphPtr *graph);
 };
 
 #endif
@@ -1,231 +1,384 @@
 #include "cuda_argument_parser.h"
 #include "kernel_arguments.h"
-#include <vector>
-#include <iostream>
 #include <sstream>
+#include <limits>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
-#include <assert.h>
 
 namespace cuda_manager {
 
-std::string parse_next(int *position, const char *arguments, bool *is_number) {
-  int i = *position;
+// Longest scalar literal accepted, real literals are copied out to be null terminated for strtod
+static const size_t MAX_NUMBER_LENGTH = 64;
+
+static const size_t OUTPUT_ALIGNMENT = 8;
+
+const char *parse_error_string(ParseErrorCode code) {
+  switch (code) {
+    case PARSE_OK: return "ok";
+    case PARSE_EXPECTED_KERNEL_ID: return "number expected (kernel mem_id)";
+    case PARSE_EXPECTED_FUNCTION_NAME: return "function name expected";
+    case PARSE_EXPECTED_DIRECTION: return "1|0 expected (buffer in|out)";
+    case PARSE_EXPECTED_BUFFER_ID: return "number expected (buffer id)";
+    case PARSE_INVALID_NUMBER: return "malformed scalar";
+    case PARSE_INVALID_SUFFIX: return "unknown scalar suffix";
+    case PARSE_OUT_OF_RANGE: return "value out of range";
+    case PARSE_UNEXPECTED_TOKEN: return "unexpected token";
+    case PARSE_BUFFER_TOO_SMALL: return "ran out of memory for arguments";
+  }
+  return "unknown error";
+}
 
-  std::string current_arg;
-  char c = arguments[i];
-  bool _is_number = true;
-  while (c != ' ' && c != '\0') {
-    // TODO Improve float parsing
-    if (is_number && (!isdigit(c) && c != '.')) _is_number = false;
+static bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
 
-    current_arg.push_back(c);
-    c = arguments[++i];
-  }
+static bool is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
 
-  if (is_number != nullptr) *is_number = _is_number;
-  *position = i;
-  return current_arg;
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
 }
 
-bool parse_pointer(int *position, const char *arguments, void **result, bool full) {
-  // full means we also parse "0x"
-  int i = *position;
-  char c = arguments[i];
-  if (full) {
-    char n = arguments[++i];
-    if (c != '0' || n != 'x') {
-      *position = i;
-      return false;
-    }
-    ++i;
+// Single pass state, the input is consumed token by token and output appended in place
+struct Parser {
+  const char *input;
+  size_t length;
+  size_t position;
+
+  char *out;
+  size_t out_capacity;
+  size_t out_size;
+
+  ParseError error(ParseErrorCode code) {
+    return { code, position };
   }
 
-  std::string hex = parse_next(&i, arguments, nullptr);
+  void skip_space() {
+    while (position < length && is_space(input[position])) ++position;
+  }
+
+  // Length of the token at position, tokens end at whitespace or the end of the input
+  size_t token_length() {
+    size_t end = position;
+    while (end < length && !is_space(input[end]) && input[end] != '\0') ++end;
+    return end - position;
+  }
 
-  // Not checking well formed hex string
-  *result = (void *)std::stoul(hex, nullptr, 16);
-  *position = i;
+  // Reserve size bytes of output, \return nullptr if the buffer is full
+  char *append(size_t size) {
+    if (out_capacity - out_size < size) return nullptr;
+    char *result = out + out_size;
+    out_size += size;
+    return result;
+  }
+};
+
+// Parse an unsigned decimal into value, \return false on an empty or overflowing number
+static bool parse_decimal(const char *token, size_t length, uint64_t max, uint64_t *value) {
+  if (length == 0) return false;
+  uint64_t result = 0;
+  for (size_t i = 0; i < length; ++i) {
+    if (!is_digit(token[i])) return false;
+    uint64_t digit = token[i] - '0';
+    if (result > (max - digit) / 10) return false;
+    result = result * 10 + digit;
+  }
+  *value = result;
   return true;
 }
 
-bool parse_bool(int *position, const char *arguments, bool *result) {
-  int i = *position;
-
-  char c = arguments[i];
-  char n = arguments[++i];
+// Parse the id after a kernel or buffer, ids are non negative ints
+static bool parse_id(Parser &parser, int *id) {
+  parser.skip_space();
+  size_t length = parser.token_length();
+  uint64_t value;
+  if (!parse_decimal(parser.input + parser.position, length, std::numeric_limits<int>::max(), &value)) return false;
+  *id = (int) value;
+  parser.position += length;
+  return true;
+}
 
-  *position = i;
+static bool suffix_equals(const char *suffix, size_t length, const char *expected) {
+  return length == strlen(expected) && memcmp(suffix, expected, length) == 0;
+}
 
-  if (!isdigit(c) && (n != ' ' || n != '\0')) {
+// Type named by a scalar suffix, \return false if it names none
+static bool suffix_type(const char *suffix, size_t length, bool is_real, ScalarType *type) {
+  if (length == 0) {
+    *type = is_real ? F32 : I32;
+  } else if (suffix_equals(suffix, length, "i32")) {
+    *type = I32;
+  } else if (suffix_equals(suffix, length, "l") || suffix_equals(suffix, length, "i64")) {
+    *type = I64;
+  } else if (suffix_equals(suffix, length, "f") || suffix_equals(suffix, length, "f32")) {
+    *type = F32;
+  } else if (suffix_equals(suffix, length, "d") || suffix_equals(suffix, length, "f64")) {
+    *type = F64;
+  } else {
     return false;
   }
-
-  *result = std::atoi(&c);
-  return true;
+  // Integer types cannot hold a real literal
+  return !is_real || *type == F32 || *type == F64;
 }
 
-bool parse_integer(int *position, const char *arguments, int *result) {
-  int i = *position;
+// Parse a scalar token into value, the token is known to start with a digit, a sign or a '.'
+static ParseErrorCode parse_scalar(const char *token, size_t length, ValueArg *value) {
+  size_t i = 0;
+  bool negative = false;
+  if (token[i] == '-' || token[i] == '+') {
+    negative = token[i] == '-';
+    ++i;
+  }
 
-  std::string current_arg;
-  char c = arguments[i];
-  bool is_number = true;
-  while (c != ' ' && c != '\0') {
-    if (!isdigit(c)) {
-      is_number = false;
-      break;
+  // Literal part, real literals have a '.' or an exponent
+  bool is_hex = length - i > 2 && token[i] == '0' && (token[i + 1] == 'x' || token[i + 1] == 'X');
+  bool is_real = false;
+  uint64_t magnitude = 0;
+  bool overflow = false;
+  size_t literal_start = i;
+
+  if (is_hex) {
+    i += 2;
+    size_t digits_start = i;
+    for (; i < length && hex_digit(token[i]) >= 0; ++i) {
+      if (magnitude >> 60) overflow = true;
+      magnitude = magnitude << 4 | hex_digit(token[i]);
+    }
+    if (i == digits_start) return PARSE_INVALID_NUMBER;
+  } else {
+    size_t digits = 0;
+    for (; i < length && is_digit(token[i]); ++i, ++digits) {
+      uint64_t digit = token[i] - '0';
+      if (magnitude > (UINT64_MAX - digit) / 10) overflow = true;
+      magnitude = magnitude * 10 + digit;
+    }
+    if (i < length && token[i] == '.') {
+      is_real = true;
+      for (++i; i < length && is_digit(token[i]); ++i, ++digits);
+    }
+    if (digits == 0) return PARSE_INVALID_NUMBER;
+    if (i < length && (token[i] == 'e' || token[i] == 'E')) {
+      is_real = true;
+      ++i;
+      if (i < length && (token[i] == '-' || token[i] == '+')) ++i;
+      size_t exponent_start = i;
+      for (; i < length && is_digit(token[i]); ++i);
+      if (i == exponent_start) return PARSE_INVALID_NUMBER;
     }
-    current_arg.push_back(c);
-    c = arguments[++i];
   }
+  size_t literal_end = i;
 
-  *position = i;
-
-  if (current_arg.size() > 0 && is_number) {
-    *result = std::stoi(current_arg);
-    return true;
+  ScalarType type;
+  if (!suffix_type(token + i, length - i, is_real, &type)) {
+    return PARSE_INVALID_SUFFIX;
   }
 
-  return false;
+  value->type = VALUE;
+  value->scalar_type = type;
+  switch (type) {
+    case I32:
+    {
+      uint64_t limit = negative ? (uint64_t) INT32_MAX + 1 : (uint64_t) INT32_MAX;
+      if (overflow || magnitude > limit) return PARSE_OUT_OF_RANGE;
+      value->size = sizeof(int32_t);
+      value->value.i32 = negative ? (int32_t) (0 - (uint32_t) magnitude) : (int32_t) magnitude;
+      break;
+    }
+    case I64:
+    {
+      uint64_t limit = negative ? (uint64_t) INT64_MAX + 1 : (uint64_t) INT64_MAX;
+      if (overflow || magnitude > limit) return PARSE_OUT_OF_RANGE;
+      value->size = sizeof(int64_t);
+      value->value.i64 = negative ? (int64_t) (0 - magnitude) : (int64_t) magnitude;
+      break;
+    }
+    case F32:
+    case F64:
+    {
+      double real;
+      if (is_hex || !is_real) {
+        // Integer literal with a real suffix, e.g. "2f"
+        if (overflow) return PARSE_OUT_OF_RANGE;
+        real = (double) magnitude;
+      } else {
+        // strtod needs a terminated string, the literal is copied to the stack
+        size_t literal_length = literal_end - literal_start;
+        if (literal_length >= MAX_NUMBER_LENGTH) return PARSE_INVALID_NUMBER;
+        char literal[MAX_NUMBER_LENGTH];
+        memcpy(literal, token + literal_start, literal_length);
+        literal[literal_length] = '\0';
+        real = strtod(literal, nullptr);
+      }
+      if (negative) real = -real;
+
+      if (type == F32) {
+        // Checked after rounding, decimals just above FLT_MAX still round to it
+        float rounded = (float) real;
+        if (isinf(rounded)) return PARSE_OUT_OF_RANGE;
+        value->size = sizeof(float);
+        value->value.f32 = rounded;
+      } else {
+        if (isinf(real)) return PARSE_OUT_OF_RANGE;
+        value->size = sizeof(double);
+        value->value.f64 = real;
+      }
+      break;
+    }
+  }
+  return PARSE_OK;
 }
 
-// @TODO receive size to not depend on correctly terminated strings
-// @TODO SCALAR args are now a pointer, currently unsupported
-bool parse_arguments(const char *arguments, char **parsed_args, int *arg_count, int *kernel_id, char **function_name) {
-  std::cout << "Parsing arguments: " << arguments << '\n';
-
-  // Allocate memory for arguments
-  size_t args_total_size = 1024 * 8;
-  char *args = (char *) malloc(args_total_size);
-  int args_count = 0;
-  size_t args_size = 0;
-
-  // Save base ptr
-  *parsed_args = args;
-
-  int i = 0; // arguments index
-  bool parse_correct; 
-  bool is_number;
+ParseError parse_arguments(const char *input, size_t length, char *buffer, size_t buffer_size, ParsedArguments *parsed) {
+  Parser parser = { input, length, 0, buffer, buffer_size, 0 };
 
   // Kernel mem_id
-  parse_correct = parse_integer(&i, arguments, kernel_id);
-  if (!parse_correct) {
-    std::cerr << "Error: number expected (kernel mem_id)\n";
-    return false;
+  if (!parse_id(parser, &parsed->kernel_id)) {
+    return parser.error(PARSE_EXPECTED_KERNEL_ID);
   }
 
-  std::cout << "Kernel id: " << kernel_id << '\n';
-
-  // Kernel name
-  std::string function_name_s = parse_next(&(++i), arguments, nullptr);
-  size_t function_name_size = sizeof(char) * (function_name_s.size() + 1);
-  *function_name = (char *) malloc(function_name_size);
-  strncpy(*function_name, function_name_s.c_str(), function_name_s.size() + 1);
+  // Kernel name, copied out with its terminator and padded so the arguments start aligned
+  parser.skip_space();
+  size_t name_length = parser.token_length();
+  if (name_length == 0) {
+    return parser.error(PARSE_EXPECTED_FUNCTION_NAME);
+  }
+  size_t name_size = (name_length + 1 + OUTPUT_ALIGNMENT - 1) / OUTPUT_ALIGNMENT * OUTPUT_ALIGNMENT;
+  char *function_name = parser.append(name_size);
+  if (function_name == nullptr) {
+    return parser.error(PARSE_BUFFER_TOO_SMALL);
+  }
+  memcpy(function_name, input + parser.position, name_length);
+  function_name[name_length] = '\0';
+  parser.position += name_length;
 
-  std::cout << "Function name: " << function_name_s << '\n';
+  parsed->function_name = function_name;
+  parsed->args = buffer + parser.out_size;
+  parsed->arg_count = 0;
 
   // Rest of the arguments
-  char c = arguments[i];
-  while (c != '\0') {
-    if (c == ' ') c = arguments[++i];
-
-    std::string current_arg = parse_next(&i, arguments, &is_number);
-
-    if (current_arg.size() > 0) { 
+  for (;;) {
+    parser.skip_space();
+    if (parser.position == length || input[parser.position] == '\0') break;
 
-      // Buffer
-      if (current_arg == "b") {
-        std::cout << "Parsing buffer..." << '\n';
+    const char *token = input + parser.position;
+    size_t token_length = parser.token_length();
 
-        current_arg.clear();
+    // Buffer
+    if (token_length == 1 && token[0] == 'b') {
+      parser.position += 1;
 
-        // In/out
-        bool is_in;
-        parse_correct = parse_bool(&(++i), arguments, &is_in);
-        if (!parse_correct) {
-          std::cerr << "Error: 1|0 expected (buffer in|out)\n";
-          return false;
-        }
-
-        // Id
-        int id;
-        parse_correct = parse_integer(&(++i), arguments, &id);
-        if (!parse_correct) {
-            std::cerr << "Error: number expected (buffer id)\n";
-            return false;
-        }
-
-        size_t new_args_size = args_size + sizeof(BufferArg);
-        if(args_total_size <= args_size) {
-          std::cerr << "Ran out of memory for arguments\n";
-          return false;
-        }
+      // In/out
+      parser.skip_space();
+      if (parser.token_length() != 1 || (input[parser.position] != '0' && input[parser.position] != '1')) {
+        return parser.error(PARSE_EXPECTED_DIRECTION);
+      }
+      bool is_in = input[parser.position] == '1';
+      parser.position += 1;
 
-        BufferArg *arg = (BufferArg *)args;
-        *arg = {BUFFER, id, is_in};
-        ++args_count;
-        args_size = new_args_size;
-        args += sizeof(BufferArg);
+      // Id
+      int id;
+      if (!parse_id(parser, &id)) {
+        return parser.error(PARSE_EXPECTED_BUFFER_ID);
+      }
 
-        std::cout << "Buffer: is_in = " << is_in << " id = " << id << '\n';
+      char *out = parser.append(sizeof(BufferArg));
+      if (out == nullptr) {
+        return parser.error(PARSE_BUFFER_TOO_SMALL);
       }
+      BufferArg arg = {BUFFER, id, is_in};
+      memcpy(out, &arg, sizeof(BufferArg));
+    }
 
+    // Number
+    else if (is_digit(token[0]) || token[0] == '-' || token[0] == '+' || token[0] == '.') {
+      ValueArg arg;
+      memset(&arg, 0, sizeof(ValueArg));
+      ParseErrorCode code = parse_scalar(token, token_length, &arg);
+      if (code != PARSE_OK) {
+        return parser.error(code);
+      }
 
-      // Number
-      else if (is_number) {
-        assert(false && "Scalar args not implemented in parser");
-        /*
-        float value = std::stof(current_arg); // TODO support multiple types
+      char *out = parser.append(sizeof(ValueArg));
+      if (out == nullptr) {
+        return parser.error(PARSE_BUFFER_TOO_SMALL);
+      }
+      memcpy(out, &arg, sizeof(ValueArg));
+      parser.position += token_length;
+    }
 
-        size_t new_args_size = args_size + sizeof(ValueArg);
-        if(args_total_size <= args_size) {
-          std::cerr << "Ran out of memory for arguments\n";
-          return false;
-        }
+    // String
+    else {
+      return parser.error(PARSE_UNEXPECTED_TOKEN);
+    }
 
-        ValueArg *arg = (ValueArg *)args;
-        *arg = {VALUE, value};
-        ++args_count;
-        args_size += new_args_size;
-        args += sizeof(ValueArg);
+    ++parsed->arg_count;
+  }
 
-        std::cout << "Number: " << current_arg << '\n';
-        */
-      }
+  parsed->size = parser.out_size;
+  return parser.error(PARSE_OK);
+}
 
-      // String
-      else {
-        std::cerr << "String: " << current_arg << " NOT SUPPORTED YET\n";
-        return false;
-      }
-    }
-    c = arguments[i];
+ParseError parse_arguments(const char *input, size_t length, ArgumentArena &arena, ParsedArguments *parsed) {
+  size_t start = (arena.used + OUTPUT_ALIGNMENT - 1) / OUTPUT_ALIGNMENT * OUTPUT_ALIGNMENT;
+  if (start > arena.capacity) {
+    return { PARSE_BUFFER_TOO_SMALL, 0 };
   }
 
-  *arg_count = args_count;
-  
-  return true;
+  ParseError result = parse_arguments(input, length, arena.data + start, arena.capacity - start, parsed);
+  if (result.code == PARSE_OK) arena.used = start + parsed->size;
+  return result;
 }
 
-// Receiving a void * vector here since we only use this for testing and makes it easy for the test.
-std::string args_to_string(std::string function_name, int kernel_id, std::vector<void *> args) {
+std::string args_to_string(const ParsedArguments &parsed) {
   std::stringstream ss;
-  ss << kernel_id;
-  ss << " " << function_name;
-
-  for (void *arg: args) {
-    Arg *base = (Arg *) arg; 
-    switch (base->type) {
-      case BUFFER: 
+  ss << parsed.kernel_id;
+  ss << " " << parsed.function_name;
+
+  const char *current_arg = parsed.args;
+  for (int i = 0; i < parsed.arg_count; ++i) {
+    Arg base;
+    memcpy(&base, current_arg, sizeof(Arg));
+    switch (base.type) {
+      case BUFFER:
       {
-        BufferArg *buffer_arg = (BufferArg *) arg; 
-        ss << " b " << buffer_arg->is_in << ' ' << buffer_arg->id; //<< std::hex << buffer_arg->ptr << std::dec;
+        BufferArg buffer_arg;
+        memcpy(&buffer_arg, current_arg, sizeof(BufferArg));
+        current_arg += sizeof(BufferArg);
+        ss << " b " << buffer_arg.is_in << ' ' << buffer_arg.id;
         break;
       }
       case SCALAR:
       {
-        ScalarArg *scalar_arg = (ScalarArg *) arg;
-        ss << ' ' << scalar_arg->ptr;
+        ScalarArg scalar_arg;
+        memcpy(&scalar_arg, current_arg, sizeof(ScalarArg));
+        current_arg += sizeof(ScalarArg);
+        ss << ' ' << scalar_arg.ptr;
+        break;
+      }
+      case VALUE:
+      {
+        ValueArg value_arg;
+        memcpy(&value_arg, current_arg, sizeof(ValueArg));
+        current_arg += sizeof(ValueArg);
+        switch (value_arg.scalar_type) {
+          case I32: ss << ' ' << value_arg.value.i32 << "i32"; break;
+          case I64: ss << ' ' << value_arg.value.i64 << "i64"; break;
+          // Enough digits to read back the same value, showpoint keeps reals from reading back as integers
+          case F32:
+            ss.precision(std::numeric_limits<float>::max_digits10);
+            ss << ' ' << std::showpoint << value_arg.value.f32 << std::noshowpoint << "f32";
+            break;
+          case F64:
+            ss.precision(std::numeric_limits<double>::max_digits10);
+            ss << ' ' << std::showpoint << value_arg.value.f64 << std::noshowpoint << "f64";
+            break;
+        }
         break;
       }
     }
@@ -233,14 +386,4 @@ std::string args_to_string(std::string function_name, int kernel_id, std::vector
   return ss.str();
 }
 
-void print_args(std::vector<void *> args) {
-  int i = 0;
-  std::cout << "print_args not implemented\n"; 
-  /*
-  for (Arg *arg: args) {
-    std::cout << ++i << ") is_buffer = " << arg->is_buffer << " value = " << arg->get_value_ptr() << " size = " << arg->size << " ptr = " << arg->get_value_ptr() << " is_in = " << arg->is_in << '\n';
-  }
-  */
-}
-
 }
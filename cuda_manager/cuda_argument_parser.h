@@ -1,23 +1,69 @@
 #include "kernel_arguments.h"
-#include "cuda_memory_manager.h"
-#include <vector>
 #include <string>
+#include <stddef.h>
 
 namespace cuda_manager {
 
-// TODO NOT CURRENTLY WORKING, SCALAR ARGS NOT SUPPORTED
-/*! \brief Parse arguments from a string.
+enum ParseErrorCode {
+  PARSE_OK,
+  PARSE_EXPECTED_KERNEL_ID,     // Input does not start with a kernel id
+  PARSE_EXPECTED_FUNCTION_NAME,
+  PARSE_EXPECTED_DIRECTION,     // Buffer without its 0|1 in/out flag
+  PARSE_EXPECTED_BUFFER_ID,
+  PARSE_INVALID_NUMBER,         // Malformed scalar
+  PARSE_INVALID_SUFFIX,         // Scalar suffix that is not a type, or does not match the literal
+  PARSE_OUT_OF_RANGE,           // Scalar or id that does not fit its type
+  PARSE_UNEXPECTED_TOKEN,
+  PARSE_BUFFER_TOO_SMALL        // Output buffer ran out, nothing is reported past this point
+};
+
+struct ParseError {
+  ParseErrorCode code;
+  size_t position; // Offset in the input where the error was found
+};
+
+// \return static description of code
+const char *parse_error_string(ParseErrorCode code);
+
+// Result of parse_arguments, pointers are into the output buffer
+struct ParsedArguments {
+  int kernel_id;
+  const char *function_name; // Null terminated
+  const char *args;          // Arguments laid out as launch_kernel expects them
+  int arg_count;
+  size_t size;               // Bytes of the output buffer in use
+};
+
+/*! \brief Bump allocator for parse_arguments output, so several requests can be parsed into one block.
+ * Memory is owned by the caller and only handed back as a whole by reset().
+ */
+struct ArgumentArena {
+  char *data;
+  size_t capacity;
+  size_t used;
+
+  ArgumentArena(char *data, size_t capacity): data(data), capacity(capacity), used(0) {}
+  void reset() { used = 0; }
+};
+
+/*! \brief Parse a launch request in a single pass, without allocating.
  * The following syntax is required: {kernel_mem_id kernel_name arguments}
  * arguments:
  *    - Buffer: {'b' is_in id} "b {0|1} 5"
- *    - Scalar: {value} "23"
+ *    - Scalar: {value[suffix]} "23", "-1l", "2.5", "1e-3d"
+ *      Integers are i32 and reals f32 unless suffixed: 'l' or 'i64' for i64, 'd' or 'f64' for f64,
+ *      'i32' and 'f'/'f32' name the default types. Integers may be hexadecimal (0x1f).
  * example: "0 saxpy 2.5 b 1 1 b 1 2 b 0 3 4096"
- * \note Allocates memory for kernel_name and parsed_args
- * \return true if successful
+ * \param length bytes of input, input does not have to be null terminated
+ * \param buffer receives the function name and the arguments, 8 byte aligned
+ * \return PARSE_OK, or the first error and where it was found
  */
-bool parse_arguments(const char *arguments, char **parsed_args, int *arg_count, int *kernel_mem_id, char **kernel_name);
+ParseError parse_arguments(const char *input, size_t length, char *buffer, size_t buffer_size, ParsedArguments *parsed);
+
+// As above, output goes to the free space of arena which only grows on success
+ParseError parse_arguments(const char *input, size_t length, ArgumentArena &arena, ParsedArguments *parsed);
 
-std::string args_to_string(std::string kernel_name, int kernel_mem_id, std::vector<void *> args);
-void print_args(std::vector<void *> args);
+// Format parsed arguments back in the request syntax, scalars always carry their suffix
+std::string args_to_string(const ParsedArguments &parsed);
 
 }
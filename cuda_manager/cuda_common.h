@@ -4,6 +4,8 @@
 #include <nvrtc.h>
 #include <cuda.h>
 #include <iostream>
+#include <utility>
+#include <stddef.h>
 
 #define CUDA_SAFE_CALL(x)                                         \
   do {                                                            \
@@ -27,4 +29,33 @@
     }                                                             \
   } while(0)
 
+namespace cuda_manager {
+
+// Makes a context current for the calling thread until the end of the scope, then restores the previous one
+struct ScopedContext {
+  ScopedContext(CUcontext context) { CUDA_SAFE_CALL(cuCtxPushCurrent(context)); }
+  ~ScopedContext() { CUDA_SAFE_CALL(cuCtxPopCurrent(nullptr)); }
+
+  ScopedContext(const ScopedContext &) = delete;
+  ScopedContext &operator=(const ScopedContext &) = delete;
+};
+
+const size_t CACHE_LINE_SIZE = 64;
+
+/*! \brief value followed by padding up to a cache line, so members declared after it stay off the line
+ * writers of value keep invalidating. Padded rather than aligned as C++14 new ignores over-alignment.
+ */
+template <typename T>
+struct CachePadded {
+  static_assert(sizeof(T) < CACHE_LINE_SIZE, "Padded value must be smaller than a cache line");
+
+  T value;
+  char padding[CACHE_LINE_SIZE - sizeof(T)];
+
+  template <typename... Args>
+  explicit CachePadded(Args &&... args): value(std::forward<Args>(args)...) {}
+};
+
+}
+
 #endif
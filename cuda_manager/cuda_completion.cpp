@@ -0,0 +1,49 @@
+#include "cuda_completion.h"
+#include "cuda_common.h"
+
+namespace cuda_manager {
+
+CompletionHandle::CompletionHandle(CUcontext context, CUstream stream, CUstream callback_stream):
+  context(context), callback_stream(callback_stream) {
+  CUDA_SAFE_CALL(cuCtxPushCurrent(context));
+  CUDA_SAFE_CALL(cuEventCreate(&event, CU_EVENT_DISABLE_TIMING));
+  CUDA_SAFE_CALL(cuEventRecord(event, stream));
+  CUDA_SAFE_CALL(cuCtxPopCurrent(nullptr));
+}
+
+CompletionHandle::~CompletionHandle() {
+  CUDA_SAFE_CALL(cuEventDestroy(event));
+}
+
+bool CompletionHandle::poll() {
+  CUresult result = cuEventQuery(event);
+  if (result == CUDA_ERROR_NOT_READY) return false;
+  CUDA_SAFE_CALL(result);
+  return true;
+}
+
+void CompletionHandle::wait() {
+  CUDA_SAFE_CALL(cuEventSynchronize(event));
+}
+
+static void run_callback(void *data) {
+  std::function<void()> *callback = (std::function<void()> *) data;
+  (*callback)();
+  delete callback;
+}
+
+void CompletionHandle::on_complete(std::function<void()> callback) {
+  if (poll()) {
+    callback();
+    return;
+  }
+
+  // The callback stream waits on the event alone, so later work queued on the launch
+  // stream does not delay the callback
+  CUDA_SAFE_CALL(cuCtxPushCurrent(context));
+  CUDA_SAFE_CALL(cuStreamWaitEvent(callback_stream, event, 0));
+  CUDA_SAFE_CALL(cuLaunchHostFunc(callback_stream, run_callback, new std::function<void()>(callback)));
+  CUDA_SAFE_CALL(cuCtxPopCurrent(nullptr));
+}
+
+}
@@ -0,0 +1,47 @@
+#ifndef CUDA_COMPLETION_H
+#define CUDA_COMPLETION_H
+
+#include <cuda.h>
+#include <functional>
+#include <memory>
+
+namespace cuda_manager {
+
+/*! \brief Tracks the completion of asynchronous work queued on a stream.
+ * Backed by a CUevent recorded right after the work, so it only covers the work queued
+ * on that stream up to the moment the handle was created.
+ */
+class CompletionHandle {
+private:
+  CUcontext context;
+  CUevent event;
+  CUstream callback_stream; // Stream where completion callbacks are queued
+
+public:
+  /*! \brief Record a completion event on stream.
+   * \param callback_stream stream, from the same context, used to run completion callbacks
+   */
+  CompletionHandle(CUcontext context, CUstream stream, CUstream callback_stream);
+  ~CompletionHandle();
+
+  CompletionHandle(const CompletionHandle &) = delete;
+  CompletionHandle &operator=(const CompletionHandle &) = delete;
+
+  // \return true if the work has completed, does not block
+  bool poll();
+
+  // Block until the work has completed
+  void wait();
+
+  /*! \brief Run callback once the work has completed.
+   * Runs right away on the calling thread if the work already completed, otherwise on a driver thread.
+   * \note As with any CUDA host function the callback must not make CUDA calls
+   */
+  void on_complete(std::function<void()> callback);
+};
+
+typedef std::shared_ptr<CompletionHandle> CompletionHandlePtr;
+
+}
+
+#endif
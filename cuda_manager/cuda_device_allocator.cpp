@@ -0,0 +1,243 @@
+#include "cuda_device_allocator.h"
+#include <algorithm>
+#include <chrono>
+#include <assert.h>
+
+namespace cuda_manager {
+
+const size_t DeviceAllocator::MIN_BLOCK_SIZE;
+const size_t DeviceAllocator::SMALL_LIMIT;
+const size_t DeviceAllocator::SMALL_SLAB_SIZE;
+const size_t DeviceAllocator::LARGE_SLAB_SIZE;
+
+static size_t round_up(size_t size, size_t alignment) {
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+// Index of the smallest size class holding size bytes, classes are MIN_BLOCK_SIZE << index
+static size_t size_class_index(size_t size) {
+  size_t index = 0;
+  while ((DeviceAllocator::MIN_BLOCK_SIZE << index) < size) ++index;
+  return index;
+}
+
+DeviceAllocator::DeviceAllocator(SlabBackend *backend): backend(backend) {
+  free_blocks.resize(size_class_index(SMALL_LIMIT) + 1);
+}
+
+bool DeviceAllocator::reserve_slab(size_t size, uint64_t *address) {
+  if (!backend->allocate_slab(size, address)) {
+    // Memory pressure, give back what is cached and try once more
+    trim();
+    if (!backend->allocate_slab(size, address)) return false;
+  }
+
+  ++slab_allocation_count;
+  reserved_bytes += size;
+  return true;
+}
+
+bool DeviceAllocator::allocate_small(size_t index, uint64_t *address) {
+  size_t block_size = MIN_BLOCK_SIZE << index;
+  std::vector<uint64_t> &blocks = free_blocks[index];
+
+  if (blocks.empty()) {
+    uint64_t slab;
+    if (!reserve_slab(SMALL_SLAB_SIZE, &slab)) return false;
+
+    small_slabs[slab] = { index, 0 };
+    // Pushed in reverse so blocks are handed out in address order
+    for (size_t offset = SMALL_SLAB_SIZE; offset >= block_size; offset -= block_size) {
+      blocks.push_back(slab + offset - block_size);
+    }
+  }
+
+  *address = blocks.back();
+  blocks.pop_back();
+
+  std::map<uint64_t, SmallSlab>::iterator slab = --small_slabs.upper_bound(*address);
+  ++slab->second.live_blocks;
+
+  live_allocations[*address] = { block_size, slab->first, true };
+  used_bytes += block_size;
+  return true;
+}
+
+bool DeviceAllocator::allocate_large(size_t size, uint64_t *address) {
+  std::multimap<size_t, uint64_t>::iterator best_fit = free_ranges_by_size.lower_bound(size);
+
+  if (best_fit == free_ranges_by_size.end()) {
+    size_t slab_size = std::max(LARGE_SLAB_SIZE, round_up(size, SMALL_SLAB_SIZE));
+    uint64_t slab;
+    if (!reserve_slab(slab_size, &slab)) return false;
+
+    large_slabs[slab] = slab_size;
+    insert_free_range(slab, slab_size);
+    best_fit = free_ranges_by_size.lower_bound(size);
+  }
+
+  uint64_t range_address = best_fit->second;
+  size_t range_size = best_fit->first;
+  erase_free_range(free_ranges.find(range_address));
+
+  // Keep the tail of the range for later requests
+  if (range_size > size) {
+    insert_free_range(range_address + size, range_size - size);
+  }
+
+  *address = range_address;
+  uint64_t slab = (--large_slabs.upper_bound(range_address))->first;
+  live_allocations[*address] = { size, slab, false };
+  used_bytes += size;
+  return true;
+}
+
+bool DeviceAllocator::allocate(size_t size, uint64_t *address) {
+  assert(size > 0 && "Allocation size is 0");
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  size_t slabs_before = slab_allocation_count;
+
+  bool success = size <= SMALL_LIMIT ?
+      allocate_small(size_class_index(size), address) :
+      allocate_large(round_up(size, MIN_BLOCK_SIZE), address);
+
+  if (success) {
+    ++allocation_count;
+    if (slab_allocation_count == slabs_before) ++cache_hit_count;
+    allocation_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  }
+  return success;
+}
+
+void DeviceAllocator::free(uint64_t address) {
+  std::unordered_map<uint64_t, Allocation>::iterator it = live_allocations.find(address);
+  assert(it != live_allocations.end() && "Address was not allocated");
+
+  Allocation allocation = it->second;
+  live_allocations.erase(it);
+  used_bytes -= allocation.size;
+  ++deallocation_count;
+
+  if (allocation.is_small) {
+    SmallSlab &slab = small_slabs[allocation.slab];
+    --slab.live_blocks;
+    free_blocks[slab.size_class].push_back(address);
+  } else {
+    free_large(address, allocation.size, allocation.slab);
+  }
+}
+
+void DeviceAllocator::free_large(uint64_t address, size_t size, uint64_t slab) {
+  // Coalesce with the neighbouring free ranges, never across slabs as they are separate device allocations
+  std::map<uint64_t, size_t>::iterator next = free_ranges.find(address + size);
+  if (next != free_ranges.end() && next->first < slab + large_slabs[slab]) {
+    size += next->second;
+    erase_free_range(next);
+  }
+
+  std::map<uint64_t, size_t>::iterator prev = free_ranges.lower_bound(address);
+  if (prev != free_ranges.begin()) {
+    --prev;
+    if (prev->first >= slab && prev->first + prev->second == address) {
+      address = prev->first;
+      size += prev->second;
+      erase_free_range(prev);
+    }
+  }
+
+  insert_free_range(address, size);
+}
+
+void DeviceAllocator::insert_free_range(uint64_t address, size_t size) {
+  free_ranges[address] = size;
+  free_ranges_by_size.emplace(size, address);
+}
+
+void DeviceAllocator::erase_free_range(std::map<uint64_t, size_t>::iterator it) {
+  auto range = free_ranges_by_size.equal_range(it->second);
+  for (auto by_size = range.first; by_size != range.second; ++by_size) {
+    if (by_size->second == it->first) {
+      free_ranges_by_size.erase(by_size);
+      break;
+    }
+  }
+  free_ranges.erase(it);
+}
+
+size_t DeviceAllocator::trim() {
+  size_t released = 0;
+
+  // Small slabs without live blocks, their blocks have to leave the free lists first
+  for (std::vector<uint64_t> &blocks: free_blocks) {
+    blocks.erase(std::remove_if(blocks.begin(), blocks.end(), [this](uint64_t block) {
+      return (--small_slabs.upper_bound(block))->second.live_blocks == 0;
+    }), blocks.end());
+  }
+  for (std::map<uint64_t, SmallSlab>::iterator it = small_slabs.begin(); it != small_slabs.end();) {
+    if (it->second.live_blocks == 0) {
+      backend->free_slab(it->first, SMALL_SLAB_SIZE);
+      released += SMALL_SLAB_SIZE;
+      ++slab_release_count;
+      it = small_slabs.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  // Large slabs covered by a single free range
+  for (std::map<uint64_t, size_t>::iterator it = large_slabs.begin(); it != large_slabs.end();) {
+    std::map<uint64_t, size_t>::iterator range = free_ranges.find(it->first);
+    if (range != free_ranges.end() && range->second == it->second) {
+      erase_free_range(range);
+      backend->free_slab(it->first, it->second);
+      released += it->second;
+      ++slab_release_count;
+      it = large_slabs.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  reserved_bytes -= released;
+  return released;
+}
+
+void DeviceAllocator::release_all() {
+  for (auto &slab: small_slabs) {
+    backend->free_slab(slab.first, SMALL_SLAB_SIZE);
+  }
+  for (auto &slab: large_slabs) {
+    backend->free_slab(slab.first, slab.second);
+  }
+
+  for (std::vector<uint64_t> &blocks: free_blocks) blocks.clear();
+  small_slabs.clear();
+  large_slabs.clear();
+  free_ranges.clear();
+  free_ranges_by_size.clear();
+  live_allocations.clear();
+  reserved_bytes = 0;
+  used_bytes = 0;
+}
+
+AllocatorStats DeviceAllocator::get_stats() const {
+  AllocatorStats stats;
+  stats.allocations = allocation_count;
+  stats.deallocations = deallocation_count;
+  stats.cache_hits = cache_hit_count;
+  stats.slab_allocations = slab_allocation_count;
+  stats.slab_releases = slab_release_count;
+  stats.reserved_bytes = reserved_bytes;
+  stats.used_bytes = used_bytes;
+  stats.largest_free_block = free_ranges_by_size.empty() ? 0 : free_ranges_by_size.rbegin()->first;
+
+  size_t free_bytes = 0;
+  for (auto &range: free_ranges) free_bytes += range.second;
+  stats.fragmentation = free_bytes == 0 ? 0.0 : 1.0 - (double) stats.largest_free_block / free_bytes;
+
+  stats.average_allocation_ns = allocation_count == 0 ? 0.0 : (double) allocation_ns / allocation_count;
+  return stats;
+}
+
+}
@@ -0,0 +1,109 @@
+#ifndef CUDA_DEVICE_ALLOCATOR_H
+#define CUDA_DEVICE_ALLOCATOR_H
+
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace cuda_manager {
+
+/*! \brief Source of the slabs carved up by DeviceAllocator.
+ * Keeps the allocator free of driver calls, so its bookkeeping can run without a GPU.
+ */
+class SlabBackend {
+public:
+  virtual ~SlabBackend() {}
+  // \return false if the memory is exhausted
+  virtual bool allocate_slab(size_t size, uint64_t *address) = 0;
+  virtual void free_slab(uint64_t address, size_t size) = 0;
+};
+
+struct AllocatorStats {
+  size_t allocations;
+  size_t deallocations;
+  size_t cache_hits;          // Allocations served from already reserved slabs
+  size_t slab_allocations;    // Slabs requested from the backend
+  size_t slab_releases;       // Slabs given back to the backend by trimming
+  size_t reserved_bytes;      // Bytes held in slabs
+  size_t used_bytes;          // Bytes handed out, rounded to block sizes
+  size_t largest_free_block;  // Largest block the large pool can serve without a new slab
+  double fragmentation;       // 1 - largest free block / free bytes of the large pool
+  double average_allocation_ns;
+};
+
+/*! \brief A caching allocator serving device buffers from large slabs.
+ * Requests up to SMALL_LIMIT bytes are rounded up to a power of two size class, every class
+ * carves fixed size blocks out of its own slabs. Larger requests are served best fit from
+ * large slabs, freed ranges are coalesced with their neighbours within the same slab.
+ * Slabs are only given back to the backend by trim(), or when a new slab cannot be reserved.
+ * \note Not thread safe
+ */
+class DeviceAllocator {
+private:
+  struct SmallSlab {
+    size_t size_class;
+    size_t live_blocks;
+  };
+
+  struct Allocation {
+    size_t size;      // Block size, rounded
+    uint64_t slab;    // Base address of the owning slab
+    bool is_small;
+  };
+
+  SlabBackend *backend;
+
+  // Small pool: free blocks per size class and slabs by base address
+  std::vector<std::vector<uint64_t>> free_blocks;
+  std::map<uint64_t, SmallSlab> small_slabs;
+
+  // Large pool: slabs by base address (value is the slab size) and free ranges, by address and by size
+  std::map<uint64_t, size_t> large_slabs;
+  std::map<uint64_t, size_t> free_ranges;
+  std::multimap<size_t, uint64_t> free_ranges_by_size;
+
+  std::unordered_map<uint64_t, Allocation> live_allocations;
+
+  size_t allocation_count = 0;
+  size_t deallocation_count = 0;
+  size_t cache_hit_count = 0;
+  size_t slab_allocation_count = 0;
+  size_t slab_release_count = 0;
+  size_t reserved_bytes = 0;
+  size_t used_bytes = 0;
+  uint64_t allocation_ns = 0;
+
+  bool reserve_slab(size_t size, uint64_t *address);
+  bool allocate_small(size_t size_class, uint64_t *address);
+  bool allocate_large(size_t size, uint64_t *address);
+  void free_large(uint64_t address, size_t size, uint64_t slab);
+  void insert_free_range(uint64_t address, size_t size);
+  void erase_free_range(std::map<uint64_t, size_t>::iterator it);
+
+public:
+  static const size_t MIN_BLOCK_SIZE = 256;             // Smallest size class, also the alignment of every block
+  static const size_t SMALL_LIMIT = 1024 * 1024;        // Largest size class
+  static const size_t SMALL_SLAB_SIZE = 2 * 1024 * 1024;
+  static const size_t LARGE_SLAB_SIZE = 32 * 1024 * 1024; // Minimum size of a large slab
+
+  DeviceAllocator(SlabBackend *backend);
+  ~DeviceAllocator() {}
+
+  // \return false if the memory is exhausted even after trimming
+  bool allocate(size_t size, uint64_t *address);
+  void free(uint64_t address);
+
+  // Give every unused slab back to the backend, \return released bytes
+  size_t trim();
+
+  // Give every slab back to the backend, live allocations included
+  void release_all();
+
+  AllocatorStats get_stats() const;
+};
+
+}
+
+#endif
@@ -0,0 +1,82 @@
+#include "cuda_device_worker.h"
+#include "cuda_common.h"
+
+namespace cuda_manager {
+
+const int DeviceWorker::SPIN_COUNT;
+
+void DeviceTask::finish() {
+  std::lock_guard<std::mutex> lock(mutex);
+  finished.store(true, std::memory_order_release);
+  // Notified under the lock, the waiter may destroy the task as soon as it sees finished
+  finished_cv.notify_one();
+}
+
+void DeviceTask::wait() {
+  // Most calls are short, spinning saves the wake up latency
+  for (int i = 0; i < DeviceWorker::SPIN_COUNT; ++i) {
+    if (finished.load(std::memory_order_acquire)) {
+      // The worker may still be in finish(), the task can only go away once it released the lock
+      std::lock_guard<std::mutex> lock(mutex);
+      return;
+    }
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+  finished_cv.wait(lock, [this] { return finished.load(std::memory_order_acquire); });
+}
+
+DeviceWorker::DeviceWorker(CUcontext context):
+  context(context), pending(0), sleeping(false), stopping(false) {
+  thread = std::thread(&DeviceWorker::run, this);
+}
+
+DeviceWorker::~DeviceWorker() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake_cv.notify_one();
+  thread.join();
+}
+
+void DeviceWorker::submit(DeviceTask *task) {
+  queue.push(task);
+  pending.fetch_add(1);
+
+  // Paired with the worker setting sleeping before it checks pending, one of the two sees the other
+  if (sleeping.load()) {
+    std::lock_guard<std::mutex> lock(mutex);
+    wake_cv.notify_one();
+  }
+}
+
+void DeviceWorker::run() {
+  CUDA_SAFE_CALL(cuCtxSetCurrent(context));
+
+  int idle_polls = 0;
+  for (;;) {
+    MpscNode *node = queue.pop();
+    if (node != nullptr) {
+      DeviceTask *task = static_cast<DeviceTask *>(node);
+      task->run();
+      pending.fetch_sub(1);
+      task->finish();
+      idle_polls = 0;
+      continue;
+    }
+
+    // Empty, or a push is not linked yet, in which case pending is already counted
+    if (++idle_polls < SPIN_COUNT) continue;
+    idle_polls = 0;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    sleeping.store(true);
+    wake_cv.wait(lock, [this] { return pending.load() > 0 || stopping; });
+    sleeping.store(false);
+
+    if (stopping && pending.load() == 0) break;
+  }
+}
+
+}
@@ -0,0 +1,92 @@
+#ifndef CUDA_DEVICE_WORKER_H
+#define CUDA_DEVICE_WORKER_H
+
+#include "mpsc_queue.h"
+#include <cuda.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace cuda_manager {
+
+// Work routed to a DeviceWorker, the submitter owns it and keeps it alive until it is finished
+class DeviceTask : public MpscNode {
+private:
+  std::mutex mutex;
+  std::condition_variable finished_cv;
+  std::atomic<bool> finished;
+
+public:
+  DeviceTask(): finished(false) {}
+  virtual ~DeviceTask() {}
+
+  virtual void run() = 0;
+
+  // Called by the worker once run() returned, the task must not be touched by the worker afterwards
+  void finish();
+  // Block until the worker finished the task, spins briefly before sleeping
+  void wait();
+};
+
+/*! \brief A thread bound to the context of one device, running the tasks submitted to it in order.
+ * The context is made current once when the thread starts, so tasks never switch contexts.
+ * Tasks are queued through a lock free MPSC queue, the worker sleeps after spinning on an empty queue
+ * and submitters only take its lock to wake it up.
+ */
+class DeviceWorker {
+private:
+  template <typename F>
+  class CallTask : public DeviceTask {
+  private:
+    F &function;
+
+  public:
+    CallTask(F &function): function(function) {}
+    void run() override { function(); }
+  };
+
+  CUcontext context;
+  MpscQueue queue;
+  std::atomic<size_t> pending; // Submitted and not yet run
+  std::atomic<bool> sleeping;
+  std::atomic<bool> stopping;
+  std::mutex mutex;
+  std::condition_variable wake_cv;
+  std::thread thread;
+
+  void run();
+
+public:
+  // Empty polls before the worker goes to sleep
+  static const int SPIN_COUNT = 4096;
+
+  // Start the worker thread, bound to context
+  DeviceWorker(CUcontext context);
+  // Run every task already submitted, then stop the thread
+  ~DeviceWorker();
+
+  DeviceWorker(const DeviceWorker &) = delete;
+  DeviceWorker &operator=(const DeviceWorker &) = delete;
+
+  // Queue task, it runs after every task submitted before it
+  void submit(DeviceTask *task);
+
+  /*! \brief Run function on the worker and wait for it to return.
+   * Runs in place when called from the worker itself, so tasks can call back into routed code.
+   */
+  template <typename F>
+  void call(F &&function) {
+    if (std::this_thread::get_id() == thread.get_id()) {
+      function();
+      return;
+    }
+    CallTask<F> task(function);
+    submit(&task);
+    task.wait();
+  }
+};
+
+}
+
+#endif
@@ -0,0 +1,16 @@
+#include "cuda_format.h"
+#include <stdarg.h>
+#include <stdio.h>
+
+namespace cuda_manager {
+
+void append_format(std::string &out, const char *format, ...) {
+  char line[512];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  out += line;
+}
+
+}
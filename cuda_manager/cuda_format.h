@@ -0,0 +1,13 @@
+#ifndef CUDA_FORMAT_H
+#define CUDA_FORMAT_H
+
+#include <string>
+
+namespace cuda_manager {
+
+// Appends to out, snprintf style, for the text dumps of metrics and reports. Lines are cut at 512 bytes
+void append_format(std::string &out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+}
+
+#endif
@@ -0,0 +1,244 @@
+#include "cuda_graph.h"
+#include "cuda_common.h"
+#include "cuda_metrics.h"
+#include "kernel_arguments.h"
+#include <assert.h>
+#include <string.h>
+
+namespace cuda_manager {
+
+CudaGraph::CudaGraph(CudaManager &cuda_manager, int device_id):
+  cuda_manager(&cuda_manager), device_id(device_id) {
+  context = cuda_manager.get_context(device_id);
+
+  ScopedContext scoped_context(context);
+  CUDA_SAFE_CALL(cuGraphCreate(&graph, 0));
+}
+
+CudaGraph::~CudaGraph() {
+  ScopedContext scoped_context(context);
+  if (exec != nullptr) {
+    CUDA_SAFE_CALL(cuGraphExecDestroy(exec));
+  }
+  CUDA_SAFE_CALL(cuGraphDestroy(graph));
+}
+
+void CudaGraph::add_node(Node &node) {
+  assert(exec == nullptr && "Graph is already instantiated");
+
+  ScopedContext scoped_context(context);
+  // Chain to the previous node so the calls keep their order
+  const CUgraphNode *dependencies = nodes.empty() ? nullptr : &nodes.back().node;
+  size_t dependency_count = nodes.empty() ? 0 : 1;
+
+  if (node.type == KERNEL) {
+    CUDA_SAFE_CALL(cuGraphAddKernelNode(&node.node, graph, dependencies, dependency_count, &node.kernel_params));
+  } else {
+    CUDA_SAFE_CALL(cuGraphAddMemcpyNode(&node.node, graph, dependencies, dependency_count, &node.copy_params, context));
+  }
+
+  // Moving the node keeps the storage of its vectors, so kernel_args stays valid
+  nodes.push_back(std::move(node));
+}
+
+CudaGraph::Node &CudaGraph::get_node(int node_index, NodeType type) {
+  assert(node_index >= 0 && node_index < (int) nodes.size() && "Node index out of range");
+  Node &node = nodes[node_index];
+  assert((node.type == type || (type != KERNEL && node.type != KERNEL)) && "Node is of another type");
+  return node;
+}
+
+void CudaGraph::add_kernel(int kernel_id, KernelVersionPtr version, const CudaResourceArgs &r_args, const char *args, int arg_count) {
+  assert(r_args.device_id == device_id && "Launch is on another device than the graph");
+  kernel_versions.push_back(version);
+  kernel_ids.push_back(kernel_id);
+  CUfunction kernel = cuda_manager->memory_manager.get_function(*version, context);
+
+  Node node;
+  node.type = KERNEL;
+  node.values.resize(arg_count);
+  node.kernel_args.resize(arg_count);
+
+  const char *current_arg = args;
+  for (int i = 0; i < arg_count; ++i) {
+    Arg *base = (Arg *) current_arg;
+
+    switch (base->type) {
+      case BUFFER:
+      {
+        BufferArg *arg = (BufferArg *) base;
+        current_arg += sizeof(BufferArg);
+        node.values[i] = cuda_manager->memory_manager.resolve_buffer(arg->id, context, arg->is_in);
+        node.kernel_args[i] = &node.values[i];
+        break;
+      }
+      case SCALAR:
+      {
+        ScalarArg *arg = (ScalarArg *) base;
+        current_arg += sizeof(ScalarArg);
+        node.kernel_args[i] = arg->ptr;
+        break;
+      }
+      case VALUE:
+      {
+        ValueArg *arg = (ValueArg *) base;
+        current_arg += sizeof(ValueArg);
+        memcpy(&node.values[i], &arg->value, arg->size);
+        node.kernel_args[i] = &node.values[i];
+        break;
+      }
+    }
+  }
+
+  // Replays keep the configuration resolved at capture
+  CudaResourceArgs dims = r_args;
+  if (dims.auto_config()) {
+    ScopedContext scoped_context(context);
+    cuda_manager->configure_launch(kernel, dims);
+  }
+
+  memset(&node.kernel_params, 0, sizeof(CUDA_KERNEL_NODE_PARAMS));
+  node.kernel_params.func = kernel;
+  node.kernel_params.gridDimX = dims.grid_dim.x;
+  node.kernel_params.gridDimY = dims.grid_dim.y;
+  node.kernel_params.gridDimZ = dims.grid_dim.z;
+  node.kernel_params.blockDimX = dims.block_dim.x;
+  node.kernel_params.blockDimY = dims.block_dim.y;
+  node.kernel_params.blockDimZ = dims.block_dim.z;
+  node.kernel_params.sharedMemBytes = 0;
+  node.kernel_params.kernelParams = node.kernel_args.data();
+  node.kernel_params.extra = nullptr;
+
+  add_node(node);
+}
+
+void CudaGraph::add_write(int buffer_id, const void *data, size_t size) {
+  const MemoryBuffer &mem_buffer = cuda_manager->memory_manager.get_buffer(buffer_id);
+  assert(size <= mem_buffer.size && "Data size is greater than buffer size");
+  assert(mem_buffer.context == context && "Buffer is on another device than the graph");
+
+  Node node;
+  node.type = COPY_TO_DEVICE;
+  memset(&node.copy_params, 0, sizeof(CUDA_MEMCPY3D));
+  node.copy_params.srcMemoryType = CU_MEMORYTYPE_HOST;
+  node.copy_params.srcHost = data;
+  node.copy_params.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+  node.copy_params.dstDevice = mem_buffer.d_ptr;
+  node.copy_params.WidthInBytes = size;
+  node.copy_params.Height = 1;
+  node.copy_params.Depth = 1;
+
+  add_node(node);
+}
+
+void CudaGraph::add_read(int buffer_id, void *buf, size_t size) {
+  const MemoryBuffer &mem_buffer = cuda_manager->memory_manager.get_buffer(buffer_id);
+  assert(size <= mem_buffer.size && "Data size is greater than buffer size");
+  assert(mem_buffer.context == context && "Buffer is on another device than the graph");
+
+  Node node;
+  node.type = COPY_TO_HOST;
+  memset(&node.copy_params, 0, sizeof(CUDA_MEMCPY3D));
+  node.copy_params.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+  node.copy_params.srcDevice = mem_buffer.d_ptr;
+  node.copy_params.dstMemoryType = CU_MEMORYTYPE_HOST;
+  node.copy_params.dstHost = buf;
+  node.copy_params.WidthInBytes = size;
+  node.copy_params.Height = 1;
+  node.copy_params.Depth = 1;
+
+  add_node(node);
+}
+
+void CudaGraph::instantiate() {
+  assert(exec == nullptr && "Graph is already instantiated");
+
+  ScopedContext scoped_context(context);
+  CUDA_SAFE_CALL(cuGraphInstantiate(&exec, graph, 0));
+}
+
+CompletionHandlePtr CudaGraph::launch() {
+  assert(exec != nullptr && "Graph has to be instantiated before launching");
+
+  cuda_manager->set_current_device(device_id);
+  CudaStreamPool &stream_pool = cuda_manager->stream_pools[device_id];
+  CUstream stream = stream_pool.next_stream();
+  CudaProfiler &profiler = cuda_manager->memory_manager.profiler;
+  uint64_t start = metrics_enabled() ? metrics_now() : 0;
+  ProfileMark mark = profiler.begin(stream);
+  CUDA_SAFE_CALL(cuGraphLaunch(exec, stream));
+  profiler.end_graph(mark, stream, (int) nodes.size());
+
+  if (start != 0 && !kernel_ids.empty()) {
+    // One call queues every kernel node, each is charged an equal share of it
+    uint64_t ns = (metrics_now() - start) / kernel_ids.size();
+    for (int kernel_id: kernel_ids) {
+      record_launch(kernel_id, ns);
+    }
+  }
+
+  return std::make_shared<CompletionHandle>(context, stream, stream_pool.get_callback_stream());
+}
+
+void CudaGraph::update_kernel_node(Node &node) {
+  // Before instantiation the node is updated when it is added
+  if (exec == nullptr) return;
+  ScopedContext scoped_context(context);
+  CUDA_SAFE_CALL(cuGraphExecKernelNodeSetParams(exec, node.node, &node.kernel_params));
+}
+
+void CudaGraph::update_copy_node(Node &node) {
+  if (exec == nullptr) return;
+  ScopedContext scoped_context(context);
+  CUDA_SAFE_CALL(cuGraphExecMemcpyNodeSetParams(exec, node.node, &node.copy_params, context));
+}
+
+void CudaGraph::set_scalar(int node_index, int index, void *ptr) {
+  Node &node = get_node(node_index, KERNEL);
+  assert(index >= 0 && index < (int) node.kernel_args.size() && "Argument index out of range");
+  node.kernel_args[index] = ptr;
+  update_kernel_node(node);
+}
+
+void CudaGraph::set_value(int node_index, int index, const void *value, size_t size) {
+  Node &node = get_node(node_index, KERNEL);
+  assert(index >= 0 && index < (int) node.kernel_args.size() && "Argument index out of range");
+  assert(size <= sizeof(uint64_t) && "Value does not fit inline");
+  memcpy(&node.values[index], value, size);
+  node.kernel_args[index] = &node.values[index];
+  update_kernel_node(node);
+}
+
+void CudaGraph::set_buffer(int node_index, int index, int buffer_id, bool is_in) {
+  Node &node = get_node(node_index, KERNEL);
+  assert(index >= 0 && index < (int) node.kernel_args.size() && "Argument index out of range");
+  node.values[index] = cuda_manager->memory_manager.resolve_buffer(buffer_id, context, is_in);
+  node.kernel_args[index] = &node.values[index];
+  update_kernel_node(node);
+}
+
+void CudaGraph::set_copy_buffer(int node_index, int buffer_id) {
+  Node &node = get_node(node_index, COPY_TO_DEVICE);
+  const MemoryBuffer &mem_buffer = cuda_manager->memory_manager.get_buffer(buffer_id);
+  assert(node.copy_params.WidthInBytes <= mem_buffer.size && "Copy size is greater than buffer size");
+  assert(mem_buffer.context == context && "Buffer is on another device than the graph");
+
+  if (node.type == COPY_TO_DEVICE) {
+    node.copy_params.dstDevice = mem_buffer.d_ptr;
+  } else {
+    node.copy_params.srcDevice = mem_buffer.d_ptr;
+  }
+  update_copy_node(node);
+}
+
+void CudaGraph::set_copy_host(int node_index, void *ptr) {
+  Node &node = get_node(node_index, COPY_TO_DEVICE);
+  if (node.type == COPY_TO_DEVICE) {
+    node.copy_params.srcHost = ptr;
+  } else {
+    node.copy_params.dstHost = ptr;
+  }
+  update_copy_node(node);
+}
+
+}
@@ -0,0 +1,91 @@
+#ifndef CUDA_GRAPH_H
+#define CUDA_GRAPH_H
+
+#include "cuda_manager.h"
+#include <cuda.h>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+
+namespace cuda_manager {
+
+/*! \brief A recorded chain of launches and copies, replayed with a single cuGraphLaunch.
+ * Nodes are added in call order and each one depends on the previous, as the calls would have run.
+ * Once instantiated, the arguments of a node can be changed without instantiating again,
+ * changes apply to the following launches. Nodes are numbered from 0 in the order they were added.
+ * \note Not thread safe, a graph is recorded and replayed by one thread at a time
+ */
+class CudaGraph {
+private:
+  enum NodeType {
+    KERNEL,
+    COPY_TO_DEVICE,
+    COPY_TO_HOST
+  };
+
+  struct Node {
+    NodeType type;
+    CUgraphNode node;
+
+    // Kernel nodes, values holds buffer device pointers and value args, kernel_args points to them or to scalars
+    CUDA_KERNEL_NODE_PARAMS kernel_params;
+    std::vector<uint64_t> values;
+    std::vector<void *> kernel_args;
+
+    // Copy nodes
+    CUDA_MEMCPY3D copy_params;
+  };
+
+  CudaManager *cuda_manager;
+  int device_id;
+  CUcontext context;
+  CUgraph graph;
+  CUgraphExec exec = nullptr;
+  std::vector<Node> nodes;
+  std::vector<KernelVersionPtr> kernel_versions; // Kept loaded, a graph keeps running the versions it recorded
+  std::vector<int> kernel_ids; // Of each kernel node, replays are recorded in their metrics
+
+  void add_node(Node &node);
+  Node &get_node(int node_index, NodeType type);
+  void update_kernel_node(Node &node);
+  void update_copy_node(Node &node);
+
+public:
+  CudaGraph(CudaManager &cuda_manager, int device_id);
+  ~CudaGraph();
+
+  CudaGraph(const CudaGraph &) = delete;
+  CudaGraph &operator=(const CudaGraph &) = delete;
+
+  // Record a launch of version, the current one of kernel_id. Arguments use the same layout as CudaManager::launch_kernel
+  void add_kernel(int kernel_id, KernelVersionPtr version, const CudaResourceArgs &r_args, const char *args, int arg_count);
+  // Record a write of buffer_id, data is read on every launch so it has to outlive the graph
+  void add_write(int buffer_id, const void *data, size_t size);
+  // Record a read of buffer_id, buf is written on every launch so it has to outlive the graph
+  void add_read(int buffer_id, void *buf, size_t size);
+
+  // Finish recording, nodes cannot be added afterwards
+  void instantiate();
+  bool is_instantiated() const { return exec != nullptr; }
+  int get_node_count() const { return (int) nodes.size(); }
+
+  // Replay every node, \return handle to wait on, poll or attach a completion callback to
+  CompletionHandlePtr launch();
+
+  // Point scalar arg index of kernel node to another value, the value is read right away
+  void set_scalar(int node_index, int index, void *ptr);
+  // Store a value of up to 8 bytes inline for arg index of kernel node
+  void set_value(int node_index, int index, const void *value, size_t size);
+  // Bind buffer arg index of kernel node to another buffer, placed on the graph device. Rebind it if it moves afterwards
+  void set_buffer(int node_index, int index, int buffer_id, bool is_in = false);
+  // Change the device side of a copy node, the buffer must hold the copied size
+  void set_copy_buffer(int node_index, int buffer_id);
+  // Change the host side of a copy node
+  void set_copy_host(int node_index, void *ptr);
+};
+
+typedef std::unique_ptr<CudaGraph> CudaGraphPtr;
+
+}
+
+#endif
@@ -0,0 +1,57 @@
+#include "cuda_host_shadow.h"
+#include <algorithm>
+#include <assert.h>
+
+namespace cuda_manager {
+
+void DirtyRanges::add(size_t begin, size_t end) {
+  assert(begin <= end && "Range ends before it begins");
+  if (begin == end) return;
+
+  // Ranges touching [begin, end) are merged into it
+  std::vector<ByteRange>::iterator first = std::lower_bound(ranges.begin(), ranges.end(), begin,
+      [](const ByteRange &range, size_t offset) { return range.end < offset; });
+  std::vector<ByteRange>::iterator last = first;
+  while (last != ranges.end() && last->begin <= end) {
+    begin = std::min(begin, last->begin);
+    end = std::max(end, last->end);
+    ++last;
+  }
+  first = ranges.erase(first, last);
+  ranges.insert(first, ByteRange{begin, end});
+}
+
+void DirtyRanges::remove(size_t begin, size_t end) {
+  assert(begin <= end && "Range ends before it begins");
+  if (begin == end) return;
+
+  std::vector<ByteRange>::iterator first = std::lower_bound(ranges.begin(), ranges.end(), begin,
+      [](const ByteRange &range, size_t offset) { return range.end <= offset; });
+  std::vector<ByteRange> kept;
+  std::vector<ByteRange>::iterator last = first;
+  while (last != ranges.end() && last->begin < end) {
+    if (last->begin < begin) kept.push_back(ByteRange{last->begin, begin});
+    if (last->end > end) kept.push_back(ByteRange{end, last->end});
+    ++last;
+  }
+  first = ranges.erase(first, last);
+  ranges.insert(first, kept.begin(), kept.end());
+}
+
+size_t DirtyRanges::bytes() const {
+  size_t total = 0;
+  for (const ByteRange &range: ranges) {
+    total += range.end - range.begin;
+  }
+  return total;
+}
+
+void DirtyRanges::intersect(size_t begin, size_t end, std::vector<ByteRange> *out) const {
+  std::vector<ByteRange>::const_iterator it = std::lower_bound(ranges.begin(), ranges.end(), begin,
+      [](const ByteRange &range, size_t offset) { return range.end <= offset; });
+  for (; it != ranges.end() && it->begin < end; ++it) {
+    out->push_back(ByteRange{std::max(begin, it->begin), std::min(end, it->end)});
+  }
+}
+
+}
@@ -0,0 +1,52 @@
+#ifndef CUDA_HOST_SHADOW_H
+#define CUDA_HOST_SHADOW_H
+
+#include <vector>
+#include <stddef.h>
+
+namespace cuda_manager {
+
+struct ByteRange {
+  size_t begin;
+  size_t end; // One past the last byte
+};
+
+/*! \brief A set of byte ranges, kept sorted and merged.
+ * Buffers see a handful of ranges at a time, so a flat vector beats a tree here.
+ */
+class DirtyRanges {
+private:
+  std::vector<ByteRange> ranges;
+
+public:
+  void add(size_t begin, size_t end);
+  void remove(size_t begin, size_t end);
+  void clear() { ranges.clear(); }
+  bool empty() const { return ranges.empty(); }
+  // Total bytes covered
+  size_t bytes() const;
+  // Parts of [begin, end) in the set, appended to out
+  void intersect(size_t begin, size_t end, std::vector<ByteRange> *out) const;
+  const std::vector<ByteRange> &get_ranges() const { return ranges; }
+};
+
+/*! \brief Host copy of a buffer and which side holds the latest data of each byte.
+ * A byte is in at most one of the sets, bytes in neither are the same on both sides.
+ */
+struct HostShadow {
+  std::vector<char> data;
+  DirtyRanges host_dirty;   // Written by the host, not uploaded yet
+  DirtyRanges device_dirty; // Possibly written by kernels, not downloaded yet
+};
+
+// Bytes moved and avoided by host shadows
+struct ShadowStats {
+  size_t write_bytes_saved; // Written with the same content the device already has
+  size_t read_bytes_saved;  // Read from the shadow instead of the device
+  size_t bytes_uploaded;
+  size_t bytes_downloaded;
+};
+
+}
+
+#endif
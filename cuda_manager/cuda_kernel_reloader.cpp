@@ -0,0 +1,236 @@
+#include "cuda_kernel_reloader.h"
+#include "cuda_log.h"
+#include <assert.h>
+#include <chrono>
+#include <fstream>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace cuda_manager {
+
+namespace {
+
+// Directory part of a path, "." for a bare file name
+std::string dir_name(const std::string &path) {
+  size_t slash = path.find_last_of('/');
+  if (slash == std::string::npos) return ".";
+  if (slash == 0) return "/";
+  return path.substr(0, slash);
+}
+
+// Spell a path the way inotify events name it, directory of the watch and file name
+std::string watch_path(const std::string &path) {
+  return dir_name(path) + "/" + path.substr(path.find_last_of('/') + 1);
+}
+
+bool read_file(const std::string &path, std::string *contents) {
+  std::ifstream input_file(path.c_str(), std::ifstream::in | std::ifstream::binary | std::ifstream::ate);
+  if (!input_file.is_open()) return false;
+
+  size_t file_size = (size_t) input_file.tellg();
+  contents->resize(file_size);
+  input_file.seekg(0, std::ifstream::beg);
+  return file_size == 0 || (bool) input_file.read(&(*contents)[0], file_size);
+}
+
+}
+
+const int KernelReloader::SETTLE_MS;
+const int KernelReloader::RECLAIM_INTERVAL_MS;
+
+KernelReloader::KernelReloader(CudaMemoryManager &memory_manager, ReloadCompileFunction compile_function):
+  memory_manager(memory_manager), compile_function(compile_function), compile_failures(0), stopping(false) {
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd < 0) {
+    CUDA_LOG_ERROR("[Kernel reloader] inotify unavailable, kernels are only reloaded with reload_now");
+  }
+  thread = std::thread(&KernelReloader::run, this);
+}
+
+KernelReloader::~KernelReloader() {
+  stopping = true;
+  thread.join();
+  if (inotify_fd >= 0) close(inotify_fd);
+}
+
+void KernelReloader::watch_dir(const std::string &path) {
+  std::string dir = dir_name(path);
+  if (inotify_fd < 0 || dirs.count(dir) != 0) return;
+
+  // Editors often replace files instead of writing them, so watch for both
+  int wd = inotify_add_watch(inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+  if (wd < 0) {
+    CUDA_LOG_WARN("[Kernel reloader] Cannot watch directory %s, changes to %s are missed", dir.c_str(), path.c_str());
+    return;
+  }
+  watch_dirs[wd] = dir;
+  dirs.insert(dir);
+}
+
+bool KernelReloader::watch_source(int kernel_id, const char *function_name, const std::string &source_path,
+    const std::vector<std::string> &dependencies) {
+  assert(compile_function != nullptr && "Watching sources needs a compile function");
+  assert(memory_manager.get_kernel_version(kernel_id) != nullptr && "Kernel has to be written before it is watched");
+
+  WatchedKernel kernel{kernel_id, function_name, watch_path(source_path), true, {}};
+  for (const std::string &dependency: dependencies) {
+    kernel.dependencies.push_back(watch_path(dependency));
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  watch_dir(kernel.path);
+  for (const std::string &dependency: kernel.dependencies) {
+    watch_dir(dependency);
+  }
+  CUDA_LOG_DEBUG("[Kernel reloader] Watching %s for kernel id %d", kernel.path.c_str(), kernel_id);
+  watched[kernel_id] = std::move(kernel);
+  return dirs.count(dir_name(source_path)) != 0;
+}
+
+bool KernelReloader::watch_image(int kernel_id, const char *function_name, const std::string &image_path) {
+  assert(memory_manager.get_kernel_version(kernel_id) != nullptr && "Kernel has to be written before it is watched");
+
+  std::lock_guard<std::mutex> lock(mutex);
+  watch_dir(image_path);
+  CUDA_LOG_DEBUG("[Kernel reloader] Watching %s for kernel id %d", image_path.c_str(), kernel_id);
+  watched[kernel_id] = WatchedKernel{kernel_id, function_name, watch_path(image_path), false, {}};
+  return dirs.count(dir_name(image_path)) != 0;
+}
+
+void KernelReloader::unwatch(int kernel_id) {
+  // Wait for a reload in progress, the kernel may be deallocated once this returns
+  std::lock_guard<std::mutex> reload_lock(reload_mutex);
+  std::lock_guard<std::mutex> lock(mutex);
+  watched.erase(kernel_id);
+}
+
+bool KernelReloader::reload_now(int kernel_id) {
+  std::lock_guard<std::mutex> reload_lock(reload_mutex);
+  WatchedKernel kernel;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<int, WatchedKernel>::iterator it = watched.find(kernel_id);
+    if (it == watched.end()) return false;
+    kernel = it->second;
+  }
+  return reload(kernel);
+}
+
+bool KernelReloader::reload(const WatchedKernel &kernel) {
+  // Load the new version where the current one lives
+  KernelVersionPtr version = memory_manager.get_kernel_version(kernel.kernel_id);
+  assert(version != nullptr && "Kernel has to be unwatched before it is deallocated");
+  ScopedContext scoped_context(version->module_key.context);
+  version.reset();
+
+  std::string image;
+  if (kernel.compile) {
+    std::vector<std::string> dependencies;
+    std::string log;
+    if (!compile_function(kernel.path, &image, &dependencies, &log)) {
+      CUDA_LOG_ERROR("[Kernel reloader] %s failed to compile, kernel id %d keeps its previous version:\n%s",
+          kernel.path.c_str(), kernel.kernel_id, log.c_str());
+      ++compile_failures;
+      return false;
+    }
+
+    // Includes may have changed with the source
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<int, WatchedKernel>::iterator it = watched.find(kernel.kernel_id);
+    if (it != watched.end()) {
+      it->second.dependencies.clear();
+      for (const std::string &dependency: dependencies) {
+        it->second.dependencies.push_back(watch_path(dependency));
+        watch_dir(dependency);
+      }
+    }
+  } else if (!read_file(kernel.path, &image)) {
+    CUDA_LOG_ERROR("[Kernel reloader] Cannot read %s, kernel id %d keeps its previous version",
+        kernel.path.c_str(), kernel.kernel_id);
+    ++compile_failures;
+    return false;
+  }
+
+  // The string keeps a terminating NUL past size, as PTX needs
+  return memory_manager.reload_kernel(kernel.kernel_id, kernel.function_name.c_str(), image.data(), image.size());
+}
+
+void KernelReloader::read_events(std::set<std::string> &changed) {
+  alignas(struct inotify_event) char buffer[4096];
+  for (;;) {
+    ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+    if (length <= 0) return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (char *p = buffer; p < buffer + length; ) {
+      const struct inotify_event *event = (const struct inotify_event *) p;
+      p += sizeof(struct inotify_event) + event->len;
+
+      std::map<int, std::string>::iterator it = watch_dirs.find(event->wd);
+      if (it == watch_dirs.end()) continue;
+      if (event->mask & IN_IGNORED) {
+        // Directory removed, watch it again if it comes back with a new kernel
+        dirs.erase(it->second);
+        watch_dirs.erase(it);
+        continue;
+      }
+      if (event->len > 0) changed.insert(it->second + "/" + event->name);
+    }
+  }
+}
+
+void KernelReloader::run() {
+  typedef std::chrono::steady_clock Clock;
+  std::map<std::string, Clock::time_point> pending; // Changed files and when they last changed
+
+  while (!stopping) {
+    if (inotify_fd >= 0) {
+      struct pollfd poll_fd = {inotify_fd, POLLIN, 0};
+      poll(&poll_fd, 1, pending.empty() ? RECLAIM_INTERVAL_MS : SETTLE_MS);
+
+      std::set<std::string> changed;
+      read_events(changed);
+      Clock::time_point now = Clock::now();
+      for (const std::string &path: changed) {
+        pending[path] = now;
+      }
+    } else {
+      std::this_thread::sleep_for(std::chrono::milliseconds(RECLAIM_INTERVAL_MS));
+    }
+
+    // Files quiet for long enough
+    std::set<std::string> settled;
+    Clock::time_point settle_time = Clock::now() - std::chrono::milliseconds(SETTLE_MS);
+    for (std::map<std::string, Clock::time_point>::iterator it = pending.begin(); it != pending.end(); ) {
+      if (it->second <= settle_time) {
+        settled.insert(it->first);
+        it = pending.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    if (!settled.empty()) {
+      std::vector<int> kernel_ids;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto &entry: watched) {
+          const WatchedKernel &kernel = entry.second;
+          bool affected = settled.count(kernel.path) != 0;
+          for (size_t i = 0; !affected && i < kernel.dependencies.size(); ++i) {
+            affected = settled.count(kernel.dependencies[i]) != 0;
+          }
+          if (affected) kernel_ids.push_back(kernel.kernel_id);
+        }
+      }
+      for (int kernel_id: kernel_ids) {
+        reload_now(kernel_id);
+      }
+    }
+
+    memory_manager.reclaim_kernels();
+  }
+}
+
+}
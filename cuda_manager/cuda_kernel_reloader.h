@@ -0,0 +1,91 @@
+#ifndef CUDA_KERNEL_RELOADER_H
+#define CUDA_KERNEL_RELOADER_H
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "cuda_memory_manager.h"
+
+namespace cuda_manager {
+
+/*! \brief Turns a kernel source into a loadable PTX or CUBIN image, e.g. with cuda_compiler::CudaCompiler.
+ * dependencies is set to the files the source includes, so changing them reloads the kernel too.
+ * \return false with the reason in log if the source does not compile
+ */
+typedef std::function<bool(const std::string &source_path, std::string *image,
+    std::vector<std::string> *dependencies, std::string *log)> ReloadCompileFunction;
+
+/*! \brief Reloads kernels when their source or image files change, without draining launches.
+ * A background thread watches the directories of the files with inotify. Once a changed file is
+ * quiet for SETTLE_MS, the kernels using it are compiled if needed and swapped in with
+ * CudaMemoryManager::reload_kernel. Launches already queued finish on the previous module, which
+ * is unloaded by the same thread once they completed. A kernel that fails to compile or load keeps
+ * its previous version.
+ * \note Kernels have to be written before they are watched, and unwatched before they are deallocated
+ */
+class KernelReloader {
+private:
+  struct WatchedKernel {
+    int kernel_id;
+    std::string function_name;
+    std::string path;
+    bool compile;                          // path is a source to compile, not an image
+    std::vector<std::string> dependencies; // Changes to these reload the kernel as well
+  };
+
+  CudaMemoryManager &memory_manager;
+  ReloadCompileFunction compile_function;
+  int inotify_fd;
+  std::atomic<size_t> compile_failures;
+
+  std::mutex reload_mutex; // Held while a kernel reloads, so unwatch can wait for it
+  std::mutex mutex; // Guards everything below
+  std::map<int, WatchedKernel> watched; // By kernel id
+  std::map<int, std::string> watch_dirs; // Directory of each inotify watch descriptor
+  std::set<std::string> dirs;
+
+  std::atomic<bool> stopping;
+  std::thread thread;
+
+  void run();
+  // Collect the paths of the pending inotify events
+  void read_events(std::set<std::string> &changed);
+  // Watch the directory of path, mutex must be held
+  void watch_dir(const std::string &path);
+  // reload_mutex must be held
+  bool reload(const WatchedKernel &kernel);
+
+public:
+  // Changed files are reloaded once no change came in for this long, editors save in several steps
+  static const int SETTLE_MS = 50;
+  // The thread wakes up at least this often to unload replaced modules
+  static const int RECLAIM_INTERVAL_MS = 100;
+
+  KernelReloader(CudaMemoryManager &memory_manager, ReloadCompileFunction compile_function = nullptr);
+  ~KernelReloader();
+
+  KernelReloader(const KernelReloader &) = delete;
+  KernelReloader &operator=(const KernelReloader &) = delete;
+
+  // Recompile and reload kernel_id when source_path or one of dependencies changes, needs a compile function
+  bool watch_source(int kernel_id, const char *function_name, const std::string &source_path,
+      const std::vector<std::string> &dependencies = std::vector<std::string>());
+  // Reload kernel_id when the PTX or CUBIN at image_path changes
+  bool watch_image(int kernel_id, const char *function_name, const std::string &image_path);
+  // Stop reloading kernel_id, waits for a reload of it in progress
+  void unwatch(int kernel_id);
+
+  // Reload a watched kernel right away, \return false if it kept its previous version
+  bool reload_now(int kernel_id);
+  // Reloads that kept the previous version because the source did not compile or the image could not be read
+  size_t get_compile_failures() const { return compile_failures; }
+};
+
+}
+
+#endif
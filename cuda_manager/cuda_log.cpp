@@ -0,0 +1,238 @@
+#include "cuda_log.h"
+#include "cuda_common.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace cuda_manager {
+
+static int default_log_level() {
+  static const char *names[] = {"trace", "debug", "info", "warn", "error", "off"};
+  const char *env = getenv("CUDA_MANAGER_LOG");
+  if (env != nullptr) {
+    for (int i = LOG_TRACE; i <= LOG_OFF; ++i) {
+      if (strcmp(env, names[i]) == 0) return i;
+    }
+  }
+#ifdef NDEBUG
+  return LOG_INFO;
+#else
+  return LOG_TRACE;
+#endif
+}
+
+std::atomic<int> log_level(default_log_level());
+
+void set_log_level(LogLevel level) {
+  log_level.store(level, std::memory_order_relaxed);
+}
+
+LogLevel get_log_level() {
+  return (LogLevel) log_level.load(std::memory_order_relaxed);
+}
+
+struct LogRecord {
+  uint64_t time; // Steady clock, nanoseconds
+  char message[248];
+};
+
+/*! \brief Records of a single thread, written by that thread and read by the drain.
+ * head and tail only grow, the slot of a position is position % CAPACITY.
+ */
+struct LogRing {
+  static const size_t CAPACITY = 512;
+
+  LogRecord records[CAPACITY];
+  CachePadded<std::atomic<size_t>> head; // Next position to write, producer only
+  std::atomic<size_t> tail;              // Next position to read, drain only
+  std::atomic<size_t> dropped;           // Records lost because the ring was full
+  std::atomic<bool> retired;             // The thread exited, the ring goes away once drained
+
+  LogRing(): head(0), tail(0), dropped(0), retired(false) {}
+};
+
+const size_t LogRing::CAPACITY;
+
+class Logger {
+private:
+  std::mutex mutex; // Guards rings and serializes drains
+  std::vector<std::unique_ptr<LogRing>> rings;
+  std::vector<const LogRecord *> pending; // Records of the current drain, sorted by time
+  std::vector<size_t> heads;             // Position each ring is drained up to
+
+  std::atomic<FILE *> file;
+  std::atomic<size_t> written;
+  std::atomic<size_t> retired_dropped; // Dropped records of rings already freed
+
+  std::mutex wake_mutex;
+  std::condition_variable wake_cv;
+  bool stopping;
+  std::thread thread;
+
+  void run() {
+    std::unique_lock<std::mutex> lock(wake_mutex);
+    while (!stopping) {
+      wake_cv.wait_for(lock, std::chrono::milliseconds(DRAIN_INTERVAL_MS));
+      lock.unlock();
+      drain();
+      lock.lock();
+    }
+  }
+
+public:
+  static const int DRAIN_INTERVAL_MS = 10;
+
+  Logger(): file(stdout), written(0), retired_dropped(0), stopping(false) {
+    thread = std::thread(&Logger::run, this);
+  }
+
+  ~Logger() {
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex);
+      stopping = true;
+    }
+    wake_cv.notify_one();
+    thread.join();
+    drain();
+  }
+
+  // Drain early, without waiting for the interval
+  void wake() {
+    wake_cv.notify_one();
+  }
+
+  LogRing *register_ring() {
+    std::lock_guard<std::mutex> lock(mutex);
+    rings.emplace_back(new LogRing);
+    return rings.back().get();
+  }
+
+  void set_file(FILE *file) {
+    drain();
+    this->file.store(file);
+  }
+
+  void drain() {
+    std::lock_guard<std::mutex> lock(mutex);
+    pending.clear();
+    heads.resize(rings.size());
+    std::vector<bool> retired(rings.size());
+
+    for (size_t i = 0; i < rings.size(); ++i) {
+      LogRing &ring = *rings[i];
+      // Checked before head, a retired ring gets no records past the head read below
+      retired[i] = ring.retired.load(std::memory_order_acquire);
+      heads[i] = ring.head.value.load(std::memory_order_acquire);
+      for (size_t position = ring.tail.load(std::memory_order_relaxed); position < heads[i]; ++position) {
+        pending.push_back(&ring.records[position % LogRing::CAPACITY]);
+      }
+    }
+
+    // Rings are drained one after the other, records are put back in the order they were logged
+    std::stable_sort(pending.begin(), pending.end(),
+        [](const LogRecord *a, const LogRecord *b) { return a->time < b->time; });
+    FILE *out = file.load();
+    for (const LogRecord *record: pending) {
+      fputs(record->message, out);
+      fputc('\n', out);
+    }
+    if (!pending.empty()) fflush(out);
+    written += pending.size();
+
+    // Slots are handed back only once written
+    size_t kept = 0;
+    for (size_t i = 0; i < rings.size(); ++i) {
+      rings[i]->tail.store(heads[i], std::memory_order_release);
+      if (retired[i]) {
+        retired_dropped += rings[i]->dropped.load(std::memory_order_relaxed);
+        continue;
+      }
+      rings[kept++] = std::move(rings[i]);
+    }
+    rings.resize(kept);
+  }
+
+  LogStats get_stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    LogStats stats;
+    stats.written = written;
+    stats.dropped = retired_dropped;
+    for (const std::unique_ptr<LogRing> &ring: rings) {
+      stats.dropped += ring->dropped.load(std::memory_order_relaxed);
+    }
+    return stats;
+  }
+};
+
+const int Logger::DRAIN_INTERVAL_MS;
+
+// Started on first use, so it outlives any static object that logs while being constructed
+static Logger &get_logger() {
+  static Logger logger;
+  return logger;
+}
+
+// Ring of the calling thread, registered on its first record
+struct ThreadRing {
+  LogRing *ring = nullptr;
+
+  ~ThreadRing() {
+    if (ring != nullptr) ring->retired.store(true, std::memory_order_release);
+  }
+};
+
+static thread_local ThreadRing thread_ring;
+
+void log_write(LogLevel level, const char *format, ...) {
+  LogRing *ring = thread_ring.ring;
+  if (ring == nullptr) {
+    ring = get_logger().register_ring();
+    thread_ring.ring = ring;
+  }
+
+  size_t head = ring->head.value.load(std::memory_order_relaxed);
+  size_t used = head - ring->tail.load(std::memory_order_acquire);
+  if (used == LogRing::CAPACITY) {
+    ring->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  // A burst is filling the ring, a missed wake up only delays the drain to the next interval
+  if (used == LogRing::CAPACITY / 2) get_logger().wake();
+
+  LogRecord &record = ring->records[head % LogRing::CAPACITY];
+  record.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+
+  int prefix = 0;
+  if (level == LOG_WARN) prefix = snprintf(record.message, sizeof(record.message), "warning: ");
+  else if (level == LOG_ERROR) prefix = snprintf(record.message, sizeof(record.message), "error: ");
+
+  va_list args;
+  va_start(args, format);
+  vsnprintf(record.message + prefix, sizeof(record.message) - prefix, format, args);
+  va_end(args);
+
+  ring->head.value.store(head + 1, std::memory_order_release);
+}
+
+void log_flush() {
+  get_logger().drain();
+}
+
+void set_log_file(FILE *file) {
+  get_logger().set_file(file);
+}
+
+LogStats get_log_stats() {
+  return get_logger().get_stats();
+}
+
+}
@@ -0,0 +1,73 @@
+#ifndef CUDA_LOG_H
+#define CUDA_LOG_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdio.h>
+
+namespace cuda_manager {
+
+enum LogLevel {
+  LOG_TRACE, // Per argument and per call details
+  LOG_DEBUG, // Every transfer, allocation and module load
+  LOG_INFO,  // Startup, shutdown and rare events
+  LOG_WARN,
+  LOG_ERROR,
+  LOG_OFF
+};
+
+// Records below this level are compiled out, release builds keep everything but TRACE
+#ifndef CUDA_LOG_MIN_LEVEL
+#ifdef NDEBUG
+#define CUDA_LOG_MIN_LEVEL cuda_manager::LOG_DEBUG
+#else
+#define CUDA_LOG_MIN_LEVEL cuda_manager::LOG_TRACE
+#endif
+#endif
+
+// Runtime level, records below it cost a load and a branch
+extern std::atomic<int> log_level;
+
+inline bool log_enabled(LogLevel level) {
+  return level >= log_level.load(std::memory_order_relaxed);
+}
+
+/*! \brief Set the runtime level.
+ * Defaults to INFO in release builds and TRACE otherwise, or to the CUDA_MANAGER_LOG environment
+ * variable (trace, debug, info, warn, error or off) when it is set.
+ */
+void set_log_level(LogLevel level);
+LogLevel get_log_level();
+
+// Where records are written, stdout by default. file must stay open while records may be drained
+void set_log_file(FILE *file);
+
+/*! \brief Format a record into the ring of the calling thread, use the CUDA_LOG_* macros instead.
+ * Never blocks nor takes a lock, records are dropped if the ring is full and truncated if too long.
+ */
+void log_write(LogLevel level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// Write every record logged so far before returning, e.g. before exiting on an error
+void log_flush();
+
+struct LogStats {
+  size_t written; // Records written to the log file
+  size_t dropped; // Records lost to full rings
+};
+LogStats get_log_stats();
+
+}
+
+#define CUDA_LOG(level, ...)                                             \
+  do {                                                                   \
+    if ((level) >= CUDA_LOG_MIN_LEVEL && cuda_manager::log_enabled(level)) \
+      cuda_manager::log_write(level, __VA_ARGS__);                       \
+  } while (0)
+
+#define CUDA_LOG_TRACE(...) CUDA_LOG(cuda_manager::LOG_TRACE, __VA_ARGS__)
+#define CUDA_LOG_DEBUG(...) CUDA_LOG(cuda_manager::LOG_DEBUG, __VA_ARGS__)
+#define CUDA_LOG_INFO(...) CUDA_LOG(cuda_manager::LOG_INFO, __VA_ARGS__)
+#define CUDA_LOG_WARN(...) CUDA_LOG(cuda_manager::LOG_WARN, __VA_ARGS__)
+#define CUDA_LOG_ERROR(...) CUDA_LOG(cuda_manager::LOG_ERROR, __VA_ARGS__)
+
+#endif
@@ -1,22 +1,42 @@
 #include "cuda_manager.h"
 #include "cuda_common.h"
+#include "cuda_log.h"
 #include "kernel_arguments.h"
 #include <cuda.h>
+#include <chrono>
+#include <thread>
 #include <vector>
-#include <iostream>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
 
 namespace cuda_manager {
 
-CudaManager::CudaManager(): memory_manager() {
-  std::cout << "Initializing CUDA Manager...\n";
+typedef std::chrono::steady_clock Clock;
+
+static double elapsed_ms(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+CudaManager::CudaManager(InitMode init_mode): memory_manager() {
+  CUDA_LOG_INFO("Initializing CUDA Manager...");
+  Clock::time_point start = Clock::now();
   CUDA_SAFE_CALL(cuInit(0));
+  startup_times.driver_init = elapsed_ms(start);
 
   // Get devices info
+  start = Clock::now();
   CUDA_SAFE_CALL(cuDeviceGetCount((int *)&device_count));
-  std::cout << "Device count: " << device_count << '\n'; 
+  CUDA_LOG_INFO("Device count: %u", device_count);
 
   devices = new CUdevice[device_count]();
-  contexts = new CUcontext[device_count]();
+  contexts = new std::atomic<CUcontext>[device_count]();
+  stream_pools = new CudaStreamPool[device_count];
+  device_init.reset(new std::once_flag[device_count]);
+  worker_init.reset(new std::once_flag[device_count]);
+  workers.resize(device_count);
+  startup_times.context_init.assign(device_count, 0.0);
+  startup_times.eager_init = 0.0;
 
   int major = 0, minor = 0;
   char device_name[256];
@@ -27,25 +47,157 @@ CudaManager::CudaManager(): memory_manager() {
     CUDA_SAFE_CALL(cuDeviceGetAttribute(&major, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR, devices[i]));
     CUDA_SAFE_CALL(cuDeviceGetAttribute(&minor, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR, devices[i]));
     CUDA_SAFE_CALL(cuDeviceGetName(device_name, 256, devices[i]));
-    std::cout << i << ") GPU name: " << device_name << "  (SM: " << major << '.' << minor << ")\n"; 
-
-    // Initialize context for device
-    CUDA_SAFE_CALL(cuCtxCreate(&contexts[i], i, devices[i]));
+    CUDA_LOG_INFO("%d) GPU name: %s  (SM: %d.%d)", i, device_name, major, minor);
   }
-  CUDA_SAFE_CALL(cuCtxSetCurrent(contexts[0]));
+  startup_times.device_query = elapsed_ms(start);
+  CUDA_LOG_INFO("Startup: driver init %g ms, device query %g ms", startup_times.driver_init, startup_times.device_query);
+
+  if (init_mode == EAGER_INIT) {
+    // Context creation is mostly driver time spent per device, so devices are initialized side by side
+    start = Clock::now();
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < device_count; ++i) {
+      threads.emplace_back([this, i] { get_context(i); });
+    }
+    for (std::thread &thread: threads) {
+      thread.join();
+    }
+    startup_times.eager_init = elapsed_ms(start);
+    CUDA_LOG_INFO("Startup: eager init of %u devices %g ms", device_count, startup_times.eager_init);
+  }
+}
+
+void CudaManager::init_device(int device_id) {
+  std::call_once(device_init[device_id], [this, device_id] {
+    Clock::time_point start = Clock::now();
+
+    CUcontext context;
+    CUDA_SAFE_CALL(cuDevicePrimaryCtxRetain(&context, devices[device_id]));
+    {
+      // Create the launch streams in the new context
+      ScopedContext scoped_context(context);
+      stream_pools[device_id].create();
+    }
+    // Published last, threads seeing the context can use the streams
+    contexts[device_id].store(context, std::memory_order_release);
+
+    double init_ms = elapsed_ms(start);
+    {
+      std::lock_guard<std::mutex> lock(startup_mutex);
+      startup_times.context_init[device_id] = init_ms;
+    }
+    CUDA_LOG_INFO("Startup: device %d context init %g ms", device_id, init_ms);
+  });
+}
+
+StartupTimes CudaManager::get_startup_times() {
+  std::lock_guard<std::mutex> lock(startup_mutex);
+  return startup_times;
 }
 
 CudaManager::~CudaManager() {
-  std::cout << "Destructing CUDA Manager...\n";
+  CUDA_LOG_INFO("Destructing CUDA Manager...");
+  stop_workers();
+  memory_manager.release_resources();
   for (int i = 0; i < device_count; ++i) {
-    CUDA_SAFE_CALL(cuCtxDestroy(contexts[i]));
+    // Devices never used have nothing to release
+    if (contexts[i] == nullptr) continue;
+    CUDA_SAFE_CALL(cuCtxSetCurrent(contexts[i]));
+    stream_pools[i].destroy();
+    CUDA_SAFE_CALL(cuCtxSetCurrent(nullptr));
+    CUDA_SAFE_CALL(cuDevicePrimaryCtxRelease(devices[i]));
+  }
+  delete[] stream_pools;
+  delete[] contexts;
+  delete[] devices;
+}
+
+
+void CudaManager::set_current_device(int device_id) {
+  CUcontext context = get_context(device_id);
+  CUcontext current;
+  CUDA_SAFE_CALL(cuCtxGetCurrent(&current));
+  if (current != context) {
+    CUDA_SAFE_CALL(cuCtxSetCurrent(context));
+  }
+}
+
+void CudaManager::ensure_context() {
+  CUcontext current;
+  CUDA_SAFE_CALL(cuCtxGetCurrent(&current));
+  if (current == nullptr) {
+    CUDA_SAFE_CALL(cuCtxSetCurrent(get_context(0)));
   }
 }
 
 
+int CudaManager::get_device_id(CUcontext context) const {
+  for (uint32_t i = 0; i < device_count; ++i) {
+    if (contexts[i] == context) return (int) i;
+  }
+  assert(false && "Context does not belong to the manager");
+  return -1;
+}
+
+void CudaManager::start_workers() {
+  assert(!use_workers && "Workers are already started");
+  use_workers = true;
+}
+
+void CudaManager::stop_workers() {
+  use_workers = false;
+  for (std::unique_ptr<DeviceWorker> &worker: workers) {
+    worker.reset();
+  }
+}
+
+DeviceWorker *CudaManager::get_worker(int device_id) {
+  std::call_once(worker_init[device_id], [this, device_id] {
+    workers[device_id].reset(new DeviceWorker(get_context(device_id)));
+  });
+  return workers[device_id].get();
+}
+
+
+void CudaManager::set_concurrent_launches(bool enabled) {
+  for (uint32_t i = 0; i < device_count; ++i) {
+    stream_pools[i].set_round_robin(enabled);
+  }
+}
+
+void CudaManager::configure_launch(const CUfunction kernel, CudaResourceArgs &r_args) {
+  assert(r_args.element_count > 0 && "Automatic launch configuration needs an element count");
+
+  uint64_t grid_size;
+  uint32_t block_size;
+  LaunchConfigCache::suggest(memory_manager.launch_configs.get(kernel), r_args.element_count, &grid_size, &block_size);
+  assert(grid_size <= INT32_MAX && "Too many elements for a 1D grid");
+
+  r_args.grid_dim = {(uint32_t) grid_size, 1, 1};
+  r_args.block_dim = {block_size, 1, 1};
+}
+
+OccupancyReport CudaManager::get_occupancy_report(const CUfunction kernel, const CudaResourceArgs &r_args) {
+  OccupancyReport report;
+  report.device_id = r_args.device_id;
+  report.config = memory_manager.launch_configs.get(kernel);
+
+  CudaResourceArgs chosen = r_args;
+  if (chosen.auto_config()) configure_launch(kernel, chosen);
+  uint64_t grid_size = (uint64_t) chosen.grid_dim.x * chosen.grid_dim.y * chosen.grid_dim.z;
+  uint32_t block_size = chosen.block_dim.x * chosen.block_dim.y * chosen.block_dim.z;
+  report.chosen = LaunchConfigCache::estimate(kernel, report.config, grid_size, block_size);
+
+  // Suggested for as many threads as the chosen launch runs
+  LaunchConfigCache::suggest(report.config, grid_size * block_size, &grid_size, &block_size);
+  report.suggested = LaunchConfigCache::estimate(kernel, report.config, grid_size, block_size);
+  return report;
+}
+
+
 void CudaManager::launch_kernel_from_ptx(const char *ptx, const char* function_name, CudaResourceArgs &r_args, const char *args, int arg_count) {
   // Set context where to launch the kernel
-  CUDA_SAFE_CALL(cuCtxSetCurrent(contexts[r_args.device_id]));
+  set_current_device(r_args.device_id);
 
   // Load module in current context and get kernel handle
   CUfunction kernel;
@@ -62,13 +214,25 @@ void CudaManager::launch_kernel_from_ptx(const char *ptx, const char* function_n
 
 
 void CudaManager::launch_kernel(const CUfunction kernel, CudaResourceArgs &r_args, const char *args, int arg_count) {
-  CUDA_SAFE_CALL(cuCtxSetCurrent(contexts[r_args.device_id]));
+  CompletionHandlePtr completion = launch_kernel_async(kernel, r_args, args, arg_count);
+
+  // Synchronize
+  completion->wait();
+
+  CUDA_LOG_TRACE("Execution complete!");
+}
+
+
+CompletionHandlePtr CudaManager::launch_kernel_async(const CUfunction kernel, CudaResourceArgs &r_args, const char *args, int arg_count) {
+  set_current_device(r_args.device_id);
+  if (r_args.auto_config()) configure_launch(kernel, r_args);
+  CudaStreamPool &stream_pool = stream_pools[r_args.device_id];
   void *kernel_args[arg_count]; // Args to be passed on kernel launch
-  std::vector<CUdeviceptr *> buffers;
+  CUdeviceptr buffer_ptrs[arg_count]; // Storage for the device pointers of buffer args
+  CudaProfiler &profiler = memory_manager.profiler;
+  std::vector<int> buffer_ids; // Only collected for the profiler
 
-#ifndef NDEBUG
-  std::cout << "Parsing arguments... [" << arg_count << "]\n";
-#endif
+  CUDA_LOG_TRACE("Parsing arguments... [%d]", arg_count);
 
   const char *current_arg = args;
   for (int i = 0; i < arg_count; ++i) {
@@ -80,23 +244,16 @@ void CudaManager::launch_kernel(const CUfunction kernel, CudaResourceArgs &r_arg
         BufferArg *arg = (BufferArg *) base; 
         current_arg += sizeof(BufferArg);
 
-#ifndef NDEBUG
-        std::cout << "Buffer arg[1/2]: id = " << arg->id << "  is_in = " << arg->is_in << "\n";
-#endif
+        CUDA_LOG_TRACE("Buffer arg[1/2]: id = %d  is_in = %d", arg->id, (int) arg->is_in);
 
-        // Get memory buffer by id
-        MemoryBuffer memory_buffer = memory_manager.get_buffer(arg->id);
+        // Get memory buffer by id, up to date and placed on the launch device as its policy says
+        memory_manager.prepare_for_launch(arg->id, arg->is_in);
+        buffer_ptrs[i] = memory_manager.resolve_buffer(arg->id, get_context(r_args.device_id), arg->is_in);
 
-#ifndef NDEBUG
-        std::cout << "Buffer arg[2/2]: size = "  << memory_buffer.size << 
-            "  d_ptr = " << (void *)memory_buffer.d_ptr << "\n";
-#endif
+        CUDA_LOG_TRACE("Buffer arg[2/2]: size = %zu  d_ptr = %p", memory_manager.get_buffer(arg->id).size, (void *)buffer_ptrs[i]);
 
-        CUdeviceptr *cuptr = new CUdeviceptr;
-        *cuptr = memory_buffer.d_ptr;
-        buffers.push_back(cuptr);
-
-        kernel_args[i] = (void *) cuptr;
+        kernel_args[i] = (void *) &buffer_ptrs[i];
+        if (profiler.is_enabled()) buffer_ids.push_back(arg->id);
         break;
       }
       case SCALAR:
@@ -104,40 +261,109 @@ void CudaManager::launch_kernel(const CUfunction kernel, CudaResourceArgs &r_arg
         ScalarArg *arg = (ScalarArg *) base;
         current_arg += sizeof(ScalarArg);
 
-#ifndef NDEBUG
-        std::cout << "Scalar arg: ptr = " << arg->ptr << "\n";
-#endif
+        CUDA_LOG_TRACE("Scalar arg: ptr = %p", arg->ptr);
         kernel_args[i] = arg->ptr;
 
+        break;
+      }
+      case VALUE:
+      {
+        ValueArg *arg = (ValueArg *) base;
+        current_arg += sizeof(ValueArg);
+
+        CUDA_LOG_TRACE("Value arg: size = %u", arg->size);
+        // Points into args, which outlives the launch call
+        kernel_args[i] = (void *) &arg->value;
+
         break;
       }
     }
   }
 
-#ifndef NDEBUG
-  std::cout << "Executing...\n";
-#endif
-  // Execute
+  CUDA_LOG_TRACE("Executing...");
+  // Execute, argument values are copied by cuLaunchKernel so they only have to outlive the call
+  CUstream stream = stream_pool.next_stream();
+  ProfileMark mark = profiler.begin(stream);
   CUDA_SAFE_CALL(
       cuLaunchKernel(kernel, 
         r_args.grid_dim.x , r_args.grid_dim.y , r_args.grid_dim.z , // grid dim 
         r_args.block_dim.x, r_args.block_dim.y, r_args.block_dim.z, // block dim
-        0, NULL, // shared mem, stream
+        0, stream, // shared mem, stream
         kernel_args, 0) // args, extras
       );
+  profiler.end_launch(mark, stream, kernel, buffer_ids);
 
-  // Synchronize
-  CUDA_SAFE_CALL(cuCtxSynchronize());
+  return std::make_shared<CompletionHandle>(get_context(r_args.device_id), stream, stream_pool.get_callback_stream());
+}
+
+
+void CudaManager::pack_arguments(int device_id, const KernelParamLayout &layout, const char *args, int arg_count, void *buffer) {
+  assert(layout.valid && "Kernel has no parameter layout");
+  assert(arg_count == (int) layout.params.size() && "Argument count does not match the kernel parameters");
 
-#ifndef NDEBUG
-  std::cout << "Execution complete!\n";
-#endif
+  char *params = (char *) buffer;
+  const char *current_arg = args;
+  for (int i = 0; i < arg_count; ++i) {
+    const KernelParam &param = layout.params[i];
+    Arg *base = (Arg *) current_arg;
+
+    switch (base->type) {
+      case BUFFER:
+      {
+        BufferArg *arg = (BufferArg *) base;
+        current_arg += sizeof(BufferArg);
+        assert(param.size == sizeof(CUdeviceptr) && "Buffer passed to a parameter that is not a pointer");
 
-  for (CUdeviceptr *cuptr: buffers) {
-      delete cuptr;
+        memory_manager.prepare_for_launch(arg->id, arg->is_in);
+        CUdeviceptr d_ptr = memory_manager.resolve_buffer(arg->id, get_context(device_id), arg->is_in);
+        memcpy(params + param.offset, &d_ptr, sizeof(CUdeviceptr));
+        break;
+      }
+      case SCALAR:
+      {
+        ScalarArg *arg = (ScalarArg *) base;
+        current_arg += sizeof(ScalarArg);
+        memcpy(params + param.offset, arg->ptr, param.size);
+        break;
+      }
+      case VALUE:
+      {
+        ValueArg *arg = (ValueArg *) base;
+        current_arg += sizeof(ValueArg);
+        assert(arg->size == param.size && "Value size does not match the kernel parameter");
+        memcpy(params + param.offset, &arg->value, param.size);
+        break;
+      }
+    }
   }
 }
 
 
+CompletionHandlePtr CudaManager::launch_kernel_packed_async(const CUfunction kernel, CudaResourceArgs &r_args,
+    const void *params, size_t params_size) {
+  set_current_device(r_args.device_id);
+  if (r_args.auto_config()) configure_launch(kernel, r_args);
+  CudaStreamPool &stream_pool = stream_pools[r_args.device_id];
+
+  void *extra[] = {
+    CU_LAUNCH_PARAM_BUFFER_POINTER, (void *) params,
+    CU_LAUNCH_PARAM_BUFFER_SIZE, &params_size,
+    CU_LAUNCH_PARAM_END
+  };
+
+  CUstream stream = stream_pool.next_stream();
+  // Buffer ids are lost once packed, the launch is profiled without them
+  ProfileMark mark = memory_manager.profiler.begin(stream);
+  CUDA_SAFE_CALL(
+      cuLaunchKernel(kernel,
+        r_args.grid_dim.x , r_args.grid_dim.y , r_args.grid_dim.z , // grid dim
+        r_args.block_dim.x, r_args.block_dim.y, r_args.block_dim.z, // block dim
+        0, stream, // shared mem, stream
+        0, extra) // args, extras
+      );
+  memory_manager.profiler.end_launch(mark, stream, kernel, std::vector<int>());
+
+  return std::make_shared<CompletionHandle>(get_context(r_args.device_id), stream, stream_pool.get_callback_stream());
+}
 
 }
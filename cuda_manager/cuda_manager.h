@@ -3,7 +3,14 @@
 
 #include "cuda_common.h"
 #include "cuda_memory_manager.h"
+#include "cuda_completion.h"
+#include "cuda_stream_pool.h"
+#include "cuda_param_layout.h"
+#include "cuda_device_worker.h"
 #include <cuda.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 // Dimensions for grid and blocks
@@ -18,30 +25,145 @@ struct CudaResourceArgs {
     int device_id;
     CudaDims grid_dim;
     CudaDims block_dim;
+    // With block_dim left zero, a 1D launch of one thread per element is configured from the kernel occupancy
+    size_t element_count = 0;
+
+    bool auto_config() const { return block_dim.x == 0; }
 };
 
 namespace cuda_manager {
 
+// Threads that make the driver calls of a CudaApi
+enum ExecutionModel {
+  CALLER_THREADS, // Every call runs on the calling thread, switching its current context as needed
+  DEVICE_WORKERS  // Calls are routed to one worker thread per device, bound to the device context
+};
+
+// When device contexts are created
+enum InitMode {
+  LAZY_INIT, // On the first use of each device
+  EAGER_INIT // All devices at construction, in parallel
+};
+
+// Time spent in each startup phase, in milliseconds
+struct StartupTimes {
+  double driver_init;               // cuInit
+  double device_query;              // Enumerating devices and their properties
+  std::vector<double> context_init; // Per device, retaining the primary context and creating streams, 0 until used
+  double eager_init;                // Wall time of the parallel initialization of every device, 0 if lazy
+};
+
 /*! \brief A class that manages devices, contexts and launches kernels.
+ * Launches can be issued from several threads at once, each thread switches its own current context as needed.
+ * Devices use their primary context, retained when the device is first used unless initialized eagerly.
  */
 class CudaManager {
+private:
+  std::unique_ptr<std::once_flag[]> device_init;
+  std::unique_ptr<std::once_flag[]> worker_init;
+  bool use_workers = false;
+  // One per device, created on first use once workers are started
+  std::vector<std::unique_ptr<DeviceWorker>> workers;
+
+  std::mutex startup_mutex; // Guards startup_times
+  StartupTimes startup_times;
+
+  void init_device(int device_id);
+  DeviceWorker *get_worker(int device_id);
+
 public:
   CudaMemoryManager memory_manager;
 
   uint32_t device_count = 0;
-  // (Device, Context) pairs
+  // (Device, Context) pairs, a context is null until its device is initialized, see get_context
   CUdevice *devices; 
-  CUcontext *contexts;
+  std::atomic<CUcontext> *contexts;
+  // Streams used for launches, one pool per device, created with the context
+  CudaStreamPool *stream_pools;
 
 
-  CudaManager();
+  CudaManager(InitMode init_mode = LAZY_INIT);
   ~CudaManager();
+
+  bool is_valid_device(int device_id) const { return device_id >= 0 && device_id < (int) device_count; }
+
+  // \return the context of device_id, initializing the device on first use
+  CUcontext get_context(int device_id) {
+    CUcontext context = contexts[device_id].load(std::memory_order_acquire);
+    if (context != nullptr) return context;
+    init_device(device_id);
+    return contexts[device_id].load(std::memory_order_acquire);
+  }
+
+  StartupTimes get_startup_times();
+
+  // Make the context of device_id current on the calling thread, only switching if it is not already
+  void set_current_device(int device_id);
+
+  // Threads that never selected a device get device 0, as the thread that created the manager does
+  void ensure_context();
+
+  // \return the device a context belongs to
+  int get_device_id(CUcontext context) const;
+
+  // Calls go through a worker thread per device from then on, workers start on the first call for their device
+  void start_workers();
+  // Run the calls already submitted and stop the workers
+  void stop_workers();
+  bool has_workers() const { return use_workers; }
+
+  /*! \brief Run function with the context of device_id current.
+   * Runs on the worker of the device once workers are started, on the calling thread otherwise.
+   * Returns once function has returned in both cases.
+   */
+  template <typename F>
+  void run_on_device(int device_id, F &&function) {
+    if (!use_workers) {
+      set_current_device(device_id);
+      function();
+    } else {
+      get_worker(device_id)->call(function);
+    }
+  }
   
+  /*! \brief Set grid_dim and block_dim of an automatic launch from the occupancy of kernel, cached per kernel.
+   * Kernels get at least element_count threads and have to check their index against it.
+   * The context of kernel must be current.
+   */
+  void configure_launch(const CUfunction kernel, CudaResourceArgs &r_args);
+  // Compare the occupancy of r_args with the automatic configuration, the context of kernel must be current
+  OccupancyReport get_occupancy_report(const CUfunction kernel, const CudaResourceArgs &r_args);
+
   // Load kernel from a ptx and function name
   void launch_kernel_from_ptx(const char *ptx, const char* function_name, CudaResourceArgs &r_args, const char *args, int arg_count);
 
   // Careful! this function will launch a kernel in the current context, if you are not manually managing contexts, do not use this function directly
+  // Blocks until the kernel completes
   void launch_kernel(const CUfunction kernel, CudaResourceArgs &r_args, const char *args, int arg_count);
+
+  /*! \brief Spread launches of every device over its stream pool so independent launches can overlap, off by default.
+   * Launches are then no longer ordered with each other, only with synchronous copies.
+   */
+  void set_concurrent_launches(bool enabled);
+
+  /*! \brief Queue a kernel on the launch stream of the device and return without waiting for it.
+   * Arguments are consumed by the time this returns, args and the scalars it points to can be reused right away.
+   * \return handle to wait on, poll or attach a completion callback to
+   */
+  CompletionHandlePtr launch_kernel_async(const CUfunction kernel, CudaResourceArgs &r_args, const char *args, int arg_count);
+
+  /*! \brief Pack arguments into a single parameter buffer laid out as layout.
+   * Buffer ids are resolved to device pointers for device_id, scalar and value arguments are copied in,
+   * so the packed buffer no longer depends on args or the memory it points to.
+   * \param buffer at least layout.size bytes, aligned to 8 bytes
+   */
+  void pack_arguments(int device_id, const KernelParamLayout &layout, const char *args, int arg_count, void *buffer);
+
+  /*! \brief Queue a kernel with its parameters passed as one packed buffer (CU_LAUNCH_PARAM_BUFFER_POINTER).
+   * The buffer is copied by the launch, so it can be reused or relaunched right away.
+   */
+  CompletionHandlePtr launch_kernel_packed_async(const CUfunction kernel, CudaResourceArgs &r_args,
+      const void *params, size_t params_size);
 };
 
 }
@@ -1,58 +1,358 @@
 #include "cuda_memory_manager.h" 
 #include <assert.h>
+#include <algorithm>
 #include <map>
 #include "cuda_common.h"
+#include "cuda_log.h"
+#include "cuda_metrics.h"
 
 namespace cuda_manager {
 
 void CudaMemoryManager::allocate_kernel(int id, size_t size) {
   assert(size > 0 && "Kernel size is 0 or less");
 
-  printf("[Memory manager] Allocated kernel id %d size %zu\n", id, size);
+  CUDA_LOG_DEBUG("[Memory manager] Allocated kernel id %d size %zu", id, size);
 
-  MemoryKernel mem_kernel = { id, size, nullptr, nullptr };
-  kernels.emplace(id, mem_kernel);
+  MemoryKernel mem_kernel = { id, size, nullptr };
+  kernels.insert(id, mem_kernel);
+}
+
+static uint64_t image_digest(const void *data, size_t size) {
+    // FNV-1a
+    const unsigned char *bytes = (const unsigned char *) data;
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+CUmodule CudaMemoryManager::acquire_module(const void *data, size_t size, ModuleKey *key, CUresult *result) {
+    CUDA_SAFE_CALL(cuCtxGetCurrent(&key->context));
+    key->digest = image_digest(data, size);
+    key->size = size;
+    key->variant = 0;
+
+    std::lock_guard<std::mutex> lock(modules_mutex);
+    std::map<ModuleKey, LoadedModule>::iterator it;
+    for (it = modules.find(*key); it != modules.end(); it = modules.find(*key)) {
+        if (it->second.image.compare(0, std::string::npos, (const char *) data, size) == 0) {
+            ++it->second.ref_count;
+            ++module_loads_avoided;
+            CUDA_LOG_DEBUG("[Memory manager] Reusing module %p, references %d", it->second.module, it->second.ref_count);
+            return it->second.module;
+        }
+        // Same digest, different image: never share, look for or load a module of its own
+        CUDA_LOG_WARN("[Memory manager] Module digest collision, loading the image separately");
+        ++key->variant;
+    }
+
+    LoadedModule loaded_module = { nullptr, 1, std::string((const char *) data, size) };
+    uint64_t load_start = metrics_now();
+    CUresult load_result = cuModuleLoadDataEx(&loaded_module.module, (char *) data, 0, 0, 0);
+    if (result != nullptr) {
+        *result = load_result;
+        if (load_result != CUDA_SUCCESS) return nullptr;
+    } else {
+        CUDA_SAFE_CALL(load_result);
+    }
+    if (metrics_enabled()) record_module_load(metrics_now() - load_start);
+    CUDA_LOG_DEBUG("[Memory manager] Loaded module %p", loaded_module.module);
+
+    modules.emplace(*key, loaded_module);
+    return loaded_module.module;
+}
+
+void CudaMemoryManager::release_module(const ModuleKey &key) {
+    std::lock_guard<std::mutex> lock(modules_mutex);
+    std::map<ModuleKey, LoadedModule>::iterator it;
+    it = modules.find(key);
+    assert(it != modules.end() && "Module does not exist");
+
+    if (--it->second.ref_count > 0) return;
+
+    CUDA_LOG_DEBUG("[Memory manager] Unloaded module %p", it->second.module);
+    CUDA_SAFE_CALL(cuModuleUnload(it->second.module));
+    modules.erase(it);
 }
 
 void CudaMemoryManager::deallocate_kernel(int id) {
-    std::map<int, MemoryKernel>::iterator it;
-    it = kernels.find(id);
-    assert(it != kernels.end() && "Kernel does not exist");
+    MemoryKernel &mem_kernel = get_kernel(id);
 
-    if(it->second.module != nullptr) {
-        printf("[Memory manager] Unloaded module %p\n", it->second.module);
-        CUDA_SAFE_CALL(cuModuleUnload(it->second.module));
+    swap_kernel_version(mem_kernel, nullptr);
+
+    CUDA_LOG_DEBUG("[Memory manager] Deallocated kernel id %d", id);
+    kernels.erase(id);
+
+    // Unload the module once its launches completed, versions still running are left for the next call
+    reclaim_kernels();
+}
+
+KernelVersionPtr CudaMemoryManager::load_kernel_version(int id, const char *function_name, const void *data, size_t size) {
+    CUDA_LOG_DEBUG("[Memory manager] Loading module for kernel id %d", id);
+
+    // Load module (or share an already loaded one) and get kernel handle
+    std::shared_ptr<KernelVersion> version(new KernelVersion);
+    CUresult result;
+    version->module = acquire_module(data, size, &version->module_key, &result);
+    if (version->module == nullptr) {
+        const char *name;
+        cuGetErrorName(result, &name);
+        CUDA_LOG_ERROR("[Memory manager] Loading module for kernel id %d failed with %s", id, name);
+        return nullptr;
+    }
+
+    result = cuModuleGetFunction(&version->kernel, version->module, function_name);
+    if (result != CUDA_SUCCESS) {
+        CUDA_LOG_ERROR("[Memory manager] No function %s in the module of kernel id %d", function_name, id);
+        release_module(version->module_key);
+        return nullptr;
     }
+    CUDA_LOG_DEBUG("[Memory manager] Got function %p", version->kernel);
+    profiler.set_function_name(version->kernel, function_name);
+    version->function_name = function_name;
 
-    printf("[Memory manager] Deallocated kernel id %d\n", id);
-    kernels.erase(it);
+    if (!parse_param_layout((const char *) data, size, function_name, &version->param_layout)) {
+        CUDA_LOG_WARN("[Memory manager] No parameter layout for kernel id %d, packed launches are unavailable", id);
+    }
+    return version;
+}
+
+void CudaMemoryManager::swap_kernel_version(MemoryKernel &mem_kernel, KernelVersionPtr version) {
+    // Launches load the version once, they run either the old or the new one in full
+    KernelVersionPtr replaced = std::atomic_exchange(&mem_kernel.version, version);
+    if (replaced != nullptr) retire_kernel(std::move(replaced));
 }
 
 void CudaMemoryManager::write_kernel(int id, const char *function_name, const void *data, size_t size) {
-    std::map<int, MemoryKernel>::iterator it;
-    it = kernels.find(id);
-    assert(it != kernels.end() && "Kernel does not exist");
-    MemoryKernel *mem_kernel = &it->second;
+    MemoryKernel &mem_kernel = get_kernel(id);
+
+    assert(size <= mem_kernel.size && "Data size is greater than kernel size");
+
+    KernelVersionPtr version = load_kernel_version(id, function_name, data, size);
+    if (version == nullptr) {
+        log_flush();
+        exit(1);
+    }
+    swap_kernel_version(mem_kernel, version);
+    reclaim_kernels();
+}
+
+bool CudaMemoryManager::reload_kernel(int id, const char *function_name, const void *data, size_t size) {
+    MemoryKernel &mem_kernel = get_kernel(id);
+
+    KernelVersionPtr version = load_kernel_version(id, function_name, data, size);
+    if (version == nullptr) {
+        ++reload_failure_count;
+        return false;
+    }
+    swap_kernel_version(mem_kernel, version);
+    ++reload_count;
+    CUDA_LOG_INFO("[Memory manager] Reloaded kernel id %d, function %s", id, function_name);
+
+    reclaim_kernels();
+    return true;
+}
+
+KernelVersionPtr CudaMemoryManager::get_kernel_version(int id) {
+    return std::atomic_load(&get_kernel(id).version);
+}
+
+CUfunction CudaMemoryManager::get_function(const KernelVersion &version, CUcontext context) {
+    if (context == version.module_key.context) return version.kernel;
+
+    std::lock_guard<std::mutex> lock(version.contexts_mutex);
+    for (const ContextFunction &function: version.other_contexts) {
+        if (function.module_key.context == context) return function.kernel;
+    }
+
+    // The module table keeps the image the version was written from
+    std::string image;
+    {
+        std::lock_guard<std::mutex> modules_lock(modules_mutex);
+        image = modules.at(version.module_key).image;
+    }
+
+    ScopedContext scoped_context(context);
+    ContextFunction function;
+    function.module = acquire_module(image.data(), image.size(), &function.module_key);
+    CUDA_SAFE_CALL(cuModuleGetFunction(&function.kernel, function.module, version.function_name.c_str()));
+    profiler.set_function_name(function.kernel, version.function_name.c_str());
+    CUDA_LOG_DEBUG("[Memory manager] Loaded function %s in context %p", version.function_name.c_str(), context);
+
+    version.other_contexts.push_back(function);
+    return function.kernel;
+}
+
+void CudaMemoryManager::retire_kernel(KernelVersionPtr version) {
+    std::lock_guard<std::mutex> lock(retired_mutex);
+    retired_kernels.push_back({std::move(version), {}});
+}
+
+size_t CudaMemoryManager::reclaim_kernels(bool wait) {
+    std::lock_guard<std::mutex> lock(retired_mutex);
+    size_t kept = 0;
+    for (size_t i = 0; i < retired_kernels.size(); ++i) {
+        RetiredKernel &retired = retired_kernels[i];
+        bool done = false;
+
+        // Nobody can get hold of a retired version again, once the count drops to one it stays there
+        // and no context is added to it any more
+        if (retired.version.use_count() == 1) {
+            const KernelVersion &version = *retired.version;
+            std::vector<ModuleKey> keys(1, version.module_key);
+            std::vector<CUfunction> functions(1, version.kernel);
+            for (const ContextFunction &function: version.other_contexts) {
+                keys.push_back(function.module_key);
+                functions.push_back(function.kernel);
+            }
+
+            if (retired.fences.empty()) {
+                // The pool streams are blocking, so the NULL stream orders the fence after every launch queued so far
+                for (const ModuleKey &key: keys) {
+                    ScopedContext scoped_context(key.context);
+                    CUevent fence;
+                    CUDA_SAFE_CALL(cuEventCreate(&fence, CU_EVENT_DISABLE_TIMING));
+                    CUDA_SAFE_CALL(cuEventRecord(fence, NULL));
+                    retired.fences.push_back(fence);
+                }
+            }
+
+            done = true;
+            for (size_t j = 0; j < keys.size(); ++j) {
+                if (retired.fences[j] == nullptr) continue;
+                ScopedContext scoped_context(keys[j].context);
+                CUresult result = wait ? cuEventSynchronize(retired.fences[j]) : cuEventQuery(retired.fences[j]);
+                if (result == CUDA_ERROR_NOT_READY) {
+                    done = false;
+                    continue;
+                }
+                CUDA_SAFE_CALL(result);
+                CUDA_SAFE_CALL(cuEventDestroy(retired.fences[j]));
+                retired.fences[j] = nullptr;
+            }
+
+            if (done) {
+                for (size_t j = 0; j < keys.size(); ++j) {
+                    ScopedContext scoped_context(keys[j].context);
+                    launch_configs.forget(functions[j]);
+                    release_module(keys[j]);
+                }
+                ++retired_unloaded_count;
+            }
+        }
+
+        if (!done) {
+            if (kept != i) retired_kernels[kept] = std::move(retired);
+            ++kept;
+        }
+    }
+    retired_kernels.resize(kept);
+    return kept;
+}
+
+ReloadStats CudaMemoryManager::get_reload_stats() {
+    ReloadStats stats;
+    stats.reloads = reload_count;
+    stats.reload_failures = reload_failure_count;
+    {
+        std::lock_guard<std::mutex> lock(retired_mutex);
+        stats.retired_pending = retired_kernels.size();
+    }
+    stats.retired_unloaded = retired_unloaded_count;
+    return stats;
+}
+
+
+MemoryKernel &CudaMemoryManager::get_kernel(int id) {
+    MemoryKernel *mem_kernel = kernels.find(id);
+    assert(mem_kernel != nullptr && "Kernel does not exist");
+    return *mem_kernel;
+}
+
+bool CudaSlabBackend::allocate_slab(size_t size, uint64_t *address) {
+    CUdeviceptr d_ptr;
+    CUresult result = cuMemAlloc(&d_ptr, size);
+    if (result == CUDA_ERROR_OUT_OF_MEMORY) return false;
+    CUDA_SAFE_CALL(result);
+
+    CUDA_LOG_DEBUG("[Memory manager] Reserved slab of %zu bytes at %p", size, (void *)d_ptr);
+    *address = d_ptr;
+    return true;
+}
 
-    assert(size <= mem_kernel->size && "Data size is greater than kernel size");
+void CudaSlabBackend::free_slab(uint64_t address, size_t size) {
+    CUDA_LOG_DEBUG("[Memory manager] Released slab of %zu bytes at %p", size, (void *)address);
+    CUDA_SAFE_CALL(cuMemFree(address));
+}
 
-    printf("[Memory manager] Loading module for kernel id %d\n", id);
+DeviceHeap *CudaMemoryManager::get_heap(CUcontext context) {
+    std::lock_guard<std::mutex> lock(contexts_mutex);
+    std::map<CUcontext, DeviceHeap *>::iterator it;
+    it = heaps.find(context);
+    if (it != heaps.end()) return it->second;
 
-    // Load module and get kernel handle
-    CUDA_SAFE_CALL(cuModuleLoadDataEx(&mem_kernel->module, (char *) data, 0, 0, 0));
-    CUDA_SAFE_CALL(cuModuleGetFunction(&mem_kernel->kernel, mem_kernel->module, function_name));
-    printf("[Memory manager] Loaded module %p\n", mem_kernel->module);
-    printf("[Memory manager] Got function %p\n", mem_kernel->kernel);
+    DeviceHeap *heap = new DeviceHeap;
+    heaps.emplace(context, heap);
+    return heap;
 }
 
+void CudaMemoryManager::reclaim_pending_frees(DeviceHeap *heap, bool wait) {
+    std::vector<PendingFree> &pending = heap->pending_frees;
+    for (size_t i = 0; i < pending.size();) {
+        if (wait) {
+            CUDA_SAFE_CALL(cuEventSynchronize(pending[i].event));
+        } else {
+            CUresult result = cuEventQuery(pending[i].event);
+            if (result == CUDA_ERROR_NOT_READY) {
+                ++i;
+                continue;
+            }
+            CUDA_SAFE_CALL(result);
+        }
 
-MemoryKernel CudaMemoryManager::get_kernel(int id) {
-    std::map<int, MemoryKernel>::iterator it;
+        heap->allocator.free(pending[i].address);
+        heap->spare_events.push_back(pending[i].event);
+        pending[i] = pending.back();
+        pending.pop_back();
+    }
+}
 
-    it = kernels.find(id);
-    assert(it != kernels.end() && "Kernel does not exist");
+uint64_t CudaMemoryManager::allocate_device_memory(CUcontext context, size_t size) {
+    DeviceHeap *heap = get_heap(context);
+    std::lock_guard<std::mutex> lock(heap->mutex);
+    reclaim_pending_frees(heap, false);
 
-    return it->second;
+    uint64_t address;
+    if (!heap->allocator.allocate(size, &address)) {
+        // Memory held by buffers freed while still in use may be enough
+        reclaim_pending_frees(heap, true);
+        if (!heap->allocator.allocate(size, &address)) {
+            CUDA_LOG_ERROR("out of device memory allocating %zu bytes", size);
+            log_flush();
+            exit(1);
+        }
+    }
+    return address;
+}
+
+void CudaMemoryManager::free_device_memory(CUcontext context, uint64_t address) {
+    // cuMemFree would wait for queued work, the allocator does not, so the memory is only
+    // reused once everything queued so far (which the NULL stream waits for) has completed
+    DeviceHeap *heap = get_heap(context);
+    PendingFree pending;
+    pending.address = address;
+    ScopedContext scoped_context(context);
+    std::lock_guard<std::mutex> lock(heap->mutex);
+    if (heap->spare_events.empty()) {
+        CUDA_SAFE_CALL(cuEventCreate(&pending.event, CU_EVENT_DISABLE_TIMING));
+    } else {
+        pending.event = heap->spare_events.back();
+        heap->spare_events.pop_back();
+    }
+    CUDA_SAFE_CALL(cuEventRecord(pending.event, NULL));
+    heap->pending_frees.push_back(pending);
 }
 
 void CudaMemoryManager::allocate_buffer(int id, size_t size) {
@@ -61,50 +361,682 @@ void CudaMemoryManager::allocate_buffer(int id, size_t size) {
     MemoryBuffer mem_buffer;
     mem_buffer.id = id;
     mem_buffer.size = size;
+    mem_buffer.placement = FIRST_TOUCH;
+    mem_buffer.touched = false;
+    mem_buffer.placement_mutex = std::make_shared<std::recursive_mutex>();
+    mem_buffer.placement_generation = std::make_shared<std::atomic<uint64_t>>(0);
+    CUDA_SAFE_CALL(cuCtxGetCurrent(&mem_buffer.context));
+    mem_buffer.d_ptr = allocate_device_memory(mem_buffer.context, size);
 
-    CUDA_SAFE_CALL(cuMemAlloc(&mem_buffer.d_ptr, size));
+    CUDA_LOG_DEBUG("[Memory manager] Allocated %zu bytes at %p", size, (void *)mem_buffer.d_ptr);
 
-    printf("[Memory manager] Allocated %zu bytes at %p\n", size, (void *)mem_buffer.d_ptr);
-
-    buffers.emplace(id, mem_buffer);
+    buffers.insert(id, mem_buffer);
 }
 
 void CudaMemoryManager::deallocate_buffer(int id) {
-    std::map<int, MemoryBuffer>::iterator it;
-    it = buffers.find(id);
-    assert(it != buffers.end() && "Buffer does not exist");
+    MemoryBuffer &mem_buffer = get_buffer(id);
+
+    CUDA_LOG_DEBUG("[Memory manager] Deallocated Buffer %p", (void *)mem_buffer.d_ptr);
 
-    printf("[Memory manager] Deallocated Buffer %p\n", (void *)it->second.d_ptr);
-    CUDA_SAFE_CALL(cuMemFree(it->second.d_ptr));
+    drop_replicas(mem_buffer);
+    free_device_memory(mem_buffer.context, mem_buffer.d_ptr);
+    ++*mem_buffer.placement_generation;
+
+    buffers.erase(id);
+}
 
-    buffers.erase(it);
+void CudaMemoryManager::set_placement(int id, PlacementPolicy placement) {
+    MemoryBuffer &mem_buffer = get_buffer(id);
+    if (placement != REPLICATE_READ_ONLY) drop_replicas(mem_buffer);
+    mem_buffer.placement = placement;
 }
 
-MemoryBuffer CudaMemoryManager::get_buffer(int id) {
-    std::map<int, MemoryBuffer>::iterator it;
-    it = buffers.find(id);
-    assert(it != buffers.end() && "Buffer does not exist");
-    return it->second;
+bool CudaMemoryManager::enable_peer_access(CUcontext context, CUcontext peer) {
+    std::lock_guard<std::mutex> lock(contexts_mutex);
+    std::map<std::pair<CUcontext, CUcontext>, bool>::iterator it;
+    it = peer_access.find(std::make_pair(context, peer));
+    if (it != peer_access.end()) return it->second;
+
+    CUdevice device, peer_device;
+    {
+        ScopedContext scoped_context(peer);
+        CUDA_SAFE_CALL(cuCtxGetDevice(&peer_device));
+    }
+    ScopedContext scoped_context(context);
+    CUDA_SAFE_CALL(cuCtxGetDevice(&device));
+
+    int can_access = 0;
+    CUDA_SAFE_CALL(cuDeviceCanAccessPeer(&can_access, device, peer_device));
+    if (can_access) {
+        CUDA_SAFE_CALL(cuCtxEnablePeerAccess(peer, 0));
+    }
+    CUDA_LOG_INFO("[Memory manager] Peer access from device %d to device %d: %s", device, peer_device,
+        can_access ? "enabled" : "unavailable");
+
+    peer_access[std::make_pair(context, peer)] = can_access != 0;
+    return can_access != 0;
+}
+
+void CudaMemoryManager::copy_between(int id, CUcontext dst_context, CUdeviceptr dst, CUcontext src_context, CUdeviceptr src, size_t size) {
+    std::lock_guard<std::recursive_mutex> placement_lock(*get_buffer(id).placement_mutex);
+    TransferTimer timer(PEER_TO_PEER, size);
+    CopyStreams *dst_copy = get_copy_streams(dst_context);
+    CopyStreams *src_copy = get_copy_streams(src_context);
+    CUstream dst_stream = dst_copy->streams.get_stream(0);
+    CUstream src_stream = src_copy->streams.get_stream(1);
+
+    // Order the copy after everything queued on either device, as synchronous copies would be
+    {
+        ScopedContext scoped_context(src_context);
+        CUDA_SAFE_CALL(cuEventRecord(src_copy->fence, NULL));
+        CUDA_SAFE_CALL(cuStreamWaitEvent(src_stream, src_copy->fence, 0));
+    }
+    ScopedContext scoped_context(dst_context);
+    CUDA_SAFE_CALL(cuEventRecord(dst_copy->fence, NULL));
+    CUDA_SAFE_CALL(cuStreamWaitEvent(dst_stream, dst_copy->fence, 0));
+    CUDA_SAFE_CALL(cuStreamWaitEvent(dst_stream, src_copy->fence, 0));
+
+    ProfileMark mark = profiler.begin(dst_stream);
+    if (enable_peer_access(dst_context, src_context)) {
+        CUDA_SAFE_CALL(cuMemcpyPeerAsync(dst, dst_context, src, src_context, size, dst_stream));
+        ++peer_copy_count;
+    } else {
+        staging_pool.copy_async(dst_context, dst, dst_stream, src_context, src, src_stream, size);
+        ++staged_copy_count;
+    }
+    profiler.end_copy(mark, dst_stream, PROFILE_PEER_TO_PEER, id, size);
+    CUDA_SAFE_CALL(cuStreamSynchronize(dst_stream));
+    bytes_copied += size;
+}
+
+void CudaMemoryManager::drop_replicas(MemoryBuffer &mem_buffer) {
+    std::lock_guard<std::recursive_mutex> placement_lock(*mem_buffer.placement_mutex);
+    if (mem_buffer.replicas.empty()) return;
+    for (BufferReplica &replica: mem_buffer.replicas) {
+        free_device_memory(replica.context, replica.d_ptr);
+    }
+    mem_buffer.replicas.clear();
+    ++*mem_buffer.placement_generation;
+}
+
+CUdeviceptr CudaMemoryManager::migrate_buffer(MemoryBuffer &mem_buffer, CUcontext context) {
+    CUdeviceptr d_ptr = allocate_device_memory(context, mem_buffer.size);
+    copy_between(mem_buffer.id, context, d_ptr, mem_buffer.context, mem_buffer.d_ptr, mem_buffer.size);
+    free_device_memory(mem_buffer.context, mem_buffer.d_ptr);
+    CUDA_LOG_INFO("[Memory manager] Migrated buffer id %d from %p to %p", mem_buffer.id, (void *)mem_buffer.d_ptr, (void *)d_ptr);
+
+    mem_buffer.d_ptr = d_ptr;
+    mem_buffer.context = context;
+    ++*mem_buffer.placement_generation;
+    ++migration_count;
+    return d_ptr;
+}
+
+CUdeviceptr CudaMemoryManager::resolve_buffer(int id, CUcontext context, bool is_in, uint64_t *generation) {
+    MemoryBuffer &mem_buffer = get_buffer(id);
+    // Held until the pointer is returned, so a concurrent launch cannot move or free what it points to
+    std::lock_guard<std::recursive_mutex> placement_lock(*mem_buffer.placement_mutex);
+    CUdeviceptr d_ptr = place_buffer(mem_buffer, context, is_in);
+    if (generation != nullptr) *generation = *mem_buffer.placement_generation;
+    return d_ptr;
+}
+
+CUdeviceptr CudaMemoryManager::place_buffer(MemoryBuffer &mem_buffer, CUcontext context, bool is_in) {
+    int id = mem_buffer.id;
+    bool first_use = !mem_buffer.touched;
+    mem_buffer.touched = true;
+    // The kernel may write the home copy, replicas of it go stale
+    if (!is_in) drop_replicas(mem_buffer);
+    if (mem_buffer.context == context) return mem_buffer.d_ptr;
+
+    switch (mem_buffer.placement) {
+        case FIRST_TOUCH:
+            // Settled once used, peers access it in place when they can
+            if (!first_use && enable_peer_access(context, mem_buffer.context)) return mem_buffer.d_ptr;
+            // Fall through, move it
+        case MIGRATE:
+            return migrate_buffer(mem_buffer, context);
+        case PINNED:
+        {
+            if (!enable_peer_access(context, mem_buffer.context)) {
+                CUDA_LOG_ERROR("pinned buffer %d used from a device without peer access to it", id);
+                log_flush();
+                exit(1);
+            }
+            return mem_buffer.d_ptr;
+        }
+        case REPLICATE_READ_ONLY:
+        {
+            if (!is_in) {
+                // Writes to a replica would be thrown away with it, the kernel has to get the home copy
+                CUDA_LOG_WARN("[Memory manager] Read only buffer id %d written by a launch, moving it instead of replicating", id);
+                return migrate_buffer(mem_buffer, context);
+            }
+            for (BufferReplica &replica: mem_buffer.replicas) {
+                if (replica.context == context) return replica.d_ptr;
+            }
+
+            BufferReplica replica;
+            replica.context = context;
+            replica.d_ptr = allocate_device_memory(context, mem_buffer.size);
+            copy_between(mem_buffer.id, context, replica.d_ptr, mem_buffer.context, mem_buffer.d_ptr, mem_buffer.size);
+            mem_buffer.replicas.push_back(replica);
+            // Output bindings of other launches have to drop it when they write
+            ++*mem_buffer.placement_generation;
+            CUDA_LOG_INFO("[Memory manager] Replicated buffer id %d to %p", id, (void *)replica.d_ptr);
+
+            ++replication_count;
+            return replica.d_ptr;
+        }
+    }
+    return mem_buffer.d_ptr;
+}
+
+PlacementStats CudaMemoryManager::get_placement_stats() const {
+    PlacementStats stats;
+    stats.migrations = migration_count;
+    stats.replications = replication_count;
+    stats.peer_copies = peer_copy_count;
+    stats.staged_copies = staged_copy_count;
+    stats.bytes_copied = bytes_copied;
+    return stats;
+}
+
+size_t CudaMemoryManager::trim() {
+    std::map<CUcontext, DeviceHeap *> heaps_copy;
+    {
+        std::lock_guard<std::mutex> lock(contexts_mutex);
+        heaps_copy = heaps;
+    }
+
+    size_t released = 0;
+    for (auto &entry: heaps_copy) {
+        ScopedContext scoped_context(entry.first);
+        std::lock_guard<std::mutex> lock(entry.second->mutex);
+        reclaim_pending_frees(entry.second, false);
+        released += entry.second->allocator.trim();
+    }
+    CUDA_LOG_INFO("[Memory manager] Trimmed %zu bytes", released);
+    return released;
+}
+
+AllocatorStats CudaMemoryManager::get_allocator_stats(CUcontext context) {
+    DeviceHeap *heap = get_heap(context);
+    std::lock_guard<std::mutex> lock(heap->mutex);
+    return heap->allocator.get_stats();
+}
+
+MemoryBuffer &CudaMemoryManager::get_buffer(int id) {
+    MemoryBuffer *mem_buffer = buffers.find(id);
+    assert(mem_buffer != nullptr && "Buffer does not exist");
+    return *mem_buffer;
+}
+
+void CudaMemoryManager::upload_range(const MemoryBuffer &mem_buffer, size_t offset, const void *data, size_t size) {
+    assert(offset + size <= mem_buffer.size && "Range is past the end of the buffer");
+    TransferTimer timer(HOST_TO_DEVICE, size);
+    CUdeviceptr d_ptr = mem_buffer.d_ptr + offset;
+    ScopedContext scoped_context(mem_buffer.context);
+
+    if (size < STAGING_THRESHOLD) {
+        ProfileMark mark = profiler.begin(NULL);
+        CUDA_SAFE_CALL(cuMemcpyHtoD(d_ptr, data, size));
+        profiler.end_copy(mark, NULL, PROFILE_HOST_TO_DEVICE, mem_buffer.id, size);
+        CUDA_LOG_DEBUG("[Memory manager] Copied HtoD %p to %p", data, (void *)d_ptr);
+        return;
+    }
+
+    // Order the staged copy after everything already queued, as the synchronous copy would be
+    CopyStreams *copy = get_copy_streams(mem_buffer.context);
+    CUstream stream = copy->streams.get_stream(0);
+    CUDA_SAFE_CALL(cuEventRecord(copy->fence, NULL));
+    CUDA_SAFE_CALL(cuStreamWaitEvent(stream, copy->fence, 0));
+
+    ProfileMark mark = profiler.begin(stream);
+    staging_pool.write_async(d_ptr, data, size, stream);
+    profiler.end_copy(mark, stream, PROFILE_HOST_TO_DEVICE, mem_buffer.id, size);
+    CUDA_SAFE_CALL(cuStreamSynchronize(stream));
+    CUDA_LOG_DEBUG("[Memory manager] Copied HtoD (staged) %p to %p", data, (void *)d_ptr);
+}
+
+void CudaMemoryManager::download_range(const MemoryBuffer &mem_buffer, size_t offset, void *buf, size_t size) {
+    assert(offset + size <= mem_buffer.size && "Range is past the end of the buffer");
+    TransferTimer timer(DEVICE_TO_HOST, size);
+    CUdeviceptr d_ptr = mem_buffer.d_ptr + offset;
+    ScopedContext scoped_context(mem_buffer.context);
+
+    if (size < STAGING_THRESHOLD) {
+        CUDA_LOG_DEBUG("[Memory manager] Copied DtoH %p to %p", (void *)d_ptr, buf);
+        ProfileMark mark = profiler.begin(NULL);
+        CUDA_SAFE_CALL(cuMemcpyDtoH(buf, d_ptr, size));
+        profiler.end_copy(mark, NULL, PROFILE_DEVICE_TO_HOST, mem_buffer.id, size);
+        return;
+    }
+
+    CopyStreams *copy = get_copy_streams(mem_buffer.context);
+    CUstream stream = copy->streams.get_stream(1);
+    CUDA_SAFE_CALL(cuEventRecord(copy->fence, NULL));
+    CUDA_SAFE_CALL(cuStreamWaitEvent(stream, copy->fence, 0));
+
+    ProfileMark mark = profiler.begin(stream);
+    staging_pool.read_async(buf, d_ptr, size, stream);
+    profiler.end_copy(mark, stream, PROFILE_DEVICE_TO_HOST, mem_buffer.id, size);
+    CUDA_SAFE_CALL(cuStreamSynchronize(stream));
+    CUDA_LOG_DEBUG("[Memory manager] Copied DtoH (staged) %p to %p", (void *)d_ptr, buf);
 }
 
 void CudaMemoryManager::write_buffer(int id, const void *data, size_t size) {
-    MemoryBuffer mem_buffer = get_buffer(id);
+    write_buffer_range(id, 0, data, size);
+}
+
+void CudaMemoryManager::read_buffer(int id, void *buf, size_t size) {
+    read_buffer_range(id, 0, buf, size);
+}
+
+void CudaMemoryManager::write_buffer_range(int id, size_t offset, const void *data, size_t size) {
+    MemoryBuffer &mem_buffer = get_buffer(id);
+    assert(offset + size <= mem_buffer.size && "Data size is greater than buffer size");
+
+    CUDA_LOG_DEBUG("[Memory manager] Writing %zu bytes from %p to buffer id %d (%p, %zu bytes) at offset %zu",
+        size, data, id, (void *)mem_buffer.d_ptr, mem_buffer.size, offset);
+
+    if (mem_buffer.shadow != nullptr) {
+        // Uploaded when a launch needs it
+        write_shadow(mem_buffer, offset, data, size);
+        return;
+    }
+
+    drop_replicas(mem_buffer);
+    upload_range(mem_buffer, offset, data, size);
+}
+
+void CudaMemoryManager::read_buffer_range(int id, size_t offset, void *buf, size_t size) {
+    MemoryBuffer &mem_buffer = get_buffer(id);
+    assert(offset + size <= mem_buffer.size && "Read size is greater than buffer size");
+
+    if (mem_buffer.shadow != nullptr) {
+        fetch_shadow(mem_buffer, offset, size);
+        memcpy(buf, &mem_buffer.shadow->data[offset], size);
+        return;
+    }
+
+    download_range(mem_buffer, offset, buf, size);
+}
+
+// Bytes past offset spanned by a box laid out as layout
+static size_t layout_span(const MemoryLayout &layout, const CopyExtent &extent) {
+    if (extent.width == 0 || extent.height == 0 || extent.depth == 0) return 0;
+    return ((extent.depth - 1) * layout.slice_height + (extent.height - 1)) * layout.pitch + extent.width;
+}
+
+// Run a strided copy, as a 2D copy when it has a single slice
+static void copy_strided(const CUDA_MEMCPY3D &params) {
+    if (params.Depth != 1) {
+        CUDA_SAFE_CALL(cuMemcpy3D(&params));
+        return;
+    }
+
+    CUDA_MEMCPY2D params_2d;
+    memset(&params_2d, 0, sizeof(CUDA_MEMCPY2D));
+    params_2d.srcMemoryType = params.srcMemoryType;
+    params_2d.srcHost = params.srcHost;
+    params_2d.srcDevice = params.srcDevice;
+    params_2d.srcPitch = params.srcPitch;
+    params_2d.dstMemoryType = params.dstMemoryType;
+    params_2d.dstHost = params.dstHost;
+    params_2d.dstDevice = params.dstDevice;
+    params_2d.dstPitch = params.dstPitch;
+    params_2d.WidthInBytes = params.WidthInBytes;
+    params_2d.Height = params.Height;
+    CUDA_SAFE_CALL(cuMemcpy2D(&params_2d));
+}
+
+// Copy parameters of a box, memory types and pointers are left to the caller
+static CUDA_MEMCPY3D strided_params(const MemoryLayout &dst, const MemoryLayout &src, const CopyExtent &extent) {
+    assert(extent.width <= dst.pitch && extent.width <= src.pitch && "Rows are wider than their pitch");
+    assert((extent.depth == 1 || (extent.height <= dst.slice_height && extent.height <= src.slice_height))
+        && "Slices are taller than their slice height");
+
+    CUDA_MEMCPY3D params;
+    memset(&params, 0, sizeof(CUDA_MEMCPY3D));
+    params.srcPitch = src.pitch;
+    params.srcHeight = src.slice_height;
+    params.dstPitch = dst.pitch;
+    params.dstHeight = dst.slice_height;
+    params.WidthInBytes = extent.width;
+    params.Height = extent.height;
+    params.Depth = extent.depth;
+    return params;
+}
+
+void CudaMemoryManager::prepare_device_access(MemoryBuffer &mem_buffer, size_t begin, size_t end, bool writes) {
+    if (mem_buffer.shadow != nullptr) {
+        flush_shadow(mem_buffer);
+        if (writes) mem_buffer.shadow->device_dirty.add(begin, end);
+    }
+    if (writes) drop_replicas(mem_buffer);
+}
+
+void CudaMemoryManager::write_buffer_strided(int id, const MemoryLayout &dst, const void *data,
+        const MemoryLayout &src, const CopyExtent &extent) {
+    MemoryBuffer &mem_buffer = get_buffer(id);
+    size_t span = layout_span(dst, extent);
+    assert(dst.offset + span <= mem_buffer.size && "Copy is past the end of the buffer");
+    if (span == 0) return;
+
+    prepare_device_access(mem_buffer, dst.offset, dst.offset + span, true);
+
+    CUDA_MEMCPY3D params = strided_params(dst, src, extent);
+    params.srcMemoryType = CU_MEMORYTYPE_HOST;
+    params.srcHost = (const char *) data + src.offset;
+    params.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+    params.dstDevice = mem_buffer.d_ptr + dst.offset;
+
+    size_t bytes = extent.width * extent.height * extent.depth;
+    TransferTimer timer(HOST_TO_DEVICE, bytes);
+    ScopedContext scoped_context(mem_buffer.context);
+    ProfileMark mark = profiler.begin(NULL);
+    copy_strided(params);
+    profiler.end_copy(mark, NULL, PROFILE_HOST_TO_DEVICE, id, bytes);
+    CUDA_LOG_DEBUG("[Memory manager] Copied HtoD %zux%zux%zu box to buffer id %d", extent.width, extent.height, extent.depth, id);
+}
+
+void CudaMemoryManager::read_buffer_strided(int id, const MemoryLayout &src, void *buf,
+        const MemoryLayout &dst, const CopyExtent &extent) {
+    MemoryBuffer &mem_buffer = get_buffer(id);
+    size_t span = layout_span(src, extent);
+    assert(src.offset + span <= mem_buffer.size && "Copy is past the end of the buffer");
+    if (span == 0) return;
+
+    // Read from the device, which has the host writes once they are flushed
+    prepare_device_access(mem_buffer, src.offset, src.offset + span, false);
+
+    CUDA_MEMCPY3D params = strided_params(dst, src, extent);
+    params.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+    params.srcDevice = mem_buffer.d_ptr + src.offset;
+    params.dstMemoryType = CU_MEMORYTYPE_HOST;
+    params.dstHost = (char *) buf + dst.offset;
+
+    size_t bytes = extent.width * extent.height * extent.depth;
+    TransferTimer timer(DEVICE_TO_HOST, bytes);
+    ScopedContext scoped_context(mem_buffer.context);
+    ProfileMark mark = profiler.begin(NULL);
+    copy_strided(params);
+    profiler.end_copy(mark, NULL, PROFILE_DEVICE_TO_HOST, id, bytes);
+    CUDA_LOG_DEBUG("[Memory manager] Copied DtoH %zux%zux%zu box from buffer id %d", extent.width, extent.height, extent.depth, id);
+}
+
+void CudaMemoryManager::copy_buffer(int dst_id, size_t dst_offset, int src_id, size_t src_offset, size_t size) {
+    MemoryBuffer &dst_buffer = get_buffer(dst_id);
+    MemoryBuffer &src_buffer = get_buffer(src_id);
+    assert(dst_offset + size <= dst_buffer.size && "Copy is past the end of the destination buffer");
+    assert(src_offset + size <= src_buffer.size && "Copy is past the end of the source buffer");
+    if (size == 0) return;
+
+    // Neither buffer may move while the copy reads their pointers
+    std::unique_lock<std::recursive_mutex> dst_lock(*dst_buffer.placement_mutex, std::defer_lock);
+    std::unique_lock<std::recursive_mutex> src_lock(*src_buffer.placement_mutex, std::defer_lock);
+    if (dst_id == src_id) dst_lock.lock();
+    else std::lock(dst_lock, src_lock);
+
+    prepare_device_access(src_buffer, src_offset, src_offset + size, false);
+    prepare_device_access(dst_buffer, dst_offset, dst_offset + size, true);
+
+    if (dst_buffer.context != src_buffer.context) {
+        copy_between(dst_id, dst_buffer.context, dst_buffer.d_ptr + dst_offset, src_buffer.context, src_buffer.d_ptr + src_offset, size);
+    } else {
+        TransferTimer timer(DEVICE_TO_DEVICE, size);
+        ScopedContext scoped_context(dst_buffer.context);
+        ProfileMark mark = profiler.begin(NULL);
+        CUDA_SAFE_CALL(cuMemcpyDtoD(dst_buffer.d_ptr + dst_offset, src_buffer.d_ptr + src_offset, size));
+        profiler.end_copy(mark, NULL, PROFILE_DEVICE_TO_DEVICE, dst_id, size);
+    }
+    CUDA_LOG_DEBUG("[Memory manager] Copied DtoD %zu bytes from buffer id %d to buffer id %d", size, src_id, dst_id);
+}
+
+void CudaMemoryManager::copy_buffer_strided(int dst_id, const MemoryLayout &dst, int src_id,
+        const MemoryLayout &src, const CopyExtent &extent) {
+    MemoryBuffer &dst_buffer = get_buffer(dst_id);
+    MemoryBuffer &src_buffer = get_buffer(src_id);
+    assert(dst_buffer.context == src_buffer.context && "Strided copies between devices are not supported");
+    size_t dst_span = layout_span(dst, extent);
+    size_t src_span = layout_span(src, extent);
+    assert(dst.offset + dst_span <= dst_buffer.size && "Copy is past the end of the destination buffer");
+    assert(src.offset + src_span <= src_buffer.size && "Copy is past the end of the source buffer");
+    if (dst_span == 0) return;
+
+    prepare_device_access(src_buffer, src.offset, src.offset + src_span, false);
+    prepare_device_access(dst_buffer, dst.offset, dst.offset + dst_span, true);
+
+    CUDA_MEMCPY3D params = strided_params(dst, src, extent);
+    params.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+    params.srcDevice = src_buffer.d_ptr + src.offset;
+    params.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+    params.dstDevice = dst_buffer.d_ptr + dst.offset;
+
+    size_t bytes = extent.width * extent.height * extent.depth;
+    TransferTimer timer(DEVICE_TO_DEVICE, bytes);
+    ScopedContext scoped_context(dst_buffer.context);
+    ProfileMark mark = profiler.begin(NULL);
+    copy_strided(params);
+    profiler.end_copy(mark, NULL, PROFILE_DEVICE_TO_DEVICE, dst_id, bytes);
+}
+
+void CudaMemoryManager::fill_buffer_d8(int id, size_t offset, uint8_t value, size_t count) {
+    MemoryBuffer &mem_buffer = get_buffer(id);
+    assert(offset + count <= mem_buffer.size && "Fill is past the end of the buffer");
+
+    prepare_device_access(mem_buffer, offset, offset + count, true);
+    ScopedContext scoped_context(mem_buffer.context);
+    CUDA_SAFE_CALL(cuMemsetD8(mem_buffer.d_ptr + offset, value, count));
+}
+
+void CudaMemoryManager::fill_buffer_d32(int id, size_t offset, uint32_t value, size_t count) {
+    MemoryBuffer &mem_buffer = get_buffer(id);
+    assert(offset % 4 == 0 && "32 bit fills have to be 4 byte aligned");
+    assert(offset + count * 4 <= mem_buffer.size && "Fill is past the end of the buffer");
+
+    prepare_device_access(mem_buffer, offset, offset + count * 4, true);
+    ScopedContext scoped_context(mem_buffer.context);
+    CUDA_SAFE_CALL(cuMemsetD32(mem_buffer.d_ptr + offset, value, count));
+}
+
+void CudaMemoryManager::write_shadow(MemoryBuffer &mem_buffer, size_t offset, const void *data, size_t size) {
+    HostShadow &shadow = *mem_buffer.shadow;
+    const char *src = (const char *) data;
+    size_t last = offset + size;
+
+    // Blocks the device has changed are unknown to the host, they are taken as they are
+    std::vector<ByteRange> stale;
+    shadow.device_dirty.intersect(offset, last, &stale);
+    for (const ByteRange &range: stale) {
+        memcpy(&shadow.data[range.begin], src + (range.begin - offset), range.end - range.begin);
+        shadow.host_dirty.add(range.begin, range.end);
+    }
+    shadow.device_dirty.remove(offset, last);
+
+    // The rest is only uploaded where it differs
+    size_t saved = 0;
+    size_t next_stale = 0;
+    for (size_t begin = offset; begin < last; begin += SHADOW_BLOCK_SIZE) {
+        size_t end = std::min(last, begin + SHADOW_BLOCK_SIZE);
+        while (next_stale < stale.size() && stale[next_stale].end <= begin) ++next_stale;
+        if (next_stale < stale.size() && stale[next_stale].begin < end) {
+            // Block overlaps taken bytes, compare it as a whole instead of splitting it
+            memcpy(&shadow.data[begin], src + (begin - offset), end - begin);
+            shadow.host_dirty.add(begin, end);
+            continue;
+        }
+        if (memcmp(&shadow.data[begin], src + (begin - offset), end - begin) == 0) {
+            saved += end - begin;
+            continue;
+        }
+        memcpy(&shadow.data[begin], src + (begin - offset), end - begin);
+        shadow.host_dirty.add(begin, end);
+    }
+    write_bytes_saved += saved;
+}
+
+void CudaMemoryManager::flush_shadow(MemoryBuffer &mem_buffer) {
+    HostShadow &shadow = *mem_buffer.shadow;
+    if (shadow.host_dirty.empty()) return;
+
+    drop_replicas(mem_buffer);
+    for (const ByteRange &range: shadow.host_dirty.get_ranges()) {
+        upload_range(mem_buffer, range.begin, &shadow.data[range.begin], range.end - range.begin);
+    }
+    bytes_uploaded += shadow.host_dirty.bytes();
+    shadow.host_dirty.clear();
+}
+
+void CudaMemoryManager::fetch_shadow(MemoryBuffer &mem_buffer, size_t offset, size_t size) {
+    HostShadow &shadow = *mem_buffer.shadow;
+    std::vector<ByteRange> stale;
+    shadow.device_dirty.intersect(offset, offset + size, &stale);
+
+    size_t downloaded = 0;
+    for (const ByteRange &range: stale) {
+        download_range(mem_buffer, range.begin, &shadow.data[range.begin], range.end - range.begin);
+        downloaded += range.end - range.begin;
+    }
+    shadow.device_dirty.remove(offset, offset + size);
+    bytes_downloaded += downloaded;
+    read_bytes_saved += size - downloaded;
+}
+
+void CudaMemoryManager::set_host_shadow(int id, bool enabled) {
+    MemoryBuffer &mem_buffer = get_buffer(id);
+    if (enabled == (mem_buffer.shadow != nullptr)) return;
+
+    if (enabled) {
+        // Nothing is known about the device contents yet
+        mem_buffer.shadow = std::make_shared<HostShadow>();
+        mem_buffer.shadow->data.resize(mem_buffer.size);
+        mem_buffer.shadow->device_dirty.add(0, mem_buffer.size);
+    } else {
+        flush_shadow(mem_buffer);
+        mem_buffer.shadow.reset();
+    }
+}
+
+void CudaMemoryManager::prepare_for_launch(int id, bool is_in) {
+    MemoryBuffer &mem_buffer = get_buffer(id);
+    if (mem_buffer.shadow == nullptr) return;
+
+    // Output buffers are uploaded too, kernels may leave part of them untouched
+    flush_shadow(mem_buffer);
+    if (!is_in) {
+        mem_buffer.shadow->device_dirty.add(0, mem_buffer.size);
+    }
+}
+
+void CudaMemoryManager::sync_shadow(int id) {
+    MemoryBuffer &mem_buffer = get_buffer(id);
+    assert(mem_buffer.shadow != nullptr && "Buffer has no host shadow");
+    flush_shadow(mem_buffer);
+    mem_buffer.shadow->device_dirty.add(0, mem_buffer.size);
+}
+
+ShadowStats CudaMemoryManager::get_shadow_stats() const {
+    ShadowStats stats;
+    stats.write_bytes_saved = write_bytes_saved;
+    stats.read_bytes_saved = read_bytes_saved;
+    stats.bytes_uploaded = bytes_uploaded;
+    stats.bytes_downloaded = bytes_downloaded;
+    return stats;
+}
+
+CompletionHandlePtr CudaMemoryManager::write_buffer_async(int id, const void *data, size_t size) {
+    MemoryBuffer &mem_buffer = get_buffer(id);
     assert(size <= mem_buffer.size && "Data size is greater than buffer size");
+    drop_replicas(mem_buffer);
+    if (mem_buffer.shadow != nullptr) {
+        // Uploaded right away, so the shadow matches the device once the copy completes
+        memcpy(mem_buffer.shadow->data.data(), data, size);
+        mem_buffer.shadow->host_dirty.remove(0, size);
+        mem_buffer.shadow->device_dirty.remove(0, size);
+        bytes_uploaded += size;
+    }
 
-    printf("[Memory manager] Writing %zu bytes at buffer id %d \n", size, id);
-    printf("[Memory manager] Writing from %p to %p\n", data, (void *)mem_buffer.d_ptr);
-    printf("[Memory manager] Buffer size: %zu, id %d, ptr %p\n", mem_buffer.size, mem_buffer.id, (void *)mem_buffer.d_ptr);
+    ScopedContext scoped_context(mem_buffer.context);
+    CopyStreams *copy = get_copy_streams(mem_buffer.context);
+    CUstream stream = copy->streams.get_stream(0);
 
-    CUDA_SAFE_CALL(cuMemcpyHtoD(mem_buffer.d_ptr, data, size));
-    printf("[Memory manager] Copied HtoD %p to %p\n", data, (void *)mem_buffer.d_ptr);
+    TransferTimer timer(HOST_TO_DEVICE, size);
+    ProfileMark mark = profiler.begin(stream);
+    staging_pool.write_async(mem_buffer.d_ptr, data, size, stream);
+    profiler.end_copy(mark, stream, PROFILE_HOST_TO_DEVICE, id, size);
+    return std::make_shared<CompletionHandle>(mem_buffer.context, stream, copy->streams.get_callback_stream());
 }
 
-void CudaMemoryManager::read_buffer(int id, void *buf, size_t size) {
-    MemoryBuffer mem_buffer = get_buffer(id);
+CompletionHandlePtr CudaMemoryManager::read_buffer_async(int id, void *buf, size_t size) {
+    MemoryBuffer &mem_buffer = get_buffer(id);
     assert(size <= mem_buffer.size && "Read size is greater than buffer size");
 
-    printf("[Memory manager] Copied DtoH %p to %p\n", (void *)mem_buffer.d_ptr, buf);
-    CUDA_SAFE_CALL(cuMemcpyDtoH(buf, mem_buffer.d_ptr, mem_buffer.size));
+    ScopedContext scoped_context(mem_buffer.context);
+    CopyStreams *copy = get_copy_streams(mem_buffer.context);
+    CUstream stream = copy->streams.get_stream(1);
+
+    if (mem_buffer.shadow != nullptr) {
+        // Served from the shadow, which holds host writes not uploaded yet. Ranges kernels may have
+        // written are fetched into it first, synchronously as read_buffer_range does
+        fetch_shadow(mem_buffer, 0, size);
+        memcpy(buf, mem_buffer.shadow->data.data(), size);
+        // The handle completes with whatever the stream already had queued
+        return std::make_shared<CompletionHandle>(mem_buffer.context, stream, copy->streams.get_callback_stream());
+    }
+
+    TransferTimer timer(DEVICE_TO_HOST, size);
+    ProfileMark mark = profiler.begin(stream);
+    staging_pool.read_async(buf, mem_buffer.d_ptr, size, stream);
+    profiler.end_copy(mark, stream, PROFILE_DEVICE_TO_HOST, id, size);
+    return std::make_shared<CompletionHandle>(mem_buffer.context, stream, copy->streams.get_callback_stream());
+}
+
+CopyStreams *CudaMemoryManager::get_copy_streams(CUcontext context) {
+    std::lock_guard<std::mutex> lock(contexts_mutex);
+    std::map<CUcontext, CopyStreams *>::iterator it;
+    it = copy_streams.find(context);
+    if (it != copy_streams.end()) return it->second;
+
+    // One stream per direction so uploads and downloads can overlap
+    ScopedContext scoped_context(context);
+    CopyStreams *copy = new CopyStreams;
+    copy->streams.create(2);
+    CUDA_SAFE_CALL(cuEventCreate(&copy->fence, CU_EVENT_DISABLE_TIMING));
+    copy_streams.emplace(context, copy);
+    return copy;
+}
+
+void CudaMemoryManager::release_resources() {
+    profiler.release_resources();
+
+    // Kernels still held by prepared launches or graphs stay loaded until their context goes away
+    if (reclaim_kernels(true) != 0) {
+        CUDA_LOG_WARN("[Memory manager] Replaced kernel versions are still in use");
+    }
+
+    for (auto &entry: copy_streams) {
+        CUDA_SAFE_CALL(cuCtxSetCurrent(entry.first));
+        CUDA_SAFE_CALL(cuCtxSynchronize());
+        entry.second->streams.destroy();
+        CUDA_SAFE_CALL(cuEventDestroy(entry.second->fence));
+        delete entry.second;
+    }
+    copy_streams.clear();
+
+    staging_pool.destroy();
+
+    for (auto &entry: heaps) {
+        CUDA_SAFE_CALL(cuCtxSetCurrent(entry.first));
+        reclaim_pending_frees(entry.second, true);
+        for (CUevent event: entry.second->spare_events) {
+            CUDA_SAFE_CALL(cuEventDestroy(event));
+        }
+        entry.second->allocator.release_all();
+        delete entry.second;
+    }
+    heaps.clear();
 }
 
 }
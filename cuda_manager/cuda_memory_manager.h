@@ -1,48 +1,376 @@
 #ifndef CUDA_MEMORY_MANAGER_H
 #define CUDA_MEMORY_MANAGER_H
+#include <atomic>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 #include <string.h>
+#include <stdint.h>
 #include <cuda.h>
 #include "cuda_common.h"
+#include "cuda_completion.h"
+#include "cuda_device_allocator.h"
+#include "cuda_host_shadow.h"
+#include "cuda_param_layout.h"
+#include "cuda_occupancy.h"
+#include "cuda_profiler.h"
+#include "handle_table.h"
+#include "cuda_staging_pool.h"
+#include "cuda_stream_pool.h"
 
 
 namespace cuda_manager {
 
 // @TODO Properly handle errors, e.g when buffer doesnt exist
 
+// Where a buffer lives when kernels on other devices use it
+enum PlacementPolicy {
+  FIRST_TOUCH,        // Moves to the device of the first launch using it, then stays and is accessed by peers, or moved if they can't
+  MIGRATE,            // Moves to the device of every launch using it
+  PINNED,             // Never moves, launches on other devices need peer access to its device
+  REPLICATE_READ_ONLY // Other devices get a copy made on first use and dropped on write, a launch writing it moves it as MIGRATE does
+};
+
+// A copy of a buffer on another device than its home
+struct BufferReplica {
+  CUcontext context;
+  CUdeviceptr d_ptr;
+};
+
 struct MemoryBuffer {
   int id;
   size_t size;
   CUdeviceptr d_ptr; // Ptr to device memory
+  CUcontext context; // Context the memory was allocated in, the home of the buffer
+  PlacementPolicy placement;
+  bool touched;      // Used by a launch already
+  std::vector<BufferReplica> replicas;
+  std::shared_ptr<HostShadow> shadow; // Null unless host shadowing is enabled
+  // Guards d_ptr, context, touched and replicas, launches on several devices may resolve the buffer at once
+  std::shared_ptr<std::recursive_mutex> placement_mutex;
+  // Bumped whenever d_ptr, context or replicas change, holders of resolved pointers compare it to know they are stale
+  std::shared_ptr<std::atomic<uint64_t>> placement_generation;
 };
 
+// Where a box of data starts in linear memory and how its rows and slices are laid out
+struct MemoryLayout {
+  size_t offset;       // Bytes to the first row
+  size_t pitch;        // Bytes from one row to the next
+  size_t slice_height; // Rows from one slice to the next, unused when depth is 1
+};
+
+// Size of a box of data
+struct CopyExtent {
+  size_t width;  // In bytes
+  size_t height; // Rows
+  size_t depth;  // Slices, 1 for a 2D copy
+};
+
+struct PlacementStats {
+  size_t migrations;   // Buffers moved to another device
+  size_t replications; // Replicas created
+  size_t peer_copies;  // Copies made with cuMemcpyPeerAsync
+  size_t staged_copies; // Copies made through host memory, between devices without peer access
+  size_t bytes_copied;
+};
+
+// Identifies a loaded module image, modules are per context so the context is part of the key
+struct ModuleKey {
+  CUcontext context;
+  uint64_t digest; // Digest of the module image
+  size_t size;
+  uint32_t variant; // Tells apart different images with the same digest and size, 0 unless they collide
+
+  bool operator<(const ModuleKey &other) const {
+    if (context != other.context) return context < other.context;
+    if (digest != other.digest) return digest < other.digest;
+    if (size != other.size) return size < other.size;
+    return variant < other.variant;
+  }
+};
+
+// A kernel version loaded in another context than the one it was written in
+struct ContextFunction {
+  CUfunction kernel;
+  CUmodule module;
+  ModuleKey module_key;
+};
+
+// A loaded image of a kernel, replaced as a whole when the kernel is written again
+struct KernelVersion {
+  CUfunction kernel;    // In the context the kernel was written in, module_key.context
+  CUmodule module;
+  ModuleKey module_key; // Entry in the module table
+  KernelParamLayout param_layout; // Parsed from the PTX on write, for packed launches
+  std::string function_name;
+  // Loaded on the first launch in each other context, see CudaMemoryManager::get_function
+  mutable std::mutex contexts_mutex;
+  mutable std::vector<ContextFunction> other_contexts;
+};
+
+// Holding one keeps the module loaded, launches hold it until they are queued
+typedef std::shared_ptr<const KernelVersion> KernelVersionPtr;
+
 struct MemoryKernel {
   int id;
   size_t size;
-  CUfunction kernel;
+  KernelVersionPtr version; // Null until written, only accessed with std::atomic_load/atomic_exchange
+};
+
+// A replaced kernel version, unloaded once no launch can still use it
+struct RetiredKernel {
+  KernelVersionPtr version;
+  // One per context the version is loaded in, written context first. Recorded on the NULL stream once
+  // nothing on the host holds the version, empty until then and null once completed
+  std::vector<CUevent> fences;
+};
+
+struct ReloadStats {
+  size_t reloads;          // Kernel versions swapped in while the kernel stayed usable
+  size_t reload_failures;  // Reloads that kept the previous version, see the log for why
+  size_t retired_pending;  // Replaced versions still waiting for their launches to complete
+  size_t retired_unloaded; // Replaced versions reclaimed so far
+};
+
+// A module shared by every kernel id that wrote the same image
+struct LoadedModule {
   CUmodule module;
+  int ref_count;
+  std::string image; // Kept to rule out digest collisions
 };
 
+// Streams used for staged transfers within a context
+struct CopyStreams {
+  CudaStreamPool streams; // Stream 0 copies host to device, stream 1 device to host
+  CUevent fence;          // Recorded on the NULL stream to order copies after work queued on other streams
+};
+
+// Slabs for DeviceAllocator, reserved with cuMemAlloc in the current context
+class CudaSlabBackend : public SlabBackend {
+public:
+  bool allocate_slab(size_t size, uint64_t *address) override;
+  void free_slab(uint64_t address, size_t size) override;
+};
+
+// A freed buffer that may still be in use by queued work, reusable once event completes
+struct PendingFree {
+  CUevent event;
+  uint64_t address;
+};
+
+// Device memory of a single context
+struct DeviceHeap {
+  std::mutex mutex; // Guards everything below
+  CudaSlabBackend backend;
+  DeviceAllocator allocator;
+  std::vector<PendingFree> pending_frees;
+  std::vector<CUevent> spare_events;
+
+  DeviceHeap(): allocator(&backend) {}
+};
+
+/*! \brief Manages device buffers and kernel modules.
+ * Safe to use from several threads at once, every table has its own lock and buffer and kernel
+ * lookups only take a shared lock on one shard. Operating on the same id from several threads
+ * at once (e.g. deallocating a buffer while writing it) is not supported, except for launches:
+ * placement changes made while resolving launch arguments take a per buffer lock.
+ */
 class CudaMemoryManager {
 private:
   // Separating kernels from buffers to allow for overlapping ids
-  std::map<int, MemoryKernel> kernels;
-  std::map<int, MemoryBuffer> buffers;
+  ShardedHandleTable<MemoryKernel> kernels;
+  ShardedHandleTable<MemoryBuffer> buffers;
+  // Refcounted modules, deduplicated by image
+  std::mutex modules_mutex;
+  std::map<ModuleKey, LoadedModule> modules;
+  std::atomic<size_t> module_loads_avoided;
+
+  // Load or share the module of an image, exits on failure unless result is given to report it
+  CUmodule acquire_module(const void *data, size_t size, ModuleKey *key, CUresult *result = nullptr);
+  void release_module(const ModuleKey &key);
+
+  // Load a version of a kernel in the current context, null with the reason logged if it fails
+  KernelVersionPtr load_kernel_version(int id, const char *function_name, const void *data, size_t size);
+  // Swap version in for kernel id, the replaced version is retired
+  void swap_kernel_version(MemoryKernel &mem_kernel, KernelVersionPtr version);
+  void retire_kernel(KernelVersionPtr version);
+
+  std::mutex retired_mutex; // Guards retired_kernels
+  std::vector<RetiredKernel> retired_kernels;
+  std::atomic<size_t> reload_count;
+  std::atomic<size_t> reload_failure_count;
+  std::atomic<size_t> retired_unloaded_count;
+
+  // Page-locked buffers shared by every transfer
+  CudaStagingPool staging_pool;
+
+  // Guards the per context maps below, not what they point to
+  std::mutex contexts_mutex;
+  std::map<CUcontext, CopyStreams *> copy_streams;
+
+  // Copy streams of a context, created on first use
+  CopyStreams *get_copy_streams(CUcontext context);
+
+  // Buffers are sub-allocated from slabs, one heap per context
+  std::map<CUcontext, DeviceHeap *> heaps;
+
+  DeviceHeap *get_heap(CUcontext context);
+  // Hand completed pending frees back to the allocator, or all of them if wait is set, heap must be locked
+  void reclaim_pending_frees(DeviceHeap *heap, bool wait);
+  // Memory from the heap of context, exits if it is exhausted
+  uint64_t allocate_device_memory(CUcontext context, size_t size);
+  // Return memory to the heap of context once the work already queued completes
+  void free_device_memory(CUcontext context, uint64_t address);
+
+  // Whether kernels in context can access memory of peer, peer access is enabled the first time it is asked for
+  std::map<std::pair<CUcontext, CUcontext>, bool> peer_access;
+  bool enable_peer_access(CUcontext context, CUcontext peer);
+  // Synchronous copy of buffer id between contexts, ordered after the work already queued in both.
+  // The placement of buffer id is locked for the copy, callers read dst and src under the same lock
+  void copy_between(int id, CUcontext dst_context, CUdeviceptr dst, CUcontext src_context, CUdeviceptr src, size_t size);
+  void drop_replicas(MemoryBuffer &mem_buffer);
+  // Move the home copy of mem_buffer to context, its placement lock must be held
+  CUdeviceptr migrate_buffer(MemoryBuffer &mem_buffer, CUcontext context);
+  // resolve_buffer with the placement lock held
+  CUdeviceptr place_buffer(MemoryBuffer &mem_buffer, CUcontext context, bool is_in);
+
+  std::atomic<size_t> migration_count;
+  std::atomic<size_t> replication_count;
+  std::atomic<size_t> peer_copy_count;
+  std::atomic<size_t> staged_copy_count;
+  std::atomic<size_t> bytes_copied;
+
+  // Synchronous copies of part of a buffer, ordered after the work already queued in its context
+  void upload_range(const MemoryBuffer &mem_buffer, size_t offset, const void *data, size_t size);
+  void download_range(const MemoryBuffer &mem_buffer, size_t offset, void *buf, size_t size);
+
+  // Upload the bytes the host wrote since the last upload
+  void flush_shadow(MemoryBuffer &mem_buffer);
+  // Download the bytes of [offset, offset + size) kernels may have written since the last download
+  void fetch_shadow(MemoryBuffer &mem_buffer, size_t offset, size_t size);
+  void write_shadow(MemoryBuffer &mem_buffer, size_t offset, const void *data, size_t size);
+  // Bring the device copy up to date before the device reads, or writes [begin, end) of, the buffer
+  void prepare_device_access(MemoryBuffer &mem_buffer, size_t begin, size_t end, bool writes);
+
+  std::atomic<size_t> write_bytes_saved;
+  std::atomic<size_t> read_bytes_saved;
+  std::atomic<size_t> bytes_uploaded;
+  std::atomic<size_t> bytes_downloaded;
 
 public:
-  CudaMemoryManager() {}
+  // Transfers smaller than this skip the staging buffers and are copied directly
+  static const size_t STAGING_THRESHOLD = 256 * 1024;
+  // Written data is compared with the shadow in blocks this large, only differing blocks are uploaded
+  static const size_t SHADOW_BLOCK_SIZE = 4096;
+
+  CudaMemoryManager(): module_loads_avoided(0), reload_count(0), reload_failure_count(0), retired_unloaded_count(0),
+    migration_count(0), replication_count(0), peer_copy_count(0), staged_copy_count(0), bytes_copied(0),
+    write_bytes_saved(0), read_bytes_saved(0), bytes_uploaded(0), bytes_downloaded(0) {}
   ~CudaMemoryManager() {}
 
+  // Timeline of launches and copies, shared with the launch paths, off unless enabled
+  CudaProfiler profiler;
+  // Occupancy data of the loaded kernels, for launches that leave their configuration to the manager
+  LaunchConfigCache launch_configs;
+
+  // Release streams and page-locked memory, has to be called while every context is still alive
+  void release_resources();
+
   void allocate_kernel(int id, size_t size);
   void deallocate_kernel(int id);
+  // Load a kernel image, launches already queued or in progress keep running the previous one
   void write_kernel(int id, const char *function_name, const void *data, size_t size);
-  MemoryKernel get_kernel(int id);
+  MemoryKernel &get_kernel(int id);
+  // Current version of kernel id, null if it was not written
+  KernelVersionPtr get_kernel_version(int id);
+  // Function of version in context, the module is loaded there on first use. Exits if it cannot be loaded
+  CUfunction get_function(const KernelVersion &version, CUcontext context);
+
+  /*! \brief Replace kernel id while it is being launched, as write_kernel does but without the size limit
+   * and without exiting when the image does not load.
+   * \return false if the image could not be loaded, the previous version stays in use
+   */
+  bool reload_kernel(int id, const char *function_name, const void *data, size_t size);
+  /*! \brief Unload replaced versions no launch can use any more. A version is done once no host thread,
+   * prepared launch or graph holds it and the work queued before that point completed.
+   * \param wait block for that work instead of leaving the version for a later call
+   * \return number of versions still waiting
+   */
+  size_t reclaim_kernels(bool wait = false);
+  ReloadStats get_reload_stats();
+  // Number of module loads skipped because an identical image was already loaded
+  size_t get_module_loads_avoided() const { return module_loads_avoided; }
 
   void allocate_buffer(int id, size_t size);
   void deallocate_buffer(int id);
-  MemoryBuffer get_buffer(int id);
+  MemoryBuffer &get_buffer(int id);
+  void set_placement(int id, PlacementPolicy placement);
+
+  /*! \brief Device pointer to use for buffer id from a launch in context, placing the buffer as its policy says.
+   * May move or replicate the buffer, so pointers resolved earlier for other contexts are no longer valid.
+   * \param is_in false if the launch writes the buffer
+   * \param generation if not null, set to the placement generation the pointer belongs to
+   */
+  CUdeviceptr resolve_buffer(int id, CUcontext context, bool is_in, uint64_t *generation = nullptr);
+  PlacementStats get_placement_stats() const;
+
+  /*! \brief Keep a host copy of buffer id and only move the bytes that changed.
+   * Writes update the copy and are uploaded when a launch uses the buffer, skipping blocks
+   * that did not change. Launches mark output buffers as changed on the device, reads only
+   * download changed bytes and serve the rest from the copy.
+   * Only launches made through launch_kernel, launch_kernel_async and packed launches are
+   * tracked, call sync_shadow around prepared launches and graphs.
+   * Disabling uploads the pending writes first.
+   */
+  void set_host_shadow(int id, bool enabled);
+  /*! \brief Make buffer id ready for a launch that reads it, or writes it unless is_in.
+   * Does nothing for buffers without a host shadow.
+   */
+  void prepare_for_launch(int id, bool is_in);
+  // Upload pending writes of buffer id and treat all of it as changed on the device
+  void sync_shadow(int id);
+  ShadowStats get_shadow_stats() const;
+
   void write_buffer(int id, const void *data, size_t size);
   void read_buffer(int id, void *buf, size_t size);
+  // Write or read size bytes at offset of buffer id
+  void write_buffer_range(int id, size_t offset, const void *data, size_t size);
+  void read_buffer_range(int id, size_t offset, void *buf, size_t size);
+
+  /*! \brief Copy a 2D or 3D box between host memory and buffer id, only the box is transferred.
+   * The box is laid out in the buffer as the buffer side layout and in host memory as the host side one,
+   * e.g. a column of tiles can be written from a host image with a different pitch.
+   */
+  void write_buffer_strided(int id, const MemoryLayout &dst, const void *data, const MemoryLayout &src, const CopyExtent &extent);
+  void read_buffer_strided(int id, const MemoryLayout &src, void *buf, const MemoryLayout &dst, const CopyExtent &extent);
+
+  // Copy between buffers without going through the host, peer copies or host staging are used between devices
+  void copy_buffer(int dst_id, size_t dst_offset, int src_id, size_t src_offset, size_t size);
+  // Copy a box between buffers of the same device
+  void copy_buffer_strided(int dst_id, const MemoryLayout &dst, int src_id, const MemoryLayout &src, const CopyExtent &extent);
+
+  // Set count bytes at offset of buffer id to value
+  void fill_buffer_d8(int id, size_t offset, uint8_t value, size_t count);
+  // Set count 32 bit words at offset of buffer id to value, offset has to be 4 byte aligned
+  void fill_buffer_d32(int id, size_t offset, uint32_t value, size_t count);
+
+  // Give cached device memory that no buffer uses back to the driver, \return released bytes
+  size_t trim();
+  AllocatorStats get_allocator_stats(CUcontext context);
+
+  /*! \brief Queue a write through the staging buffers and return without waiting for the copy.
+   * data can be reused once this returns. Not ordered with in-flight launches, wait on their handles first.
+   * \note Returns once every chunk is queued, writes larger than the staging pool block until earlier chunks drain
+   */
+  CompletionHandlePtr write_buffer_async(int id, const void *data, size_t size);
+
+  /*! \brief Queue a read through the staging buffers and return without waiting for the copy.
+   * buf must stay valid until the returned handle completes. Not ordered with in-flight launches.
+   * Shadowed buffers are read from their shadow, downloading the stale ranges before returning.
+   */
+  CompletionHandlePtr read_buffer_async(int id, void *buf, size_t size);
 };
 
 }
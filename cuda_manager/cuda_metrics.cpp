@@ -0,0 +1,267 @@
+#include "cuda_metrics.h"
+#include "cuda_format.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace cuda_manager {
+
+const int LatencyHistogram::BUCKETS;
+
+void LatencyHistogram::record(uint64_t ns) {
+  int bucket = 0;
+  while (bucket < BUCKETS - 1 && (ns >> (bucket + 1)) != 0) ++bucket;
+  ++buckets[bucket];
+  ++count;
+  total_ns += ns;
+  max_ns = std::max(max_ns, ns);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other) {
+  for (int i = 0; i < BUCKETS; ++i) {
+    buckets[i] += other.buckets[i];
+  }
+  count += other.count;
+  total_ns += other.total_ns;
+  max_ns = std::max(max_ns, other.max_ns);
+}
+
+uint64_t LatencyHistogram::quantile_ns(double p) const {
+  if (count == 0) return 0;
+  uint64_t rank = (uint64_t) (p * (count - 1)) + 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < BUCKETS; ++i) {
+    seen += buckets[i];
+    if (seen >= rank) return std::min(max_ns, (uint64_t(2) << i) - 1);
+  }
+  return max_ns;
+}
+
+const char *transfer_direction_name(TransferDirection direction) {
+  switch (direction) {
+    case HOST_TO_DEVICE: return "host_to_device";
+    case DEVICE_TO_HOST: return "device_to_host";
+    case DEVICE_TO_DEVICE: return "device_to_device";
+    case PEER_TO_PEER: return "peer_to_peer";
+    default: return "unknown";
+  }
+}
+
+// Counters of one thread
+struct ThreadMetrics {
+  std::mutex mutex; // Taken by the owning thread to record, and by snapshots to read
+  std::unordered_map<int, KernelMetrics> kernels;
+  TransferMetrics transfers[TRANSFER_DIRECTIONS];
+  LatencyHistogram module_loads;
+};
+
+static void merge_into(MetricsSnapshot &snapshot, const ThreadMetrics &metrics) {
+  for (const auto &entry: metrics.kernels) {
+    KernelMetrics &kernel = snapshot.kernels[entry.first];
+    kernel.launches += entry.second.launches;
+    kernel.launch_latency.merge(entry.second.launch_latency);
+  }
+  for (int i = 0; i < TRANSFER_DIRECTIONS; ++i) {
+    snapshot.transfers[i].count += metrics.transfers[i].count;
+    snapshot.transfers[i].bytes += metrics.transfers[i].bytes;
+    snapshot.transfers[i].total_ns += metrics.transfers[i].total_ns;
+  }
+  snapshot.module_loads.merge(metrics.module_loads);
+}
+
+class MetricsRegistry {
+private:
+  std::mutex mutex; // Guards threads and retired
+  std::vector<ThreadMetrics *> threads;
+  MetricsSnapshot retired; // Totals of exited threads
+
+public:
+  ~MetricsRegistry() {
+    for (ThreadMetrics *metrics: threads) {
+      delete metrics;
+    }
+  }
+
+  ThreadMetrics *add_thread() {
+    std::lock_guard<std::mutex> lock(mutex);
+    threads.push_back(new ThreadMetrics);
+    return threads.back();
+  }
+
+  void retire_thread(ThreadMetrics *metrics) {
+    std::lock_guard<std::mutex> lock(mutex);
+    merge_into(retired, *metrics);
+    threads.erase(std::find(threads.begin(), threads.end(), metrics));
+    delete metrics;
+  }
+
+  MetricsSnapshot collect() {
+    std::lock_guard<std::mutex> lock(mutex);
+    MetricsSnapshot snapshot = retired;
+    for (ThreadMetrics *metrics: threads) {
+      std::lock_guard<std::mutex> thread_lock(metrics->mutex);
+      merge_into(snapshot, *metrics);
+    }
+    return snapshot;
+  }
+
+  void reset() {
+    std::lock_guard<std::mutex> lock(mutex);
+    retired = MetricsSnapshot();
+    for (ThreadMetrics *metrics: threads) {
+      std::lock_guard<std::mutex> thread_lock(metrics->mutex);
+      metrics->kernels.clear();
+      std::fill(metrics->transfers, metrics->transfers + TRANSFER_DIRECTIONS, TransferMetrics());
+      metrics->module_loads = LatencyHistogram();
+    }
+  }
+};
+
+static MetricsRegistry &get_registry() {
+  static MetricsRegistry registry;
+  return registry;
+}
+
+// Block of the calling thread, created on its first record
+struct ThreadMetricsHandle {
+  ThreadMetrics *metrics = nullptr;
+
+  ~ThreadMetricsHandle() {
+    if (metrics != nullptr) get_registry().retire_thread(metrics);
+  }
+};
+
+static thread_local ThreadMetricsHandle thread_metrics;
+
+static ThreadMetrics &get_thread_metrics() {
+  if (thread_metrics.metrics == nullptr) {
+    thread_metrics.metrics = get_registry().add_thread();
+  }
+  return *thread_metrics.metrics;
+}
+
+static std::atomic<bool> enabled(true);
+
+void set_metrics_enabled(bool value) {
+  enabled.store(value, std::memory_order_relaxed);
+}
+
+bool metrics_enabled() {
+  return enabled.load(std::memory_order_relaxed);
+}
+
+void record_launch(int kernel_id, uint64_t ns) {
+  ThreadMetrics &metrics = get_thread_metrics();
+  std::lock_guard<std::mutex> lock(metrics.mutex);
+  KernelMetrics &kernel = metrics.kernels[kernel_id];
+  ++kernel.launches;
+  kernel.launch_latency.record(ns);
+}
+
+void record_transfer(TransferDirection direction, size_t bytes, uint64_t ns) {
+  ThreadMetrics &metrics = get_thread_metrics();
+  std::lock_guard<std::mutex> lock(metrics.mutex);
+  TransferMetrics &transfer = metrics.transfers[direction];
+  ++transfer.count;
+  transfer.bytes += bytes;
+  transfer.total_ns += ns;
+}
+
+void record_module_load(uint64_t ns) {
+  ThreadMetrics &metrics = get_thread_metrics();
+  std::lock_guard<std::mutex> lock(metrics.mutex);
+  metrics.module_loads.record(ns);
+}
+
+MetricsSnapshot collect_metrics() {
+  return get_registry().collect();
+}
+
+void reset_metrics() {
+  get_registry().reset();
+}
+
+static double ms(uint64_t ns) {
+  return ns / 1e6;
+}
+
+std::string MetricsSnapshot::to_text() const {
+  std::string out;
+  append_format(out, "Kernels:\n");
+  for (const auto &entry: kernels) {
+    const LatencyHistogram &latency = entry.second.launch_latency;
+    append_format(out, "  %d: %llu launches, launch latency mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+        entry.first, (unsigned long long) entry.second.launches,
+        latency.count ? latency.total_ns / 1e3 / latency.count : 0.0,
+        latency.quantile_ns(0.5) / 1e3, latency.quantile_ns(0.99) / 1e3, latency.max_ns / 1e3);
+  }
+
+  append_format(out, "Transfers:\n");
+  for (int i = 0; i < TRANSFER_DIRECTIONS; ++i) {
+    const TransferMetrics &transfer = transfers[i];
+    double seconds = transfer.total_ns / 1e9;
+    append_format(out, "  %s: %llu copies, %llu bytes, %.3f ms, %.1f MB/s\n",
+        transfer_direction_name((TransferDirection) i), (unsigned long long) transfer.count,
+        (unsigned long long) transfer.bytes, ms(transfer.total_ns),
+        seconds > 0 ? transfer.bytes / 1e6 / seconds : 0.0);
+  }
+
+  append_format(out, "Devices:\n");
+  for (const DeviceMetrics &device: devices) {
+    append_format(out, "  %d: %zu allocations, %zu deallocations, %zu live bytes, %zu reserved bytes\n",
+        device.device_id, device.allocations, device.deallocations, device.live_bytes, device.reserved_bytes);
+  }
+
+  append_format(out, "Module loads: %llu, %.3f ms total, %.3f ms max\n",
+      (unsigned long long) module_loads.count, ms(module_loads.total_ns), ms(module_loads.max_ns));
+  return out;
+}
+
+static void append_histogram(std::string &out, const LatencyHistogram &histogram) {
+  append_format(out, "{\"count\": %llu, \"total_ns\": %llu, \"max_ns\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, \"buckets\": [",
+      (unsigned long long) histogram.count, (unsigned long long) histogram.total_ns,
+      (unsigned long long) histogram.max_ns, (unsigned long long) histogram.quantile_ns(0.5),
+      (unsigned long long) histogram.quantile_ns(0.99));
+  // Trailing empty buckets are left out
+  int last = LatencyHistogram::BUCKETS - 1;
+  while (last >= 0 && histogram.buckets[last] == 0) --last;
+  for (int i = 0; i <= last; ++i) {
+    append_format(out, i ? ", %llu" : "%llu", (unsigned long long) histogram.buckets[i]);
+  }
+  out += "]}";
+}
+
+std::string MetricsSnapshot::to_json() const {
+  std::string out = "{\"kernels\": {";
+  bool first = true;
+  for (const auto &entry: kernels) {
+    append_format(out, "%s\"%d\": {\"launches\": %llu, \"launch_latency\": ", first ? "" : ", ",
+        entry.first, (unsigned long long) entry.second.launches);
+    append_histogram(out, entry.second.launch_latency);
+    out += "}";
+    first = false;
+  }
+
+  out += "}, \"transfers\": {";
+  for (int i = 0; i < TRANSFER_DIRECTIONS; ++i) {
+    append_format(out, "%s\"%s\": {\"count\": %llu, \"bytes\": %llu, \"total_ns\": %llu}", i ? ", " : "",
+        transfer_direction_name((TransferDirection) i), (unsigned long long) transfers[i].count,
+        (unsigned long long) transfers[i].bytes, (unsigned long long) transfers[i].total_ns);
+  }
+
+  out += "}, \"devices\": [";
+  for (size_t i = 0; i < devices.size(); ++i) {
+    const DeviceMetrics &device = devices[i];
+    append_format(out, "%s{\"device_id\": %d, \"allocations\": %zu, \"deallocations\": %zu, \"live_bytes\": %zu, \"reserved_bytes\": %zu}",
+        i ? ", " : "", device.device_id, device.allocations, device.deallocations, device.live_bytes, device.reserved_bytes);
+  }
+
+  out += "], \"module_loads\": ";
+  append_histogram(out, module_loads);
+  out += "}";
+  return out;
+}
+
+}
@@ -0,0 +1,120 @@
+#ifndef CUDA_METRICS_H
+#define CUDA_METRICS_H
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace cuda_manager {
+
+// Latencies in power of two buckets, bucket i counts samples of [2^i, 2^(i+1)) ns, bucket 0 also counts 0 ns
+struct LatencyHistogram {
+  static const int BUCKETS = 40; // Up to ~18 minutes
+
+  uint64_t buckets[BUCKETS] = {};
+  uint64_t count = 0;
+  uint64_t total_ns = 0;
+  uint64_t max_ns = 0;
+
+  void record(uint64_t ns);
+  void merge(const LatencyHistogram &other);
+  // Upper bound of the bucket holding the p quantile, p in [0, 1]
+  uint64_t quantile_ns(double p) const;
+};
+
+enum TransferDirection {
+  HOST_TO_DEVICE,
+  DEVICE_TO_HOST,
+  DEVICE_TO_DEVICE, // Within a device
+  PEER_TO_PEER,     // Between devices, with peer access or through host staging
+  TRANSFER_DIRECTIONS
+};
+
+// Name of a direction as used in dumps
+const char *transfer_direction_name(TransferDirection direction);
+
+struct TransferMetrics {
+  uint64_t count = 0;
+  uint64_t bytes = 0;
+  uint64_t total_ns = 0; // Host time in the call, enqueue time for asynchronous copies
+};
+
+struct KernelMetrics {
+  uint64_t launches = 0;
+  LatencyHistogram launch_latency; // Host side, from the API call until the launch is queued, graph replays split it across their kernels
+};
+
+struct DeviceMetrics {
+  int device_id;
+  size_t allocations;
+  size_t deallocations;
+  size_t live_bytes;     // Handed out to buffers, rounded to allocator block sizes
+  size_t reserved_bytes; // Held by the allocator
+};
+
+// Totals across every thread at the time of the snapshot
+struct MetricsSnapshot {
+  std::map<int, KernelMetrics> kernels; // By kernel id
+  TransferMetrics transfers[TRANSFER_DIRECTIONS];
+  std::vector<DeviceMetrics> devices;   // Initialized devices only
+  LatencyHistogram module_loads;
+
+  std::string to_text() const;
+  std::string to_json() const;
+};
+
+/*! \brief Process wide metrics, recorded into blocks owned by each thread.
+ * A thread only ever locks its own block, which is uncontended unless a snapshot is being taken,
+ * so recording costs a clock read and an uncontended lock. Blocks of exited threads are folded
+ * into a shared total.
+ */
+void set_metrics_enabled(bool enabled);
+bool metrics_enabled();
+
+inline uint64_t metrics_now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void record_launch(int kernel_id, uint64_t ns);
+void record_transfer(TransferDirection direction, size_t bytes, uint64_t ns);
+void record_module_load(uint64_t ns);
+
+// Records a transfer taking from construction to destruction, nothing is timed while metrics are disabled
+class TransferTimer {
+private:
+  TransferDirection direction;
+  size_t bytes;
+  uint64_t start;
+
+public:
+  TransferTimer(TransferDirection direction, size_t bytes):
+    direction(direction), bytes(bytes), start(metrics_enabled() ? metrics_now() : 0) {}
+  ~TransferTimer() {
+    if (start != 0) record_transfer(direction, bytes, metrics_now() - start);
+  }
+};
+
+// Records a launch of kernel_id taking from construction to destruction
+class LaunchTimer {
+private:
+  int kernel_id;
+  uint64_t start;
+
+public:
+  LaunchTimer(int kernel_id): kernel_id(kernel_id), start(metrics_enabled() ? metrics_now() : 0) {}
+  ~LaunchTimer() {
+    if (start != 0) record_launch(kernel_id, metrics_now() - start);
+  }
+};
+
+// Kernels, transfers and module loads recorded so far, devices are left for the caller to fill
+MetricsSnapshot collect_metrics();
+void reset_metrics();
+
+}
+
+#endif
@@ -0,0 +1,95 @@
+#include "cuda_occupancy.h"
+#include "cuda_format.h"
+#include "cuda_common.h"
+#include "cuda_log.h"
+#include <algorithm>
+
+namespace cuda_manager {
+
+const int LaunchConfigCache::WARP_SIZE;
+
+LaunchConfig LaunchConfigCache::get(CUfunction kernel) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<CUfunction, LaunchConfig>::iterator it = configs.find(kernel);
+    if (it != configs.end()) return it->second;
+  }
+
+  // Computed outside the lock, threads racing on a new kernel get the same result
+  LaunchConfig config;
+  int min_grid_size;
+  CUDA_SAFE_CALL(cuOccupancyMaxPotentialBlockSize(&min_grid_size, &config.block_size, kernel, nullptr, 0, 0));
+  CUDA_SAFE_CALL(cuOccupancyMaxActiveBlocksPerMultiprocessor(&config.blocks_per_sm, kernel, config.block_size, 0));
+
+  int shared_bytes;
+  CUDA_SAFE_CALL(cuFuncGetAttribute(&config.registers, CU_FUNC_ATTRIBUTE_NUM_REGS, kernel));
+  CUDA_SAFE_CALL(cuFuncGetAttribute(&shared_bytes, CU_FUNC_ATTRIBUTE_SHARED_SIZE_BYTES, kernel));
+  CUDA_SAFE_CALL(cuFuncGetAttribute(&config.max_threads_per_block, CU_FUNC_ATTRIBUTE_MAX_THREADS_PER_BLOCK, kernel));
+  config.static_shared_bytes = shared_bytes;
+
+  CUdevice device;
+  CUDA_SAFE_CALL(cuCtxGetDevice(&device));
+  CUDA_SAFE_CALL(cuDeviceGetAttribute(&config.sm_count, CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT, device));
+  CUDA_SAFE_CALL(cuDeviceGetAttribute(&config.max_threads_per_sm, CU_DEVICE_ATTRIBUTE_MAX_THREADS_PER_MULTIPROCESSOR, device));
+
+  CUDA_LOG_DEBUG("[Occupancy] Kernel %p: block size %d, %d blocks per SM, %d registers, %zu bytes shared",
+      kernel, config.block_size, config.blocks_per_sm, config.registers, config.static_shared_bytes);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  configs[kernel] = config;
+  return config;
+}
+
+void LaunchConfigCache::forget(CUfunction kernel) {
+  std::lock_guard<std::mutex> lock(mutex);
+  configs.erase(kernel);
+}
+
+void LaunchConfigCache::suggest(const LaunchConfig &config, size_t element_count, uint64_t *grid_size, uint32_t *block_size) {
+  uint64_t block = config.block_size;
+
+  // Too few elements to give every SM a full block
+  uint64_t per_sm = (element_count + config.sm_count - 1) / config.sm_count;
+  if (per_sm < block) {
+    block = std::min(block, std::max<uint64_t>(WARP_SIZE, (per_sm + WARP_SIZE - 1) / WARP_SIZE * WARP_SIZE));
+  }
+
+  *block_size = (uint32_t) block;
+  *grid_size = (element_count + block - 1) / block;
+}
+
+OccupancyEstimate LaunchConfigCache::estimate(CUfunction kernel, const LaunchConfig &config, uint64_t grid_size, uint32_t block_size) {
+  OccupancyEstimate estimate = {grid_size, block_size, 0, 0.0, 0.0, 0.0, 0.0};
+  if (block_size == 0 || block_size > (uint32_t) config.max_threads_per_block) return estimate;
+
+  CUDA_SAFE_CALL(cuOccupancyMaxActiveBlocksPerMultiprocessor(&estimate.blocks_per_sm, kernel, block_size, 0));
+
+  // SMs schedule whole warps, a partial warp takes the room of a full one
+  uint64_t warps_per_block = (block_size + WARP_SIZE - 1) / WARP_SIZE;
+  estimate.occupancy = (double) (estimate.blocks_per_sm * warps_per_block) / (config.max_threads_per_sm / WARP_SIZE);
+
+  uint64_t capacity = (uint64_t) estimate.blocks_per_sm * config.sm_count;
+  if (capacity == 0) return estimate;
+  estimate.waves = (double) grid_size / capacity;
+  estimate.sm_utilization = (double) std::min<uint64_t>(grid_size, config.sm_count) / config.sm_count;
+  uint64_t last_wave = grid_size % capacity;
+  estimate.tail_efficiency = last_wave == 0 ? 1.0 : (double) last_wave / capacity;
+  return estimate;
+}
+
+static void append_estimate(std::string &out, const char *name, const OccupancyEstimate &estimate) {
+  append_format(out, "  %s: %llu blocks of %u threads, %d blocks per SM, occupancy %.0f%%, %.2f waves, %.0f%% of SMs busy, last wave %.0f%% full\n",
+      name, (unsigned long long) estimate.grid_size, estimate.block_size, estimate.blocks_per_sm,
+      estimate.occupancy * 100, estimate.waves, estimate.sm_utilization * 100, estimate.tail_efficiency * 100);
+}
+
+std::string OccupancyReport::to_text() const {
+  std::string out;
+  append_format(out, "Device %d: %d SMs, kernel uses %d registers per thread and %zu bytes of static shared memory per block\n",
+      device_id, config.sm_count, config.registers, config.static_shared_bytes);
+  append_estimate(out, "chosen", chosen);
+  append_estimate(out, "suggested", suggested);
+  return out;
+}
+
+}
@@ -0,0 +1,81 @@
+#ifndef CUDA_OCCUPANCY_H
+#define CUDA_OCCUPANCY_H
+
+#include <cuda.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace cuda_manager {
+
+// Occupancy data of a kernel on the device of its context
+struct LaunchConfig {
+  int block_size;             // Threads per block reaching the highest occupancy, from cuOccupancyMaxPotentialBlockSize
+  int blocks_per_sm;          // Blocks of block_size resident on an SM at once
+  int registers;              // Per thread
+  size_t static_shared_bytes; // Per block
+  int max_threads_per_block;  // Of the kernel, lower than the device's when registers run out
+  int sm_count;
+  int max_threads_per_sm;
+};
+
+// How a grid of grid_size blocks of block_size threads fills the device
+struct OccupancyEstimate {
+  uint64_t grid_size;    // Blocks
+  uint32_t block_size;   // Threads per block
+  int blocks_per_sm;     // Resident at once, 0 if the block cannot run at all
+  double occupancy;      // Resident warps per SM over the most an SM holds
+  double waves;          // Grid size over the blocks the device holds at once
+  double sm_utilization; // Share of the SMs given work in the first wave
+  double tail_efficiency; // Share of the last wave's block slots in use, 1 for whole waves
+};
+
+/*! \brief Theoretical occupancy of a launch as configured by the caller and as configured automatically
+ * for the same number of threads. Theoretical occupancy is an upper bound, the achieved one also
+ * depends on how long blocks run and what they wait on.
+ */
+struct OccupancyReport {
+  int device_id;
+  LaunchConfig config;
+  OccupancyEstimate chosen;
+  OccupancyEstimate suggested;
+
+  std::string to_text() const;
+};
+
+/*! \brief Occupancy data per kernel, queried from the driver on the first launch that needs it.
+ * Function handles belong to one context and so to one device, the handle is the whole key.
+ * Entries are dropped when the module of the kernel is unloaded, as its handle may be reused.
+ */
+class LaunchConfigCache {
+private:
+  std::mutex mutex; // Guards configs
+  std::map<CUfunction, LaunchConfig> configs;
+
+public:
+  static const int WARP_SIZE = 32;
+
+  LaunchConfigCache() {}
+  ~LaunchConfigCache() {}
+
+  LaunchConfigCache(const LaunchConfigCache &) = delete;
+  LaunchConfigCache &operator=(const LaunchConfigCache &) = delete;
+
+  // Occupancy data of kernel, its context must be current
+  LaunchConfig get(CUfunction kernel);
+  void forget(CUfunction kernel);
+
+  /*! \brief Block and grid size running element_count threads, one per element.
+   * Blocks get the size of highest occupancy, unless that leaves SMs without work: small launches
+   * get smaller blocks, down to a warp, so every SM gets one.
+   */
+  static void suggest(const LaunchConfig &config, size_t element_count, uint64_t *grid_size, uint32_t *block_size);
+  // Occupancy of a launch of kernel, its context must be current
+  static OccupancyEstimate estimate(CUfunction kernel, const LaunchConfig &config, uint64_t grid_size, uint32_t block_size);
+};
+
+}
+
+#endif
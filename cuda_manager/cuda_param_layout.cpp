@@ -0,0 +1,160 @@
+#include "cuda_param_layout.h"
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+namespace cuda_manager {
+
+// Cursor over a PTX image, ptx may not be null terminated
+struct PtxReader {
+  const char *current;
+  const char *end;
+
+  void skip_space() {
+    while (current < end) {
+      if (isspace((unsigned char) *current)) {
+        ++current;
+      } else if (end - current >= 2 && current[0] == '/' && current[1] == '/') {
+        while (current < end && *current != '\n') ++current;
+      } else if (end - current >= 2 && current[0] == '/' && current[1] == '*') {
+        current += 2;
+        while (end - current >= 2 && !(current[0] == '*' && current[1] == '/')) ++current;
+        current = end - current >= 2 ? current + 2 : end;
+      } else {
+        break;
+      }
+    }
+  }
+
+  // Next identifier or directive (e.g. ".param", "_Z5saxpyf"), empty on punctuation
+  size_t token(const char **start) {
+    skip_space();
+    *start = current;
+    while (current < end && (isalnum((unsigned char) *current) || *current == '_' || *current == '.' || *current == '$')) {
+      ++current;
+    }
+    return current - *start;
+  }
+
+  bool accept(char c) {
+    skip_space();
+    if (current < end && *current == c) {
+      ++current;
+      return true;
+    }
+    return false;
+  }
+
+  bool number(size_t *value) {
+    skip_space();
+    if (current == end || !isdigit((unsigned char) *current)) return false;
+    *value = 0;
+    while (current < end && isdigit((unsigned char) *current)) {
+      *value = *value * 10 + (*current - '0');
+      ++current;
+    }
+    return true;
+  }
+};
+
+static bool token_equals(const char *token, size_t length, const char *expected) {
+  return length == strlen(expected) && memcmp(token, expected, length) == 0;
+}
+
+// Size of a PTX fundamental type such as .u32 or .f64, 0 if token is not one
+static size_t type_size(const char *token, size_t length) {
+  if (length < 3 || token[0] != '.') return 0;
+  if (token_equals(token, length, ".pred")) return 4; // Predicates are passed as 32 bit values
+  if (strchr("usbf", token[1]) == nullptr) return 0;
+  size_t bits = 0;
+  for (size_t i = 2; i < length; ++i) {
+    if (!isdigit((unsigned char) token[i])) return 0;
+    bits = bits * 10 + (token[i] - '0');
+  }
+  return bits == 8 || bits == 16 || bits == 32 || bits == 64 ? bits / 8 : 0;
+}
+
+// Parse one ".param [.align N] .type [.ptr ...] name[[N]]" declaration
+static bool parse_param(PtxReader &reader, KernelParam *param) {
+  const char *token;
+  size_t length = reader.token(&token);
+  if (!token_equals(token, length, ".param")) return false;
+
+  size_t align = 0;
+  size_t element_size = 0;
+  bool is_pointer = false;
+  for (;;) {
+    length = reader.token(&token);
+    if (length == 0) return false;
+    if (token_equals(token, length, ".align")) {
+      // After .ptr the alignment is of the pointed memory, not of the parameter
+      size_t value;
+      if (!reader.number(&value)) return false;
+      if (!is_pointer) align = value;
+    } else if (token_equals(token, length, ".ptr")) {
+      is_pointer = true;
+    } else if (element_size == 0 && type_size(token, length) != 0) {
+      element_size = type_size(token, length);
+    } else if (token[0] != '.') {
+      break; // The parameter name, attributes such as .ptr .global are skipped above
+    }
+  }
+  if (element_size == 0) return false;
+
+  size_t count = 1;
+  if (reader.accept('[')) {
+    if (!reader.number(&count) || !reader.accept(']')) return false;
+  }
+
+  param->size = element_size * count;
+  param->align = align != 0 ? align : element_size;
+  return true;
+}
+
+bool parse_param_layout(const char *ptx, size_t size, const char *function_name, KernelParamLayout *layout) {
+  layout->valid = false;
+  layout->params.clear();
+  layout->size = 0;
+
+  // Text images may carry their null terminator in size
+  const char *end = (const char *) memchr(ptx, '\0', size);
+  PtxReader reader = { ptx, end != nullptr ? end : ptx + size };
+
+  // Find ".entry <function_name>", other .entry directives are skipped
+  const char *token;
+  size_t length;
+  for (;;) {
+    reader.skip_space();
+    if (reader.current == reader.end) return false;
+
+    length = reader.token(&token);
+    if (length == 0) {
+      ++reader.current; // Punctuation
+      continue;
+    }
+    if (!token_equals(token, length, ".entry")) continue;
+
+    length = reader.token(&token);
+    if (token_equals(token, length, function_name)) break;
+  }
+
+  if (reader.accept('(')) {
+    if (!reader.accept(')')) {
+      do {
+        KernelParam param;
+        if (!parse_param(reader, &param)) return false;
+
+        param.offset = (layout->size + param.align - 1) / param.align * param.align;
+        layout->size = param.offset + param.size;
+        layout->params.push_back(param);
+      } while (reader.accept(','));
+
+      if (!reader.accept(')')) return false;
+    }
+  }
+
+  layout->valid = true;
+  return true;
+}
+
+}
@@ -0,0 +1,33 @@
+#ifndef CUDA_PARAM_LAYOUT_H
+#define CUDA_PARAM_LAYOUT_H
+
+#include <vector>
+#include <stddef.h>
+
+namespace cuda_manager {
+
+// A kernel parameter within the packed parameter buffer
+struct KernelParam {
+  size_t offset;
+  size_t size;
+  size_t align;
+};
+
+/*! \brief Layout of the parameters of a kernel, as passed through CU_LAUNCH_PARAM_BUFFER_POINTER.
+ * Every parameter sits at the next offset aligned to its own alignment, as the PTX ABI lays them out.
+ */
+struct KernelParamLayout {
+  bool valid = false; // Set when the layout was found, images that are not PTX text have none
+  std::vector<KernelParam> params;
+  size_t size = 0;    // Size of the packed buffer
+};
+
+/*! \brief Find the .entry of function_name in a PTX image and compute its parameter layout.
+ * Handles scalar parameters (.u32, .f64, .pred, ...), pointer attributes and .align'd byte arrays.
+ * \return false if the image is not PTX or has no such entry
+ */
+bool parse_param_layout(const char *ptx, size_t size, const char *function_name, KernelParamLayout *layout);
+
+}
+
+#endif
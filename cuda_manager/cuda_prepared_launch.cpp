@@ -0,0 +1,158 @@
+#include "cuda_prepared_launch.h"
+#include "cuda_common.h"
+#include "cuda_log.h"
+#include "cuda_metrics.h"
+#include "kernel_arguments.h"
+#include <assert.h>
+#include <string.h>
+#include <vector>
+
+namespace cuda_manager {
+
+PreparedLaunch::PreparedLaunch(CudaManager &cuda_manager, int kernel_id, KernelVersionPtr version, const CudaResourceArgs &r_args,
+    const char *args, int arg_count):
+  cuda_manager(&cuda_manager), memory_manager(&cuda_manager.memory_manager), kernel_id(kernel_id), version(version), r_args(r_args), arg_count(arg_count),
+  values(arg_count), kernel_args(arg_count), buffer_ids(arg_count, -1), buffer_generations(arg_count),
+  resolved_generations(arg_count), buffer_is_in(arg_count) {
+
+  context = cuda_manager.get_context(r_args.device_id);
+  kernel = cuda_manager.memory_manager.get_function(*version, context);
+  stream = cuda_manager.stream_pools[r_args.device_id].next_stream();
+
+  ScopedContext scoped_context(context);
+  CUDA_SAFE_CALL(cuEventCreate(&completion, CU_EVENT_DISABLE_TIMING));
+  if (r_args.auto_config()) cuda_manager.configure_launch(kernel, this->r_args);
+
+  const char *current_arg = args;
+  for (int i = 0; i < arg_count; ++i) {
+    Arg *base = (Arg *) current_arg;
+
+    switch (base->type) {
+      case BUFFER:
+      {
+        BufferArg *arg = (BufferArg *) base;
+        current_arg += sizeof(BufferArg);
+        set_buffer(i, arg->id, arg->is_in);
+        break;
+      }
+      case SCALAR:
+      {
+        ScalarArg *arg = (ScalarArg *) base;
+        current_arg += sizeof(ScalarArg);
+        set_scalar(i, arg->ptr);
+        break;
+      }
+      case VALUE:
+      {
+        ValueArg *arg = (ValueArg *) base;
+        current_arg += sizeof(ValueArg);
+        set_value(i, &arg->value, arg->size);
+        break;
+      }
+    }
+  }
+}
+
+PreparedLaunch::~PreparedLaunch() {
+  CUDA_SAFE_CALL(cuEventDestroy(completion));
+}
+
+void PreparedLaunch::set_scalar(int index, void *ptr) {
+  assert(index < arg_count && "Argument index out of range");
+  kernel_args[index] = ptr;
+  buffer_ids[index] = -1;
+  buffer_generations[index] = nullptr;
+}
+
+bool PreparedLaunch::can_prepare(const char *args, int arg_count) {
+  const char *current_arg = args;
+  for (int i = 0; i < arg_count; ++i) {
+    switch (((Arg *) current_arg)->type) {
+      case BUFFER: current_arg += sizeof(BufferArg); break;
+      case SCALAR: current_arg += sizeof(ScalarArg); break;
+      case VALUE:
+        if (((ValueArg *) current_arg)->size > sizeof(uint64_t)) return false;
+        current_arg += sizeof(ValueArg);
+        break;
+    }
+  }
+  return true;
+}
+
+void PreparedLaunch::set_value(int index, const void *value, size_t size) {
+  assert(index < arg_count && "Argument index out of range");
+  if (size > sizeof(values[index])) {
+    CUDA_LOG_ERROR("[Prepared launch] Value of %zu bytes for argument %d does not fit inline", size, index);
+    log_flush();
+    exit(1);
+  }
+  memcpy(&values[index], value, size);
+  kernel_args[index] = &values[index];
+  buffer_ids[index] = -1;
+  buffer_generations[index] = nullptr;
+}
+
+void PreparedLaunch::set_buffer(int index, int buffer_id, bool is_in) {
+  assert(index < arg_count && "Argument index out of range");
+  values[index] = memory_manager->resolve_buffer(buffer_id, context, is_in, &resolved_generations[index]);
+  kernel_args[index] = &values[index];
+  buffer_ids[index] = buffer_id;
+  buffer_generations[index] = memory_manager->get_buffer(buffer_id).placement_generation;
+  buffer_is_in[index] = is_in;
+}
+
+void PreparedLaunch::set_resources(const CudaResourceArgs &r_args) {
+  assert(r_args.device_id == this->r_args.device_id && "A prepared launch cannot change device");
+  this->r_args = r_args;
+  if (r_args.auto_config()) {
+    ScopedContext scoped_context(context);
+    cuda_manager->configure_launch(kernel, this->r_args);
+  }
+}
+
+void PreparedLaunch::launch() {
+  LaunchTimer timer(kernel_id);
+  CUcontext current;
+  CUDA_SAFE_CALL(cuCtxGetCurrent(&current));
+  if (current != context) {
+    CUDA_SAFE_CALL(cuCtxSetCurrent(context));
+  }
+
+  // Another launch moved a buffer or changed its replicas, the pointer resolved before may be freed
+  for (int i = 0; i < arg_count; ++i) {
+    if (buffer_generations[i] != nullptr && *buffer_generations[i] != resolved_generations[i]) {
+      values[i] = memory_manager->resolve_buffer(buffer_ids[i], context, buffer_is_in[i], &resolved_generations[i]);
+    }
+  }
+
+  CudaProfiler &profiler = memory_manager->profiler;
+  ProfileMark mark = profiler.begin(stream);
+  CUDA_SAFE_CALL(
+      cuLaunchKernel(kernel,
+        r_args.grid_dim.x , r_args.grid_dim.y , r_args.grid_dim.z , // grid dim
+        r_args.block_dim.x, r_args.block_dim.y, r_args.block_dim.z, // block dim
+        0, stream, // shared mem, stream
+        kernel_args.data(), 0) // args, extras
+      );
+  if (mark.active()) {
+    std::vector<int> launch_buffer_ids;
+    for (int i = 0; i < arg_count; ++i) {
+      if (buffer_ids[i] >= 0) launch_buffer_ids.push_back(buffer_ids[i]);
+    }
+    profiler.end_launch(mark, stream, kernel, launch_buffer_ids);
+  }
+  CUDA_SAFE_CALL(cuEventRecord(completion, stream));
+}
+
+void PreparedLaunch::wait() {
+  CUDA_SAFE_CALL(cuEventSynchronize(completion));
+}
+
+bool PreparedLaunch::poll() {
+  CUresult result = cuEventQuery(completion);
+  if (result == CUDA_ERROR_NOT_READY) return false;
+  CUDA_SAFE_CALL(result);
+  return true;
+}
+
+}
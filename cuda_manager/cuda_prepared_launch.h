@@ -0,0 +1,80 @@
+#ifndef CUDA_PREPARED_LAUNCH_H
+#define CUDA_PREPARED_LAUNCH_H
+
+#include "cuda_manager.h"
+#include <cuda.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+
+namespace cuda_manager {
+
+/*! \brief A kernel launch with its arguments resolved once, for launching the same kernel repeatedly.
+ * Buffer ids are resolved to device pointers held in inline storage, as are value args. The stream and completion event
+ * are picked once, so launch() does not parse arguments, look anything up or allocate.
+ * Scalars still point to caller memory and are read on every launch, so changing the pointed value
+ * is enough to relaunch with a new value.
+ * Each buffer arg remembers the placement generation its pointer was resolved at, launch() resolves
+ * again only the buffers that moved or gained or lost replicas since. Deallocated buffers have to be
+ * rebound and host shadow writes synced (see CudaApi::prepare_launch).
+ * \note A prepared launch must not be launched from several threads at once
+ */
+class PreparedLaunch {
+private:
+  CudaManager *cuda_manager;
+  CudaMemoryManager *memory_manager;
+  int kernel_id; // Launches are recorded in the metrics of the kernel id the version was taken from
+  KernelVersionPtr version; // Kept loaded, a prepared launch keeps running the version it was made with
+  CUfunction kernel;
+  CudaResourceArgs r_args;
+  CUcontext context;
+  CUstream stream;
+  CUevent completion;
+
+  int arg_count;
+  // Sized once from arg_count, launch() does not allocate
+  std::vector<uint64_t> values; // Buffer device pointers and value args, kernel_args points here
+  std::vector<void *> kernel_args;
+  std::vector<int> buffer_ids; // Buffer bound to each arg, -1 for other args
+  // Placement generation of each bound buffer and the one its pointer in values was resolved at, null for other args
+  std::vector<std::shared_ptr<const std::atomic<uint64_t>>> buffer_generations;
+  std::vector<uint64_t> resolved_generations;
+  std::vector<char> buffer_is_in;
+
+public:
+  /*! \brief Resolve a launch, arguments use the same layout as CudaManager::launch_kernel.
+   * args is no longer needed once this returns, the scalars it points to are.
+   */
+  PreparedLaunch(CudaManager &cuda_manager, int kernel_id, KernelVersionPtr version, const CudaResourceArgs &r_args,
+      const char *args, int arg_count);
+  ~PreparedLaunch();
+
+  PreparedLaunch(const PreparedLaunch &) = delete;
+  PreparedLaunch &operator=(const PreparedLaunch &) = delete;
+
+  // Point scalar arg index to another value
+  void set_scalar(int index, void *ptr);
+  // Whether every value arg of args fits the inline storage of 8 bytes
+  static bool can_prepare(const char *args, int arg_count);
+
+  // Store a value of up to 8 bytes inline for arg index, exits for larger values
+  void set_value(int index, const void *value, size_t size);
+  // Bind buffer arg index to another buffer, placed on the launch device
+  void set_buffer(int index, int buffer_id, bool is_in = false);
+  // Automatic configurations are resolved here, not on every launch
+  void set_resources(const CudaResourceArgs &r_args);
+
+  // Queue the kernel, launches are ordered with each other as they share a stream
+  void launch();
+  // Block until the last launch completes
+  void wait();
+  // \return true if the last launch completed, does not block
+  bool poll();
+};
+
+typedef std::unique_ptr<PreparedLaunch> PreparedLaunchPtr;
+
+}
+
+#endif
@@ -0,0 +1,262 @@
+#include "cuda_profiler.h"
+#include "cuda_common.h"
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+
+namespace cuda_manager {
+
+const size_t CudaProfiler::RESOLVE_BATCH;
+
+static double host_now_us() {
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+CudaProfiler::ContextState *CudaProfiler::get_state(CUcontext context) {
+  std::map<CUcontext, ContextState *>::iterator it = contexts.find(context);
+  if (it != contexts.end()) return it->second;
+
+  // Called with context current, the epoch is the only time the profiler waits on the GPU
+  ContextState *state = new ContextState;
+  CUDA_SAFE_CALL(cuCtxGetDevice(&state->device));
+  CUDA_SAFE_CALL(cuEventCreate(&state->epoch, CU_EVENT_DEFAULT));
+  CUDA_SAFE_CALL(cuEventRecord(state->epoch, NULL));
+  CUDA_SAFE_CALL(cuEventSynchronize(state->epoch));
+  state->epoch_us = host_now_us();
+
+  contexts.emplace(context, state);
+  return state;
+}
+
+CUevent CudaProfiler::acquire_event(ContextState *state) {
+  if (state->spare_events.empty()) {
+    CUevent event;
+    CUDA_SAFE_CALL(cuEventCreate(&event, CU_EVENT_DEFAULT));
+    return event;
+  }
+  CUevent event = state->spare_events.back();
+  state->spare_events.pop_back();
+  return event;
+}
+
+void CudaProfiler::set_function_name(CUfunction function, const std::string &name) {
+  std::lock_guard<std::mutex> lock(mutex);
+  function_names[function] = name;
+}
+
+ProfileMark CudaProfiler::begin(CUstream stream) {
+  ProfileMark mark;
+  if (!is_enabled()) return mark;
+
+  CUcontext context;
+  CUDA_SAFE_CALL(cuCtxGetCurrent(&context));
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    mark.start = acquire_event(get_state(context));
+  }
+  CUDA_SAFE_CALL(cuEventRecord(mark.start, stream));
+  return mark;
+}
+
+void CudaProfiler::finish(ProfileMark &mark, CUstream stream, ProfileRecord &record) {
+  CUcontext context;
+  CUDA_SAFE_CALL(cuCtxGetCurrent(&context));
+
+  std::lock_guard<std::mutex> lock(mutex);
+  PendingRecord pending_record;
+  pending_record.state = get_state(context);
+  pending_record.start = mark.start;
+  pending_record.end = acquire_event(pending_record.state);
+  CUDA_SAFE_CALL(cuEventRecord(pending_record.end, stream));
+  mark.start = nullptr;
+
+  std::map<CUstream, int> &streams = pending_record.state->streams;
+  record.device = pending_record.state->device;
+  record.stream = stream;
+  record.stream_index = streams.emplace(stream, (int) streams.size()).first->second;
+  pending_record.record = std::move(record);
+  pending.push_back(std::move(pending_record));
+
+  if (pending.size() >= RESOLVE_BATCH) resolve_locked(false);
+}
+
+void CudaProfiler::end_launch(ProfileMark &mark, CUstream stream, CUfunction function, const std::vector<int> &buffer_ids) {
+  if (!mark.active()) return;
+
+  ProfileRecord record;
+  record.kind = PROFILE_KERNEL;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<CUfunction, std::string>::iterator it = function_names.find(function);
+    record.name = it != function_names.end() ? it->second : "kernel";
+  }
+  record.bytes = 0;
+  record.buffer_ids = buffer_ids;
+  finish(mark, stream, record);
+}
+
+void CudaProfiler::end_graph(ProfileMark &mark, CUstream stream, int node_count) {
+  if (!mark.active()) return;
+
+  ProfileRecord record;
+  record.kind = PROFILE_GRAPH;
+  record.name = "graph (" + std::to_string(node_count) + " nodes)";
+  record.bytes = 0;
+  finish(mark, stream, record);
+}
+
+void CudaProfiler::end_copy(ProfileMark &mark, CUstream stream, ProfileKind kind, int buffer_id, size_t bytes) {
+  if (!mark.active()) return;
+
+  static const char *names[] = {"", "", "HtoD", "DtoH", "DtoD", "Peer"};
+  ProfileRecord record;
+  record.kind = kind;
+  record.name = names[kind];
+  record.bytes = bytes;
+  record.buffer_ids.push_back(buffer_id);
+  finish(mark, stream, record);
+}
+
+void CudaProfiler::resolve_locked(bool wait) {
+  size_t kept = 0;
+  for (size_t i = 0; i < pending.size(); ++i) {
+    PendingRecord &pending_record = pending[i];
+    if (wait) {
+      CUDA_SAFE_CALL(cuEventSynchronize(pending_record.end));
+    } else {
+      CUresult result = cuEventQuery(pending_record.end);
+      if (result == CUDA_ERROR_NOT_READY) {
+        if (kept != i) pending[kept] = std::move(pending_record);
+        ++kept;
+        continue;
+      }
+      CUDA_SAFE_CALL(result);
+    }
+
+    ContextState *state = pending_record.state;
+    float since_epoch_ms, duration_ms;
+    CUDA_SAFE_CALL(cuEventElapsedTime(&since_epoch_ms, state->epoch, pending_record.start));
+    CUDA_SAFE_CALL(cuEventElapsedTime(&duration_ms, pending_record.start, pending_record.end));
+    pending_record.record.start_us = state->epoch_us + since_epoch_ms * 1000.0;
+    pending_record.record.duration_us = duration_ms * 1000.0;
+
+    state->spare_events.push_back(pending_record.start);
+    if (since_epoch_ms + duration_ms > 0) {
+      // Elapsed times are float milliseconds, measured from far away they lose microseconds.
+      // The completed end becomes the epoch, so the next records are measured from close by
+      state->spare_events.push_back(state->epoch);
+      state->epoch = pending_record.end;
+      state->epoch_us = pending_record.record.start_us + pending_record.record.duration_us;
+    } else {
+      state->spare_events.push_back(pending_record.end);
+    }
+    resolved.push_back(std::move(pending_record.record));
+  }
+  pending.resize(kept);
+}
+
+std::vector<ProfileRecord> CudaProfiler::get_records() {
+  std::lock_guard<std::mutex> lock(mutex);
+  resolve_locked(true);
+  std::vector<ProfileRecord> records = resolved;
+  std::stable_sort(records.begin(), records.end(),
+      [](const ProfileRecord &a, const ProfileRecord &b) { return a.start_us < b.start_us; });
+  return records;
+}
+
+static void append_json_string(std::string &out, const std::string &value) {
+  out += '"';
+  for (char c: value) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if ((unsigned char) c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out += escaped;
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+}
+
+std::string CudaProfiler::to_chrome_trace() {
+  std::vector<ProfileRecord> records = get_records();
+  std::string out = "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+  char field[256];
+  bool first = true;
+
+  // Name the devices and their streams
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &entry: contexts) {
+      const ContextState &state = *entry.second;
+      snprintf(field, sizeof(field), "%s{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"GPU %d\"}}",
+          first ? "" : ", ", state.device, state.device);
+      out += field;
+      first = false;
+      for (const auto &stream: state.streams) {
+        if (stream.first == NULL) {
+          snprintf(field, sizeof(field), ", {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"default stream\"}}",
+              state.device, stream.second);
+        } else {
+          snprintf(field, sizeof(field), ", {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"stream %d (%p)\"}}",
+              state.device, stream.second, stream.second, (void *) stream.first);
+        }
+        out += field;
+      }
+    }
+  }
+
+  for (const ProfileRecord &record: records) {
+    out += first ? "{\"name\": " : ", {\"name\": ";
+    first = false;
+    append_json_string(out, record.name);
+    const char *category = record.kind == PROFILE_KERNEL ? "kernel" : record.kind == PROFILE_GRAPH ? "graph" : "copy";
+    snprintf(field, sizeof(field), ", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d, \"args\": {",
+        category, record.start_us, record.duration_us, record.device, record.stream_index);
+    out += field;
+
+    out += "\"buffer_ids\": [";
+    for (size_t i = 0; i < record.buffer_ids.size(); ++i) {
+      out += (i ? ", " : "") + std::to_string(record.buffer_ids[i]);
+    }
+    out += "]";
+    if (record.bytes != 0) out += ", \"bytes\": " + std::to_string(record.bytes);
+    out += "}}";
+  }
+
+  out += "]}";
+  return out;
+}
+
+bool CudaProfiler::write_chrome_trace(const char *path) {
+  std::string trace = to_chrome_trace();
+  FILE *file = fopen(path, "w");
+  if (file == nullptr) return false;
+  bool written = fwrite(trace.data(), 1, trace.size(), file) == trace.size();
+  return fclose(file) == 0 && written;
+}
+
+void CudaProfiler::clear() {
+  std::lock_guard<std::mutex> lock(mutex);
+  resolve_locked(true);
+  resolved.clear();
+}
+
+void CudaProfiler::release_resources() {
+  std::lock_guard<std::mutex> lock(mutex);
+  resolve_locked(true);
+  for (auto &entry: contexts) {
+    ContextState *state = entry.second;
+    for (CUevent event: state->spare_events) {
+      CUDA_SAFE_CALL(cuEventDestroy(event));
+    }
+    CUDA_SAFE_CALL(cuEventDestroy(state->epoch));
+    delete state;
+  }
+  contexts.clear();
+}
+
+}
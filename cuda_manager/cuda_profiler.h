@@ -0,0 +1,116 @@
+#ifndef CUDA_PROFILER_H
+#define CUDA_PROFILER_H
+
+#include <cuda.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace cuda_manager {
+
+enum ProfileKind {
+  PROFILE_KERNEL,
+  PROFILE_GRAPH,
+  PROFILE_HOST_TO_DEVICE,
+  PROFILE_DEVICE_TO_HOST,
+  PROFILE_DEVICE_TO_DEVICE,
+  PROFILE_PEER_TO_PEER
+};
+
+// Start of a profiled piece of work, inactive when profiling was off at begin()
+struct ProfileMark {
+  CUevent start = nullptr;
+  bool active() const { return start != nullptr; }
+};
+
+// A piece of work timed on the GPU, times are microseconds on the host steady clock
+struct ProfileRecord {
+  ProfileKind kind;
+  std::string name;           // Kernel function name, or a description of the copy
+  int device;
+  CUstream stream;
+  int stream_index;           // Order in which the stream was first seen on its device
+  size_t bytes;              // Copies only
+  std::vector<int> buffer_ids;
+  double start_us;
+  double duration_us;
+};
+
+/*! \brief Opt-in GPU timeline of launches and copies.
+ * Work is bracketed by a pair of CUevents recorded on its stream, elapsed times are only read
+ * when records are resolved, so profiling adds two event records per launch or copy and never waits.
+ * Every context gets an epoch event whose host time is known, GPU times are placed on the host
+ * timeline relative to it. The epoch moves to the end of the latest resolved record, so elapsed times
+ * are measured over short spans and keep their precision however long the process runs. Disabled, begin() costs a relaxed load.
+ */
+class CudaProfiler {
+private:
+  struct ContextState {
+    CUdevice device;
+    CUevent epoch;          // Completed event recorded at epoch_us, the end of the latest resolved record
+    double epoch_us;
+    std::vector<CUevent> spare_events;
+    std::map<CUstream, int> streams; // Index of every stream seen, in order of appearance
+  };
+
+  struct PendingRecord {
+    ContextState *state;
+    CUevent start;
+    CUevent end;
+    ProfileRecord record;
+  };
+
+  std::atomic<bool> enabled;
+  std::mutex mutex; // Guards everything below
+  std::map<CUcontext, ContextState *> contexts;
+  std::map<CUfunction, std::string> function_names;
+  std::vector<PendingRecord> pending;
+  std::vector<ProfileRecord> resolved;
+
+  ContextState *get_state(CUcontext context);
+  CUevent acquire_event(ContextState *state);
+  void finish(ProfileMark &mark, CUstream stream, ProfileRecord &record);
+  // Move completed pending records to resolved, or all of them if wait is set, mutex must be held
+  void resolve_locked(bool wait);
+
+public:
+  // Records are resolved without being asked once this many are pending, so events get reused
+  static const size_t RESOLVE_BATCH = 256;
+
+  CudaProfiler(): enabled(false) {}
+  ~CudaProfiler() {}
+
+  void set_enabled(bool value) { enabled.store(value, std::memory_order_relaxed); }
+  bool is_enabled() const { return enabled.load(std::memory_order_relaxed); }
+
+  // Name shown for launches of function
+  void set_function_name(CUfunction function, const std::string &name);
+
+  // Record the start of work queued next on stream, in the current context
+  ProfileMark begin(CUstream stream);
+  // Record the end of a kernel launch started at mark, in the same context
+  void end_launch(ProfileMark &mark, CUstream stream, CUfunction function, const std::vector<int> &buffer_ids);
+  void end_graph(ProfileMark &mark, CUstream stream, int node_count);
+  void end_copy(ProfileMark &mark, CUstream stream, ProfileKind kind, int buffer_id, size_t bytes);
+
+  // Resolve every record, waiting for the work still running, and return them in start order
+  std::vector<ProfileRecord> get_records();
+  /*! \brief Timeline in the Chrome trace event format, loadable in chrome://tracing or Perfetto.
+   * Devices are processes and streams are threads, args carry buffer ids and copy sizes.
+   */
+  std::string to_chrome_trace();
+  bool write_chrome_trace(const char *path);
+  // Drop every record, waiting for the work still running
+  void clear();
+
+  // Destroy the events, has to be called while every context is still alive
+  void release_resources();
+};
+
+}
+
+#endif
@@ -0,0 +1,107 @@
+#include "cuda_staging_pool.h"
+#include "cuda_common.h"
+#include "cuda_log.h"
+#include <assert.h>
+#include <string.h>
+
+namespace cuda_manager {
+
+void CudaStagingPool::allocate() {
+  buffers.resize(buffer_count);
+  for (StagingBuffer &buffer: buffers) {
+    buffer.pool = this;
+    buffer.copy_dst = nullptr;
+    buffer.copy_size = 0;
+    CUDA_SAFE_CALL(cuMemHostAlloc(&buffer.h_ptr, chunk_size, CU_MEMHOSTALLOC_PORTABLE));
+    free_buffers.push_back(&buffer);
+  }
+  CUDA_LOG_INFO("[Staging pool] Allocated %u page-locked buffers of %zu bytes", buffer_count, chunk_size);
+}
+
+void CudaStagingPool::destroy() {
+  std::lock_guard<std::mutex> lock(mutex);
+  assert(free_buffers.size() == buffers.size() && "Staging buffers still in use");
+
+  for (StagingBuffer &buffer: buffers) {
+    CUDA_SAFE_CALL(cuMemFreeHost(buffer.h_ptr));
+  }
+  buffers.clear();
+  free_buffers.clear();
+}
+
+StagingBuffer *CudaStagingPool::acquire() {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (buffers.empty()) allocate();
+
+  buffer_released.wait(lock, [this]() { return !free_buffers.empty(); });
+  StagingBuffer *buffer = free_buffers.back();
+  free_buffers.pop_back();
+  return buffer;
+}
+
+void CudaStagingPool::release(StagingBuffer *buffer) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    free_buffers.push_back(buffer);
+  }
+  buffer_released.notify_one();
+}
+
+// Host functions queued behind the copy of each chunk
+static void release_staging_buffer(void *data) {
+  StagingBuffer *buffer = (StagingBuffer *) data;
+  buffer->pool->release(buffer);
+}
+
+static void finish_staged_read(void *data) {
+  StagingBuffer *buffer = (StagingBuffer *) data;
+  memcpy(buffer->copy_dst, buffer->h_ptr, buffer->copy_size);
+  buffer->pool->release(buffer);
+}
+
+void CudaStagingPool::write_async(CUdeviceptr d_ptr, const void *data, size_t size, CUstream stream) {
+  const char *src = (const char *) data;
+  for (size_t offset = 0; offset < size; offset += chunk_size) {
+    size_t chunk = size - offset < chunk_size ? size - offset : chunk_size;
+
+    // Filling a buffer overlaps with the DMA of the previous ones
+    StagingBuffer *buffer = acquire();
+    memcpy(buffer->h_ptr, src + offset, chunk);
+    CUDA_SAFE_CALL(cuMemcpyHtoDAsync(d_ptr + offset, buffer->h_ptr, chunk, stream));
+    CUDA_SAFE_CALL(cuLaunchHostFunc(stream, release_staging_buffer, buffer));
+  }
+}
+
+void CudaStagingPool::read_async(void *buf, CUdeviceptr d_ptr, size_t size, CUstream stream) {
+  char *dst = (char *) buf;
+  for (size_t offset = 0; offset < size; offset += chunk_size) {
+    size_t chunk = size - offset < chunk_size ? size - offset : chunk_size;
+
+    StagingBuffer *buffer = acquire();
+    buffer->copy_dst = dst + offset;
+    buffer->copy_size = chunk;
+    CUDA_SAFE_CALL(cuMemcpyDtoHAsync(buffer->h_ptr, d_ptr + offset, chunk, stream));
+    CUDA_SAFE_CALL(cuLaunchHostFunc(stream, finish_staged_read, buffer));
+  }
+}
+
+void CudaStagingPool::copy_async(CUcontext dst_context, CUdeviceptr dst, CUstream dst_stream,
+    CUcontext src_context, CUdeviceptr src, CUstream src_stream, size_t size) {
+  for (size_t offset = 0; offset < size; offset += chunk_size) {
+    size_t chunk = size - offset < chunk_size ? size - offset : chunk_size;
+
+    StagingBuffer *buffer = acquire();
+    {
+      ScopedContext scoped_context(src_context);
+      CUDA_SAFE_CALL(cuMemcpyDtoHAsync(buffer->h_ptr, src + offset, chunk, src_stream));
+      CUDA_SAFE_CALL(cuStreamSynchronize(src_stream));
+    }
+    {
+      ScopedContext scoped_context(dst_context);
+      CUDA_SAFE_CALL(cuMemcpyHtoDAsync(dst + offset, buffer->h_ptr, chunk, dst_stream));
+      CUDA_SAFE_CALL(cuLaunchHostFunc(dst_stream, release_staging_buffer, buffer));
+    }
+  }
+}
+
+}
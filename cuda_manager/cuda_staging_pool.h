@@ -0,0 +1,75 @@
+#ifndef CUDA_STAGING_POOL_H
+#define CUDA_STAGING_POOL_H
+
+#include <cuda.h>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+namespace cuda_manager {
+
+class CudaStagingPool;
+
+// A page-locked host buffer used as an intermediate step of host <-> device copies
+struct StagingBuffer {
+  CudaStagingPool *pool;
+  void *h_ptr;
+  // Pending host side copy for device to host transfers, done once the DMA into h_ptr completes
+  void *copy_dst;
+  size_t copy_size;
+};
+
+/*! \brief A fixed set of page-locked host buffers reused across transfers.
+ * Buffers are allocated with cuMemHostAlloc on first use and are portable, so any context can use them.
+ * A buffer is handed out by acquire() and given back by a host function queued behind the copy
+ * that uses it, so it is never reused while the DMA engine may still be reading or writing it.
+ */
+class CudaStagingPool {
+private:
+  size_t chunk_size;
+  unsigned int buffer_count;
+  std::vector<StagingBuffer> buffers;
+  std::vector<StagingBuffer *> free_buffers;
+  std::mutex mutex;
+  std::condition_variable buffer_released;
+
+  void allocate();
+
+public:
+  static const size_t DEFAULT_CHUNK_SIZE = 4 * 1024 * 1024;
+  static const unsigned int DEFAULT_BUFFER_COUNT = 4;
+
+  CudaStagingPool(size_t chunk_size = DEFAULT_CHUNK_SIZE, unsigned int buffer_count = DEFAULT_BUFFER_COUNT):
+    chunk_size(chunk_size), buffer_count(buffer_count) {}
+  ~CudaStagingPool() {}
+
+  // Free the page-locked buffers, no transfer may be in flight
+  void destroy();
+
+  // Get a free buffer, blocks until one is released if all of them are in use
+  StagingBuffer *acquire();
+  void release(StagingBuffer *buffer);
+
+  size_t get_chunk_size() const { return chunk_size; }
+
+  /*! \brief Queue a host to device copy on stream, chunked through the staging buffers.
+   * data is fully consumed when this returns, the copy itself may still be in flight.
+   */
+  void write_async(CUdeviceptr d_ptr, const void *data, size_t size, CUstream stream);
+
+  /*! \brief Queue a device to host copy on stream, chunked through the staging buffers.
+   * buf must stay valid until the work queued on stream completes.
+   */
+  void read_async(void *buf, CUdeviceptr d_ptr, size_t size, CUstream stream);
+
+  /*! \brief Copy between the memory of two contexts through the staging buffers, for devices without peer access.
+   * Every chunk is read on src_stream and written on dst_stream once the read completed, so reading a chunk
+   * overlaps with writing the previous one. Returns once the last write is queued on dst_stream.
+   */
+  void copy_async(CUcontext dst_context, CUdeviceptr dst, CUstream dst_stream,
+      CUcontext src_context, CUdeviceptr src, CUstream src_stream, size_t size);
+};
+
+}
+
+#endif
@@ -0,0 +1,36 @@
+#include "cuda_stream_pool.h"
+#include "cuda_common.h"
+#include <assert.h>
+
+namespace cuda_manager {
+
+void CudaStreamPool::create(unsigned int stream_count) {
+  assert(stream_count > 0 && "Stream pool needs at least one stream");
+
+  streams.resize(stream_count);
+  for (CUstream &stream: streams) {
+    CUDA_SAFE_CALL(cuStreamCreate(&stream, CU_STREAM_DEFAULT));
+  }
+
+  // Callbacks only wait on events, they must not be held back by NULL stream work
+  CUDA_SAFE_CALL(cuStreamCreate(&callback_stream, CU_STREAM_NON_BLOCKING));
+}
+
+void CudaStreamPool::destroy() {
+  for (CUstream stream: streams) {
+    CUDA_SAFE_CALL(cuStreamDestroy(stream));
+  }
+  streams.clear();
+
+  if (callback_stream != nullptr) {
+    CUDA_SAFE_CALL(cuStreamDestroy(callback_stream));
+    callback_stream = nullptr;
+  }
+}
+
+CUstream CudaStreamPool::next_stream() {
+  if (!round_robin.load(std::memory_order_relaxed)) return streams[0];
+  return streams[next_index++ % streams.size()];
+}
+
+}
@@ -0,0 +1,42 @@
+#ifndef CUDA_STREAM_POOL_H
+#define CUDA_STREAM_POOL_H
+
+#include <cuda.h>
+#include <atomic>
+#include <vector>
+
+namespace cuda_manager {
+
+/*! \brief A fixed set of streams of a single context.
+ * next_stream hands out the first stream only, so work stays in issue order, unless round robin
+ * is enabled. Streams are created as blocking streams, so they stay ordered with the synchronous
+ * copies CudaMemoryManager issues on the NULL stream.
+ */
+class CudaStreamPool {
+private:
+  std::vector<CUstream> streams;
+  CUstream callback_stream = nullptr;
+  std::atomic<unsigned int> next_index;
+  std::atomic<bool> round_robin;
+
+public:
+  static const unsigned int DEFAULT_STREAM_COUNT = 4;
+
+  CudaStreamPool(): next_index(0), round_robin(false) {}
+  ~CudaStreamPool() {}
+
+  // Create the streams in the current context
+  void create(unsigned int stream_count = DEFAULT_STREAM_COUNT);
+  // Destroy the streams, the owning context has to be current
+  void destroy();
+
+  // Hand out every stream in turn, work on different streams may run in any order
+  void set_round_robin(bool enabled) { round_robin = enabled; }
+  CUstream next_stream();
+  CUstream get_stream(unsigned int index) const { return streams[index]; }
+  CUstream get_callback_stream() const { return callback_stream; }
+};
+
+}
+
+#endif
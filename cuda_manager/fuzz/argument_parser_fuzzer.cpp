@@ -0,0 +1,47 @@
+// libFuzzer harness for parse_arguments, the text format the front-end submits launches in.
+// Every input must parse without reading past its length or writing past the output buffer,
+// and whatever parses must format back to a request that parses to the same arguments.
+//
+// Build with -DBUILD_FUZZERS=ON using clang, then run e.g.
+//   ./argument_parser_fuzzer -max_len=256 corpus/
+
+#include <string>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cuda_argument_parser.h"
+
+using namespace cuda_manager;
+
+// Small enough that long inputs run out of output space
+#define OUTPUT_SIZE 512
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  // Exact size copy so ASan catches reads past the end
+  char *input = (char *) malloc(size);
+  memcpy(input, data, size);
+
+  alignas(8) char output[OUTPUT_SIZE];
+  ParsedArguments parsed;
+  ParseError error = parse_arguments(input, size, output, OUTPUT_SIZE, &parsed);
+
+  if (error.code == PARSE_OK) {
+    if (parsed.size > OUTPUT_SIZE) abort();
+
+    std::string formatted = args_to_string(parsed);
+
+    alignas(8) char reparsed_output[OUTPUT_SIZE * 2];
+    ParsedArguments reparsed;
+    ParseError reparse_error = parse_arguments(formatted.c_str(), formatted.size(), reparsed_output,
+        sizeof(reparsed_output), &reparsed);
+    if (reparse_error.code != PARSE_OK) abort();
+    if (reparsed.arg_count != parsed.arg_count || reparsed.kernel_id != parsed.kernel_id) abort();
+    if (args_to_string(reparsed) != formatted) abort();
+  } else {
+    if (error.position > size) abort();
+    if (parse_error_string(error.code) == nullptr) abort();
+  }
+
+  free(input);
+  return 0;
+}
@@ -0,0 +1,175 @@
+#ifndef HANDLE_TABLE_H
+#define HANDLE_TABLE_H
+
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace cuda_manager {
+
+/*! \brief A table of values keyed by client chosen int ids, tuned for lookups.
+ * Values live in a dense slot array allocated in fixed size chunks, so references stay valid
+ * until the value is erased. Ids map to slots through an open addressing (linear probing) index
+ * of slot numbers, which keeps a lookup to a hash, a couple of adjacent probes and one slot access.
+ * \note Not thread safe
+ */
+template <typename T>
+class HandleTable {
+private:
+  static const size_t CHUNK_SIZE = 256;
+  static const int32_t EMPTY = -1;
+  static const int32_t TOMBSTONE = -2;
+
+  struct Slot {
+    int id;
+    T value;
+  };
+
+  std::vector<std::unique_ptr<Slot[]>> chunks;
+  std::vector<int32_t> free_slots;
+  size_t slot_count = 0;
+
+  std::vector<int32_t> index; // Slot number per bucket, or EMPTY/TOMBSTONE
+  size_t mask = 0;
+  size_t count = 0;
+  size_t tombstones = 0;
+
+  Slot &slot(int32_t slot_number) {
+    return chunks[slot_number / CHUNK_SIZE][slot_number % CHUNK_SIZE];
+  }
+
+  static size_t hash(int id) {
+    // Fibonacci hashing spreads sequential ids across the index
+    return (size_t) ((uint32_t) id * 2654435769u);
+  }
+
+  // Bucket holding id, or the EMPTY bucket ending its probe sequence
+  size_t find_bucket(int id) {
+    size_t bucket = hash(id) & mask;
+    while (index[bucket] != EMPTY) {
+      if (index[bucket] != TOMBSTONE && slot(index[bucket]).id == id) return bucket;
+      bucket = (bucket + 1) & mask;
+    }
+    return bucket;
+  }
+
+  void rehash(size_t capacity) {
+    std::vector<int32_t> old_index;
+    old_index.swap(index);
+    index.assign(capacity, EMPTY);
+    mask = capacity - 1;
+    tombstones = 0;
+
+    for (int32_t slot_number: old_index) {
+      if (slot_number < 0) continue;
+      size_t bucket = hash(slot(slot_number).id) & mask;
+      while (index[bucket] != EMPTY) bucket = (bucket + 1) & mask;
+      index[bucket] = slot_number;
+    }
+  }
+
+public:
+  HandleTable() {
+    rehash(16);
+  }
+
+  // \return the value for id, nullptr if there is none
+  T *find(int id) {
+    int32_t slot_number = index[find_bucket(id)];
+    return slot_number == EMPTY ? nullptr : &slot(slot_number).value;
+  }
+
+  /*! \brief Insert a value for id, nothing is inserted if id already exists.
+   * \return true if the value was inserted
+   */
+  bool insert(int id, const T &value) {
+    // Keep the load, tombstones included, under 3/4
+    if ((count + tombstones + 1) * 4 > index.size() * 3) {
+      rehash(count * 2 >= index.size() ? index.size() * 2 : index.size());
+    }
+
+    size_t bucket = find_bucket(id);
+    if (index[bucket] != EMPTY) return false;
+
+    int32_t slot_number;
+    if (!free_slots.empty()) {
+      slot_number = free_slots.back();
+      free_slots.pop_back();
+    } else {
+      if (slot_count % CHUNK_SIZE == 0) chunks.emplace_back(new Slot[CHUNK_SIZE]);
+      slot_number = (int32_t) slot_count++;
+    }
+
+    slot(slot_number).id = id;
+    slot(slot_number).value = value;
+    index[bucket] = slot_number;
+    ++count;
+    return true;
+  }
+
+  // \return true if id existed
+  bool erase(int id) {
+    size_t bucket = find_bucket(id);
+    if (index[bucket] == EMPTY) return false;
+
+    free_slots.push_back(index[bucket]);
+    slot(index[bucket]).value = T();
+    index[bucket] = TOMBSTONE;
+    --count;
+    ++tombstones;
+    return true;
+  }
+
+  size_t size() const { return count; }
+};
+
+template <typename T> const size_t HandleTable<T>::CHUNK_SIZE;
+template <typename T> const int32_t HandleTable<T>::EMPTY;
+template <typename T> const int32_t HandleTable<T>::TOMBSTONE;
+
+/*! \brief A HandleTable split in shards, each behind its own reader-writer lock.
+ * Lookups only take a shared lock on one shard, so concurrent lookups never contend and
+ * inserts or erases only block the ids of their own shard.
+ * Returned pointers stay valid without the lock, until the value is erased.
+ */
+template <typename T, size_t SHARD_BITS = 4>
+class ShardedHandleTable {
+private:
+  struct alignas(64) Shard {
+    HandleTable<T> table;
+    std::shared_timed_mutex mutex;
+  };
+
+  Shard shards[1 << SHARD_BITS];
+
+  Shard &shard(int id) {
+    // Top bits of the Fibonacci hash, the table of each shard uses the low ones
+    return shards[((uint32_t) id * 2654435769u) >> (32 - SHARD_BITS)];
+  }
+
+public:
+  T *find(int id) {
+    Shard &s = shard(id);
+    std::shared_lock<std::shared_timed_mutex> lock(s.mutex);
+    return s.table.find(id);
+  }
+
+  bool insert(int id, const T &value) {
+    Shard &s = shard(id);
+    std::lock_guard<std::shared_timed_mutex> lock(s.mutex);
+    return s.table.insert(id, value);
+  }
+
+  bool erase(int id) {
+    Shard &s = shard(id);
+    std::lock_guard<std::shared_timed_mutex> lock(s.mutex);
+    return s.table.erase(id);
+  }
+};
+
+}
+
+#endif
@@ -2,12 +2,14 @@
 #define KERNEL_ARGUMENTS_H
 
 #include <stdlib.h>
+#include <stdint.h>
 
 namespace cuda_manager {
 
 enum ArgType {
   BUFFER,
-  SCALAR
+  SCALAR,
+  VALUE
 };
 
 struct Arg {
@@ -19,6 +21,27 @@ struct ScalarArg {
   void *ptr;
 };
 
+enum ScalarType {
+  I32,
+  I64,
+  F32,
+  F64
+};
+
+// A scalar stored in the argument itself, so it does not have to outlive the call
+struct ValueArg {
+  ArgType type;
+  ScalarType scalar_type;
+  uint32_t size; // Bytes of value in use
+  union {
+    int32_t i32;
+    int64_t i64;
+    float f32;
+    double f64;
+    unsigned char bytes[8];
+  } value;
+};
+
 struct BufferArg {
   ArgType type;
   int id;
@@ -0,0 +1,71 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <atomic>
+#include "cuda_common.h"
+
+namespace cuda_manager {
+
+// Link embedded in every queued item, items are owned by the producer and never allocated by the queue
+struct MpscNode {
+  std::atomic<MpscNode *> next;
+
+  MpscNode(): next(nullptr) {}
+};
+
+/*! \brief Intrusive multi producer, single consumer queue (Vyukov's algorithm).
+ * push() is wait free, a single atomic exchange. pop() is lock free and only ever called from
+ * the consumer thread. Pushed nodes must stay alive until they are popped.
+ */
+class MpscQueue {
+private:
+  CachePadded<std::atomic<MpscNode *>> head; // Last pushed node, shared by producers
+  MpscNode *tail;                            // Next node to pop, consumer only
+  MpscNode stub;                             // Keeps the queue non empty so push never touches tail
+
+public:
+  MpscQueue(): head(&stub), tail(&stub) {}
+
+  MpscQueue(const MpscQueue &) = delete;
+  MpscQueue &operator=(const MpscQueue &) = delete;
+
+  void push(MpscNode *node) {
+    node->next.store(nullptr, std::memory_order_relaxed);
+    MpscNode *prev = head.value.exchange(node, std::memory_order_acq_rel);
+    // Between the exchange and this store the node is unreachable from tail, pop() sees the queue as empty
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  // \return the oldest node, nullptr if the queue is empty or the next push is not linked yet
+  MpscNode *pop() {
+    MpscNode *first = tail;
+    MpscNode *next = first->next.load(std::memory_order_acquire);
+
+    if (first == &stub) {
+      if (next == nullptr) return nullptr;
+      tail = next;
+      first = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next != nullptr) {
+      tail = next;
+      return first;
+    }
+
+    // first is the last linked node, it can only be handed out once a successor exists
+    if (first != head.value.load(std::memory_order_acquire)) return nullptr;
+    push(&stub);
+
+    next = first->next.load(std::memory_order_acquire);
+    if (next != nullptr) {
+      tail = next;
+      return first;
+    }
+    return nullptr;
+  }
+};
+
+}
+
+#endif
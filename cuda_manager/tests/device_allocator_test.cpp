@@ -0,0 +1,290 @@
+// Bookkeeping of DeviceAllocator against a fake slab backend: size classes, best fit splitting,
+// coalescing, trimming and the reported statistics. Runs on the host only.
+
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include "cuda_device_allocator.h"
+
+using namespace cuda_manager;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      exit(1); \
+    } \
+  } while (0)
+
+static const size_t KB = 1024;
+static const size_t MB = 1024 * 1024;
+
+// Hands out slabs back to back, so coalescing across slabs would go unnoticed without the slab check
+class FakeBackend: public SlabBackend {
+public:
+  std::map<uint64_t, size_t> slabs; // Live slabs by address
+  size_t capacity;                  // Most bytes live at once
+  size_t live_bytes = 0;
+  uint64_t next_address = 0x100000000;
+
+  FakeBackend(size_t capacity = (size_t) -1): capacity(capacity) {}
+
+  bool allocate_slab(size_t size, uint64_t *address) override {
+    if (live_bytes + size > capacity) return false;
+    *address = next_address;
+    next_address += size;
+    slabs[*address] = size;
+    live_bytes += size;
+    return true;
+  }
+
+  void free_slab(uint64_t address, size_t size) override {
+    std::map<uint64_t, size_t>::iterator it = slabs.find(address);
+    CHECK(it != slabs.end() && it->second == size);
+    slabs.erase(it);
+    live_bytes -= size;
+  }
+};
+
+static void test_size_classes() {
+  FakeBackend backend;
+  DeviceAllocator allocator(&backend);
+
+  // Rounded up to the smallest class, blocks of one class share a slab in address order
+  uint64_t a, b, c;
+  CHECK(allocator.allocate(1, &a));
+  CHECK(allocator.allocate(DeviceAllocator::MIN_BLOCK_SIZE, &b));
+  CHECK(b == a + DeviceAllocator::MIN_BLOCK_SIZE);
+  CHECK(backend.slabs.size() == 1);
+
+  // The next class gets a slab of its own
+  CHECK(allocator.allocate(DeviceAllocator::MIN_BLOCK_SIZE + 1, &c));
+  CHECK(backend.slabs.size() == 2);
+  CHECK(backend.slabs.count(c) == 1);
+
+  uint64_t largest;
+  CHECK(allocator.allocate(DeviceAllocator::SMALL_LIMIT, &largest));
+  CHECK(backend.slabs.size() == 3);
+  CHECK(backend.slabs[largest] == DeviceAllocator::SMALL_SLAB_SIZE);
+
+  AllocatorStats stats = allocator.get_stats();
+  CHECK(stats.allocations == 4);
+  CHECK(stats.slab_allocations == 3);
+  CHECK(stats.cache_hits == 1);
+  CHECK(stats.reserved_bytes == 3 * DeviceAllocator::SMALL_SLAB_SIZE);
+  CHECK(stats.used_bytes == 2 * 256 + 512 + DeviceAllocator::SMALL_LIMIT);
+  // Small classes do not count towards the large pool
+  CHECK(stats.largest_free_block == 0);
+  CHECK(stats.fragmentation == 0.0);
+
+  // A freed block is the next one handed out in its class
+  allocator.free(a);
+  uint64_t reused;
+  CHECK(allocator.allocate(100, &reused));
+  CHECK(reused == a);
+  CHECK(allocator.get_stats().slab_allocations == 3);
+
+  // A second block of SMALL_LIMIT fits the slab, a third needs a new one
+  uint64_t second, third;
+  CHECK(allocator.allocate(DeviceAllocator::SMALL_LIMIT, &second));
+  CHECK(second == largest + DeviceAllocator::SMALL_LIMIT);
+  CHECK(allocator.allocate(DeviceAllocator::SMALL_LIMIT, &third));
+  CHECK(allocator.get_stats().slab_allocations == 4);
+
+  allocator.release_all();
+  CHECK(backend.slabs.empty());
+}
+
+static void test_best_fit_and_coalescing() {
+  FakeBackend backend;
+  DeviceAllocator allocator(&backend);
+
+  // Large requests are rounded to MIN_BLOCK_SIZE and split off the front of the slab
+  uint64_t a, b, c;
+  CHECK(allocator.allocate(4 * MB, &a));
+  CHECK(backend.slabs.size() == 1);
+  CHECK(backend.slabs[a] == DeviceAllocator::LARGE_SLAB_SIZE);
+  CHECK(allocator.allocate(4 * MB - 100, &b));
+  CHECK(b == a + 4 * MB);
+  CHECK(allocator.allocate(4 * MB, &c));
+  CHECK(c == b + 4 * MB);
+
+  AllocatorStats stats = allocator.get_stats();
+  CHECK(stats.used_bytes == 12 * MB);
+  CHECK(stats.largest_free_block == 20 * MB);
+  CHECK(stats.fragmentation == 0.0);
+
+  // Best fit takes the hole left by b over the larger tail of the slab
+  allocator.free(b);
+  uint64_t d;
+  CHECK(allocator.allocate(2 * MB, &d));
+  CHECK(d == b);
+
+  // a is not adjacent to a free range, the pool is split into 4 + 2 + 20 MiB
+  allocator.free(a);
+  stats = allocator.get_stats();
+  CHECK(stats.largest_free_block == 20 * MB);
+  CHECK(stats.fragmentation > 0.23 && stats.fragmentation < 0.24); // 1 - 20 / 26
+
+  // d joins a and the rest of b, c then joins everything into the whole slab
+  allocator.free(d);
+  stats = allocator.get_stats();
+  CHECK(stats.largest_free_block == 20 * MB);
+  CHECK(stats.fragmentation > 0.28 && stats.fragmentation < 0.29); // 1 - 20 / 28
+  allocator.free(c);
+  stats = allocator.get_stats();
+  CHECK(stats.largest_free_block == DeviceAllocator::LARGE_SLAB_SIZE);
+  CHECK(stats.fragmentation == 0.0);
+  CHECK(stats.used_bytes == 0);
+  CHECK(stats.deallocations == 4);
+
+  // The coalesced slab serves a request of its full size without a new slab
+  uint64_t whole;
+  CHECK(allocator.allocate(DeviceAllocator::LARGE_SLAB_SIZE, &whole));
+  CHECK(whole == a);
+  CHECK(allocator.get_stats().slab_allocations == 1);
+  allocator.free(whole);
+
+  // Requests over LARGE_SLAB_SIZE get a slab of their own size, rounded to SMALL_SLAB_SIZE
+  uint64_t huge;
+  CHECK(allocator.allocate(DeviceAllocator::LARGE_SLAB_SIZE + 1, &huge));
+  CHECK(backend.slabs[huge] == DeviceAllocator::LARGE_SLAB_SIZE + DeviceAllocator::SMALL_SLAB_SIZE);
+  allocator.free(huge);
+
+  allocator.release_all();
+  CHECK(backend.slabs.empty());
+}
+
+static void test_no_coalescing_across_slabs() {
+  FakeBackend backend;
+  DeviceAllocator allocator(&backend);
+
+  // The backend places the second slab right after the first
+  uint64_t a, b;
+  CHECK(allocator.allocate(DeviceAllocator::LARGE_SLAB_SIZE, &a));
+  CHECK(allocator.allocate(DeviceAllocator::LARGE_SLAB_SIZE, &b));
+  CHECK(b == a + DeviceAllocator::LARGE_SLAB_SIZE);
+
+  allocator.free(a);
+  allocator.free(b);
+  AllocatorStats stats = allocator.get_stats();
+  CHECK(stats.largest_free_block == DeviceAllocator::LARGE_SLAB_SIZE);
+  CHECK(stats.fragmentation == 0.5);
+
+  // Both slabs are still whole, so both are released
+  CHECK(allocator.trim() == 2 * DeviceAllocator::LARGE_SLAB_SIZE);
+  CHECK(backend.slabs.empty());
+}
+
+static void test_trim() {
+  FakeBackend backend;
+  DeviceAllocator allocator(&backend);
+
+  uint64_t small_live, small_freed, large_live, large_freed;
+  CHECK(allocator.allocate(256, &small_live));
+  CHECK(allocator.allocate(64 * KB, &small_freed));
+  CHECK(allocator.allocate(2 * MB, &large_live));
+  CHECK(allocator.allocate(48 * MB, &large_freed));
+  CHECK(backend.slabs.size() == 4);
+  allocator.free(small_freed);
+  allocator.free(large_freed);
+
+  // Only slabs without live allocations go back
+  size_t released = allocator.trim();
+  CHECK(released == DeviceAllocator::SMALL_SLAB_SIZE + 48 * MB);
+  CHECK(backend.slabs.size() == 2);
+  CHECK(backend.slabs.count(small_live) == 1);
+  CHECK(backend.slabs.count(large_live) == 1);
+
+  AllocatorStats stats = allocator.get_stats();
+  CHECK(stats.slab_releases == 2);
+  CHECK(stats.reserved_bytes == DeviceAllocator::SMALL_SLAB_SIZE + DeviceAllocator::LARGE_SLAB_SIZE);
+  CHECK(stats.used_bytes == 256 + 2 * MB);
+  CHECK(stats.largest_free_block == DeviceAllocator::LARGE_SLAB_SIZE - 2 * MB);
+
+  // Blocks of a released slab must not be handed out again
+  uint64_t block;
+  CHECK(allocator.allocate(64 * KB, &block));
+  CHECK(backend.slabs.count(block) == 1);
+  CHECK(allocator.get_stats().slab_allocations == 5);
+
+  // Nothing left to release while everything is live
+  CHECK(allocator.trim() == 0);
+
+  allocator.free(small_live);
+  allocator.free(large_live);
+  allocator.free(block);
+  CHECK(allocator.trim() == 2 * DeviceAllocator::SMALL_SLAB_SIZE + DeviceAllocator::LARGE_SLAB_SIZE);
+  CHECK(backend.slabs.empty());
+  stats = allocator.get_stats();
+  CHECK(stats.reserved_bytes == 0);
+  CHECK(stats.largest_free_block == 0);
+  CHECK(stats.slab_releases == 5);
+}
+
+static void test_exhaustion() {
+  // Room for one large slab only
+  FakeBackend backend(DeviceAllocator::LARGE_SLAB_SIZE);
+  DeviceAllocator allocator(&backend);
+
+  uint64_t small, large;
+  CHECK(allocator.allocate(512, &small));
+  allocator.free(small);
+
+  // The cached small slab is trimmed to make room
+  CHECK(allocator.allocate(DeviceAllocator::LARGE_SLAB_SIZE, &large));
+  AllocatorStats stats = allocator.get_stats();
+  CHECK(stats.slab_releases == 1);
+  CHECK(stats.reserved_bytes == DeviceAllocator::LARGE_SLAB_SIZE);
+
+  // A failed allocation leaves the counters alone
+  uint64_t failed;
+  CHECK(!allocator.allocate(DeviceAllocator::LARGE_SLAB_SIZE, &failed));
+  CHECK(allocator.get_stats().allocations == stats.allocations);
+
+  allocator.free(large);
+  CHECK(allocator.trim() == DeviceAllocator::LARGE_SLAB_SIZE);
+}
+
+static void test_stats() {
+  FakeBackend backend;
+  DeviceAllocator allocator(&backend);
+
+  AllocatorStats stats = allocator.get_stats();
+  CHECK(stats.allocations == 0);
+  CHECK(stats.reserved_bytes == 0);
+  CHECK(stats.fragmentation == 0.0);
+  CHECK(stats.average_allocation_ns == 0.0);
+
+  uint64_t addresses[100];
+  for (int i = 0; i < 100; ++i) {
+    CHECK(allocator.allocate(1000, &addresses[i]));
+  }
+  for (int i = 0; i < 100; ++i) {
+    allocator.free(addresses[i]);
+  }
+
+  // 1000 bytes are served from the 1 KiB class, one slab holds all of them
+  stats = allocator.get_stats();
+  CHECK(stats.allocations == 100);
+  CHECK(stats.deallocations == 100);
+  CHECK(stats.slab_allocations == 1);
+  CHECK(stats.cache_hits == 99);
+  CHECK(stats.used_bytes == 0);
+  CHECK(stats.reserved_bytes == DeviceAllocator::SMALL_SLAB_SIZE);
+  CHECK(stats.average_allocation_ns > 0.0);
+
+  allocator.release_all();
+  CHECK(backend.slabs.empty());
+  CHECK(allocator.get_stats().reserved_bytes == 0);
+}
+
+int main(void) {
+  test_size_classes();
+  test_best_fit_and_coalescing();
+  test_no_coalescing_across_slabs();
+  test_trim();
+  test_exhaustion();
+  test_stats();
+  printf("All device allocator tests passed\n");
+  return 0;
+}